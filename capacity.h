@@ -0,0 +1,256 @@
+#ifndef HTTPMON_CAPACITY_H
+#define HTTPMON_CAPACITY_H
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+/*
+ * Capacity search
+ *
+ * Finds the highest request rate at which a service meets a service-level
+ * objective (SLO), such as "p99<200ms,errors<0.1%": a latency percentile
+ * and an error rate not to exceed. Each tested rate is first given some
+ * report intervals to settle, which are ignored, then measured for some
+ * more. The search doubles the rate until the SLO is violated, then bisects
+ * between the highest rate that met it and the lowest that violated it,
+ * until they are within the requested precision. After each violation, it
+ * backs off: arrivals pause until all queued requests were answered, so
+ * that the backlog of an overload does not spill into the next rate. The
+ * highest rate found to meet the SLO is the knee; the true capacity lies
+ * between it and the lowest rate found to violate it.
+ *
+ * Latencies are taken from the requests that succeeded during measurement,
+ * errors also include arrivals dropped by the client, e.g., because of
+ * --max-backlog.
+ */
+
+struct Slo {
+	double percentile; /*< e.g., 99 */
+	double latency; /*< seconds */
+	double errorRate; /*< fraction of requests */
+};
+
+/* Parse an SLO such as "p99<200ms,errors<0.1%"; throws std::invalid_argument on errors */
+inline Slo parseSlo(const std::string &spec)
+{
+	Slo slo = { 99, INFINITY, INFINITY };
+	bool hasObjective = false;
+	size_t start = 0;
+	while (start <= spec.size()) {
+		size_t end = spec.find(',', start);
+		if (end == std::string::npos)
+			end = spec.size();
+		std::string objective = spec.substr(start, end - start);
+		start = end + 1;
+
+		size_t less = objective.find('<');
+		if (less == std::string::npos)
+			throw std::invalid_argument("expected pNN<LATENCY or errors<PERCENT instead of '" + objective + "'");
+		std::string metric = objective.substr(0, less);
+		std::string value = objective.substr(less + 1);
+		char *unit;
+		double bound = strtod(value.c_str(), &unit);
+		if (unit == value.c_str() || bound <= 0)
+			throw std::invalid_argument("invalid bound in '" + objective + "'");
+
+		if (metric.size() > 1 && metric[0] == 'p') {
+			char *rest;
+			slo.percentile = strtod(metric.c_str() + 1, &rest);
+			if (*rest != '\0' || slo.percentile <= 0 || slo.percentile >= 100)
+				throw std::invalid_argument("invalid percentile in '" + objective + "'");
+			std::string u = unit;
+			if (u == "s")
+				slo.latency = bound;
+			else if (u == "ms")
+				slo.latency = bound / 1e3;
+			else if (u == "us")
+				slo.latency = bound / 1e6;
+			else
+				throw std::invalid_argument("latency in '" + objective + "' needs a unit: s, ms or us");
+		}
+		else if (metric == "errors") {
+			if (std::string(unit) != "%")
+				throw std::invalid_argument("error rate in '" + objective + "' must be given in %");
+			slo.errorRate = bound / 100;
+		}
+		else
+			throw std::invalid_argument("unknown metric '" + metric + "'");
+		hasObjective = true;
+	}
+	if (!hasObjective)
+		throw std::invalid_argument("empty SLO");
+	return slo;
+}
+
+class CapacitySearch {
+public:
+	CapacitySearch(const Slo &slo, double startRate, double precision,
+		int settleIntervals, int measureIntervals, int histogramDigits) :
+		slo(slo),
+		precision(precision),
+		settleIntervals(settleIntervals),
+		measureIntervals(measureIntervals),
+		currentRate(startRate),
+		lower(0),
+		upper(INFINITY),
+		backingOff(false),
+		nextRate(0),
+		numIntervals(0),
+		window(histogramDigits),
+		numRequests(0),
+		numErrors(0)
+	{
+	}
+
+	/* Rate to generate now, in requests per second */
+	double rate() const { return currentRate; }
+
+	/*
+	 * Account for the statistics of one report interval, at the end of
+	 * which queueLength requests were in flight. Once a rate has been
+	 * measured, sets log to a line describing it. Returns true if rate()
+	 * changed. Sets done once the search is over.
+	 */
+	bool addInterval(const Histogram &latencies, uint64_t requests, uint64_t errors, int queueLength,
+		std::string &log, bool &done)
+	{
+		done = false;
+		if (backingOff) {
+			if (requests > 0 || queueLength > 0)
+				return false; /* still draining */
+			backingOff = false;
+			setRate(nextRate);
+			return true;
+		}
+		if (++numIntervals <= settleIntervals)
+			return false;
+
+		window.add(latencies);
+		numRequests += requests;
+		numErrors += errors;
+		if (numIntervals < settleIntervals + measureIntervals)
+			return false;
+
+		/* Evaluate the SLO at this rate */
+		double latency, latencyLow, latencyHigh;
+		latencyBounds(latency, latencyLow, latencyHigh);
+		double errorRate = numRequests ? (double)numErrors / numRequests : 1;
+		bool met = numRequests > 0 && latency <= slo.latency && errorRate <= slo.errorRate;
+		log = formatMeasurement(met ? "met" : "violated", currentRate, latency, latencyLow, latencyHigh, errorRate);
+		if (met) {
+			lower = currentRate;
+			kneeLog = formatMeasurement("knee", currentRate, latency, latencyLow, latencyHigh, errorRate);
+		}
+		else
+			upper = currentRate;
+
+		/* Decide where to go next */
+		if (std::isinf(upper)) {
+			setRate(currentRate * 2);
+			return true;
+		}
+		if (upper - lower <= precision * lower || upper <= MinRate) {
+			done = true;
+			return false;
+		}
+		double bisected = (lower > 0) ? (lower + upper) / 2 : upper / 2;
+		if (!met) {
+			backingOff = true;
+			nextRate = bisected;
+			setRate(0);
+		}
+		else
+			setRate(bisected);
+		return true;
+	}
+
+	/* Summary of the result, once done */
+	std::string summary() const
+	{
+		if (lower == 0)
+			return strprintf("knee=0rps kneeUpper=%.1frps slo=unreachable", upper);
+		return kneeLog + strprintf(" kneeLower=%.1frps kneeUpper=%.1frps", lower, upper);
+	}
+
+private:
+	static constexpr double MinRate = 0.01; /* below, give up: the SLO cannot be met */
+
+	void setRate(double rate)
+	{
+		currentRate = rate;
+		numIntervals = 0;
+		window.reset();
+		numRequests = numErrors = 0;
+	}
+
+	/*
+	 * The latency percentile measured, with a 95% confidence interval: among
+	 * n requests, the rank of the q-quantile is approximately normally
+	 * distributed with standard deviation sqrt(n q (1 - q)).
+	 */
+	void latencyBounds(double &latency, double &low, double &high) const
+	{
+		double n = window.count();
+		if (n == 0) {
+			latency = low = high = NAN;
+			return;
+		}
+		double q = slo.percentile / 100;
+		double margin = 1.96 * sqrt(q * (1 - q) / n) * 100;
+		latency = window.valueAtPercentile(slo.percentile) / 1e9;
+		low = window.valueAtPercentile(std::max(0.0, slo.percentile - margin)) / 1e9;
+		high = window.valueAtPercentile(std::min(100.0, slo.percentile + margin)) / 1e9;
+	}
+
+	/* Upper bound of the 95% Wilson score interval of the error rate */
+	double errorRateHigh(double errorRate) const
+	{
+		double n = numRequests, z = 1.96;
+		if (n == 0)
+			return 1;
+		return (errorRate + z * z / (2 * n) + z * sqrt(errorRate * (1 - errorRate) / n + z * z / (4 * n * n))) /
+			(1 + z * z / n);
+	}
+
+	std::string formatMeasurement(const char *verdict, double rate, double latency, double latencyLow,
+		double latencyHigh, double errorRate) const
+	{
+		return strprintf("search=%s rate=%.1frps requests=%llu sloLatency=%.1fms sloLatencyLow=%.1fms "
+			"sloLatencyHigh=%.1fms errorRate=%.3f%% errorRateHigh=%.3f%%",
+			verdict, rate, (unsigned long long)numRequests, latency * 1e3, latencyLow * 1e3,
+			latencyHigh * 1e3, errorRate * 100, errorRateHigh(errorRate) * 100);
+	}
+
+	template<typename... Args>
+	static std::string strprintf(const char *format, Args... args)
+	{
+		char buf[512];
+		snprintf(buf, sizeof(buf), format, args...);
+		return buf;
+	}
+
+	const Slo slo;
+	const double precision; /* stop once the knee is known within this fraction */
+	const int settleIntervals, measureIntervals;
+
+	double currentRate;
+	double lower; /* highest rate that met the SLO, 0 if none yet */
+	double upper; /* lowest rate that violated it, infinity if none yet */
+	bool backingOff; /* paused, to drain queues before trying nextRate */
+	double nextRate;
+	std::string kneeLog; /* measurement at lower */
+
+	int numIntervals; /* since the rate was set */
+	Histogram window; /* latencies measured at this rate, in nanoseconds */
+	uint64_t numRequests;
+	uint64_t numErrors;
+};
+
+#endif
@@ -0,0 +1,119 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "classifier.h"
+
+/*
+ * Microbenchmark of the response body classifier: measures how many GB/s
+ * each implementation supporting the markers scans, compared with looking
+ * for each marker byte with memchr, as httpmon used to. With the default
+ * single-byte markers, the classifier's own memchr implementation is
+ * measured first, since httpmon picks it by default. Bodies contain no
+ * marker, which is the worst case, since scanning cannot stop early. They
+ * are small enough to stay in cache, like chunks CURL just received. Before measuring, checks
+ * that all implementations agree, also on markers spanning chunks.
+ */
+
+const size_t BodySize = 1 << 20;
+const size_t ChunkSize = 16 << 10; /* as CURL_MAX_WRITE_SIZE */
+const int BodiesPerRun = 256;
+const int Repetitions = 5;
+
+/* Best throughput over several repetitions, in GB/s */
+double measure(const std::function<void(const char *, size_t)> &scanChunk, const std::vector<char> &body)
+{
+	double best = 0;
+	for (int r = 0; r < Repetitions; r++) {
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < BodiesPerRun; i++) {
+			for (size_t pos = 0; pos < body.size(); pos += ChunkSize)
+				scanChunk(body.data() + pos, std::min(ChunkSize, body.size() - pos));
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		best = std::max(best, (double)body.size() * BodiesPerRun / elapsed.count() / 1e9);
+	}
+	return best;
+}
+
+/* Classify text split in chunks of the given size */
+uint32_t classifyInChunks(const BodyClassifier &classifier, const std::string &text, size_t chunkSize)
+{
+	BodyClassifier::State state;
+	classifier.reset(state);
+	for (size_t pos = 0; pos < text.size(); pos += chunkSize)
+		classifier.classify(state, text.data() + pos, std::min(chunkSize, text.size() - pos));
+	return state.found;
+}
+
+bool selfTest(const char *spec)
+{
+	std::vector<std::string> markers = BodyClassifier::parse(spec);
+	BodyClassifier classifier(markers);
+	std::mt19937 rng(1);
+	for (int i = 0; i < 2000; i++) {
+		/* Random text, with some markers inserted at random places */
+		std::string text(rng() % 300, 'a');
+		for (char &c : text)
+			c = "ab<-!rnotw\x80"[rng() % 11];
+		for (size_t m = 0; m < markers.size(); m++) {
+			if (rng() % 2)
+				text.insert(rng() % (text.size() + 1), markers[m]);
+		}
+
+		/* Compare with a straightforward search */
+		uint32_t expected = 0;
+		for (size_t m = 0; m < markers.size(); m++) {
+			if (text.find(markers[m]) != std::string::npos)
+				expected |= 1u << m;
+		}
+		for (const std::string &implementation : classifier.supportedImplementations()) {
+			classifier.useImplementation(implementation);
+			size_t chunkSize = 1 + rng() % 70;
+			uint32_t found = classifyInChunks(classifier, text, chunkSize);
+			if (found != expected) {
+				fprintf(stderr, "%s: found %x instead of %x in chunks of %zu bytes\n",
+					implementation.c_str(), found, expected, chunkSize);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main()
+{
+	if (!selfTest("\\x80,\\x81,brownout,out\\x80,<!--opt-->") || !selfTest("\\x80,\\x81,<"))
+		return 1;
+
+	std::vector<char> body(BodySize);
+	std::mt19937 rng(42);
+	for (char &c : body)
+		c = rng() % 128; /* no marker byte */
+
+	printf("memchr x2: %.2f GB/s\n", measure([](const char *p, size_t len) {
+		volatile bool option1 = memchr(p, 128, len) != NULL;
+		volatile bool option2 = memchr(p, 129, len) != NULL;
+		(void)option1;
+		(void)option2;
+	}, body));
+
+	const char *markerSets[] = { "\\x80,\\x81", "\\x80,\\x81,brownout,<!--opt-->" };
+	for (const char *markers : markerSets) {
+		BodyClassifier classifier(BodyClassifier::parse(markers));
+		for (const std::string &implementation : classifier.supportedImplementations()) {
+			classifier.useImplementation(implementation);
+			BodyClassifier::State state;
+			printf("%s, markers %s: %.2f GB/s\n", implementation.c_str(), markers,
+				measure([&](const char *p, size_t len) {
+					classifier.reset(state);
+					classifier.classify(state, p, len);
+				}, body));
+		}
+	}
+	return 0;
+}
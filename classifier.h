@@ -0,0 +1,366 @@
+#ifndef HTTPMON_CLASSIFIER_H
+#define HTTPMON_CLASSIFIER_H
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTPMON_CLASSIFIER_X86
+#endif
+
+/*
+ * Response body classification
+ *
+ * Replies are classified by which markers, i.e., bytes or short byte
+ * strings, they contain anywhere in their body; in brownout experiments,
+ * markers tell which optional content the server served. Bodies arrive in
+ * chunks, which are scanned once as they arrive: SIMD instructions look for
+ * the first byte of all markers at once, and only candidate positions are
+ * compared with whole markers. Markers may span chunks. Scanning stops as
+ * soon as all markers were found.
+ *
+ * If all markers are single bytes, as by default, each is looked for with
+ * memchr, which libc vectorizes better than a scan for several bytes at
+ * once. Otherwise, the widest instruction set the CPU supports is picked at
+ * run-time: AVX2, SSE2, or plain C on other architectures. Without markers,
+ * nothing is scanned.
+ */
+
+const size_t MaxMarkers = 8;
+const size_t MaxMarkerLength = 16;
+
+class BodyClassifier {
+public:
+	/* Classification of one body, reset before each request */
+	struct State {
+		uint32_t found; /* bit i set if marker i was found */
+		uint32_t tailLength;
+		char tail[MaxMarkerLength - 1]; /* end of previous chunks, for markers spanning chunks */
+	};
+
+	/* Throws std::invalid_argument if markers are too many, empty or too long */
+	explicit BodyClassifier(const std::vector<std::string> &markers) :
+		markers(markers),
+		allFound(0),
+		maxLength(1)
+	{
+		if (markers.size() > MaxMarkers)
+			throw std::invalid_argument("at most " + std::to_string(MaxMarkers) + " markers are supported");
+		for (size_t i = 0; i < markers.size(); i++) {
+			if (markers[i].empty() || markers[i].size() > MaxMarkerLength)
+				throw std::invalid_argument("markers must have 1 to " + std::to_string(MaxMarkerLength) + " bytes");
+			allFound |= 1u << i;
+			maxLength = std::max(maxLength, markers[i].size());
+		}
+		useImplementation(supportedImplementations()[0]);
+	}
+
+	size_t size() const { return markers.size(); }
+	bool empty() const { return markers.empty(); }
+	const std::string &operator[](size_t i) const { return markers[i]; }
+
+	void reset(State &state) const
+	{
+		state.found = 0;
+		state.tailLength = 0;
+	}
+
+	/* Scan the next chunk of a body */
+	void classify(State &state, const char *data, size_t len) const
+	{
+		if (state.found == allFound || len == 0)
+			return;
+
+		/* Markers starting in the previous chunks, ending in this one */
+		if (state.tailLength > 0) {
+			char joint[2 * MaxMarkerLength];
+			size_t head = std::min(len, maxLength - 1);
+			memcpy(joint, state.tail, state.tailLength);
+			memcpy(joint + state.tailLength, data, head);
+			for (size_t pos = 0; pos < state.tailLength; pos++)
+				matchAt(state, joint, pos, state.tailLength + head);
+		}
+
+		(this->*scan)(state, data, len);
+
+		/* Keep the end of the body seen so far */
+		if (maxLength > 1) {
+			size_t keep = maxLength - 1;
+			if (len >= keep) {
+				memcpy(state.tail, data + len - keep, keep);
+				state.tailLength = keep;
+			}
+			else {
+				size_t fromTail = std::min<size_t>(state.tailLength, keep - len);
+				memmove(state.tail, state.tail + state.tailLength - fromTail, fromTail);
+				memcpy(state.tail + fromTail, data, len);
+				state.tailLength = fromTail + len;
+			}
+		}
+	}
+
+	/* Implementations this CPU supports, widest first */
+	static std::vector<std::string> implementations()
+	{
+		std::vector<std::string> result;
+#ifdef HTTPMON_CLASSIFIER_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			result.push_back("avx2");
+		if (__builtin_cpu_supports("sse2"))
+			result.push_back("sse2");
+#endif
+		result.push_back("scalar");
+		return result;
+	}
+
+	/* Implementations supporting these markers, fastest first; memchr needs single-byte markers */
+	std::vector<std::string> supportedImplementations() const
+	{
+		std::vector<std::string> result = implementations();
+		if (maxLength == 1)
+			result.insert(result.begin(), "memchr");
+		return result;
+	}
+
+	/* Force an implementation, e.g., to benchmark; returns false if not supported */
+	bool useImplementation(const std::string &name)
+	{
+		std::vector<std::string> supported = supportedImplementations();
+		if (std::find(supported.begin(), supported.end(), name) == supported.end())
+			return false;
+		implementation = name;
+		scan = &BodyClassifier::scanScalar;
+		if (name == "memchr")
+			scan = &BodyClassifier::scanMemchr;
+#ifdef HTTPMON_CLASSIFIER_X86
+		if (name == "avx2")
+			scan = &BodyClassifier::scanAvx2;
+		else if (name == "sse2")
+			scan = &BodyClassifier::scanSse2;
+#endif
+		return true;
+	}
+
+	const std::string &implementationName() const { return implementation; }
+
+	/*
+	 * Parse a comma-separated list of markers, in which \xHH stands for a
+	 * byte given in hexadecimal, and \, and \\ for a comma and a backslash.
+	 * An empty list means no markers.
+	 */
+	static std::vector<std::string> parse(const std::string &spec)
+	{
+		if (spec.empty())
+			return std::vector<std::string>();
+		std::vector<std::string> result(1);
+		for (size_t i = 0; i < spec.size(); i++) {
+			char c = spec[i];
+			if (c == ',') {
+				result.emplace_back();
+				continue;
+			}
+			if (c == '\\') {
+				if (i + 1 < spec.size() && (spec[i + 1] == ',' || spec[i + 1] == '\\')) {
+					c = spec[++i];
+				}
+				else if (i + 3 < spec.size() && spec[i + 1] == 'x' &&
+					isxdigit(spec[i + 2]) && isxdigit(spec[i + 3])) {
+					c = (char)std::stoi(spec.substr(i + 2, 2), NULL, 16);
+					i += 3;
+				}
+				else {
+					throw std::invalid_argument("invalid escape in markers '" + spec + "'");
+				}
+			}
+			result.back() += c;
+		}
+		return result;
+	}
+
+private:
+	typedef void (BodyClassifier::*ScanFunction)(State &state, const char *data, size_t len) const;
+
+	/* Check whether a marker starts at pos; returns true once all markers were found */
+	bool matchAt(State &state, const char *data, size_t pos, size_t len) const
+	{
+		for (size_t i = 0; i < markers.size(); i++) {
+			const std::string &marker = markers[i];
+			if ((state.found & (1u << i)) || data[pos] != marker[0] ||
+				pos + marker.size() > len)
+				continue;
+			if (memcmp(data + pos + 1, marker.data() + 1, marker.size() - 1) == 0)
+				state.found |= 1u << i;
+		}
+		return state.found == allFound;
+	}
+
+	/* Pairs of bytes identifying candidate positions of a marker */
+	struct Needle {
+		uint8_t first;
+		uint8_t last;
+		size_t lastOffset; /* of last byte, relative to first */
+	};
+
+	/* Needles of markers not found yet */
+	size_t pendingNeedles(const State &state, Needle needles[MaxMarkers]) const
+	{
+		size_t n = 0;
+		for (size_t i = 0; i < markers.size(); i++) {
+			if (state.found & (1u << i))
+				continue;
+			Needle needle = { (uint8_t)markers[i][0], (uint8_t)markers[i].back(), markers[i].size() - 1 };
+			bool duplicate = false;
+			for (size_t j = 0; j < n; j++) {
+				duplicate |= (needles[j].first == needle.first && needles[j].last == needle.last &&
+					needles[j].lastOffset == needle.lastOffset);
+			}
+			if (!duplicate)
+				needles[n++] = needle;
+		}
+		return n;
+	}
+
+	/* Only for single-byte markers, hence never spanning chunks */
+	void scanMemchr(State &state, const char *data, size_t len) const
+	{
+		for (size_t i = 0; i < markers.size(); i++) {
+			if (!(state.found & (1u << i)) && memchr(data, (uint8_t)markers[i][0], len) != NULL)
+				state.found |= 1u << i;
+		}
+	}
+
+	void scanScalar(State &state, const char *data, size_t len) const
+	{
+		scanScalarFrom(state, data, 0, len);
+	}
+
+	void scanScalarFrom(State &state, const char *data, size_t pos, size_t len) const
+	{
+		bool isFirstByte[256] = { false };
+		Needle needles[MaxMarkers];
+		for (size_t i = 0, n = pendingNeedles(state, needles); i < n; i++)
+			isFirstByte[needles[i].first] = true;
+		for (; pos < len; pos++) {
+			if (isFirstByte[(uint8_t)data[pos]] && matchAt(state, data, pos, len))
+				return;
+		}
+	}
+
+#ifdef HTTPMON_CLASSIFIER_X86
+	/*
+	 * Both SIMD scans process two blocks per iteration. Candidate positions
+	 * are those where the first and last byte of a pending marker match,
+	 * which filters out most false positives of longer markers. Candidates
+	 * are then compared with whole markers, one by one.
+	 */
+	__attribute__((target("sse2")))
+	void scanSse2(State &state, const char *data, size_t len) const
+	{
+		const size_t Width = 16;
+		Needle needles[MaxMarkers];
+		__m128i firsts[MaxMarkers], lasts[MaxMarkers];
+		size_t numNeedles = 0;
+		uint32_t foundBefore = ~state.found;
+
+		size_t pos = 0;
+		for (; pos + 2 * Width + maxLength - 1 <= len; pos += 2 * Width) {
+			if (state.found != foundBefore) {
+				foundBefore = state.found;
+				numNeedles = pendingNeedles(state, needles);
+				for (size_t i = 0; i < numNeedles; i++) {
+					firsts[i] = _mm_set1_epi8((char)needles[i].first);
+					lasts[i] = _mm_set1_epi8((char)needles[i].last);
+				}
+			}
+
+			const char *p = data + pos;
+			__m128i block0 = _mm_loadu_si128((const __m128i *)p);
+			__m128i block1 = _mm_loadu_si128((const __m128i *)(p + Width));
+			__m128i hits0 = _mm_setzero_si128(), hits1 = _mm_setzero_si128();
+			for (size_t i = 0; i < numNeedles; i++) {
+				__m128i first0 = _mm_cmpeq_epi8(block0, firsts[i]);
+				__m128i first1 = _mm_cmpeq_epi8(block1, firsts[i]);
+				size_t offset = needles[i].lastOffset;
+				if (offset > 0) {
+					first0 = _mm_and_si128(first0, _mm_cmpeq_epi8(lasts[i],
+						_mm_loadu_si128((const __m128i *)(p + offset))));
+					first1 = _mm_and_si128(first1, _mm_cmpeq_epi8(lasts[i],
+						_mm_loadu_si128((const __m128i *)(p + Width + offset))));
+				}
+				hits0 = _mm_or_si128(hits0, first0);
+				hits1 = _mm_or_si128(hits1, first1);
+			}
+			uint32_t mask = _mm_movemask_epi8(hits0) | _mm_movemask_epi8(hits1) << Width;
+			for (; mask != 0; mask &= mask - 1) {
+				if (matchAt(state, data, pos + __builtin_ctz(mask), len))
+					return;
+			}
+		}
+		scanScalarFrom(state, data, pos, len);
+	}
+
+	__attribute__((target("avx2")))
+	void scanAvx2(State &state, const char *data, size_t len) const
+	{
+		const size_t Width = 32;
+		Needle needles[MaxMarkers];
+		__m256i firsts[MaxMarkers], lasts[MaxMarkers];
+		size_t numNeedles = 0;
+		uint32_t foundBefore = ~state.found;
+
+		size_t pos = 0;
+		for (; pos + 2 * Width + maxLength - 1 <= len; pos += 2 * Width) {
+			if (state.found != foundBefore) {
+				foundBefore = state.found;
+				numNeedles = pendingNeedles(state, needles);
+				for (size_t i = 0; i < numNeedles; i++) {
+					firsts[i] = _mm256_set1_epi8((char)needles[i].first);
+					lasts[i] = _mm256_set1_epi8((char)needles[i].last);
+				}
+			}
+
+			const char *p = data + pos;
+			__m256i block0 = _mm256_loadu_si256((const __m256i *)p);
+			__m256i block1 = _mm256_loadu_si256((const __m256i *)(p + Width));
+			__m256i hits0 = _mm256_setzero_si256(), hits1 = _mm256_setzero_si256();
+			for (size_t i = 0; i < numNeedles; i++) {
+				__m256i first0 = _mm256_cmpeq_epi8(block0, firsts[i]);
+				__m256i first1 = _mm256_cmpeq_epi8(block1, firsts[i]);
+				size_t offset = needles[i].lastOffset;
+				if (offset > 0) {
+					first0 = _mm256_and_si256(first0, _mm256_cmpeq_epi8(lasts[i],
+						_mm256_loadu_si256((const __m256i *)(p + offset))));
+					first1 = _mm256_and_si256(first1, _mm256_cmpeq_epi8(lasts[i],
+						_mm256_loadu_si256((const __m256i *)(p + Width + offset))));
+				}
+				hits0 = _mm256_or_si256(hits0, first0);
+				hits1 = _mm256_or_si256(hits1, first1);
+			}
+			if (_mm256_testz_si256(_mm256_or_si256(hits0, hits1), _mm256_or_si256(hits0, hits1)))
+				continue;
+			uint64_t mask = (uint32_t)_mm256_movemask_epi8(hits0) |
+				(uint64_t)(uint32_t)_mm256_movemask_epi8(hits1) << Width;
+			for (; mask != 0; mask &= mask - 1) {
+				if (matchAt(state, data, pos + __builtin_ctzll(mask), len))
+					return;
+			}
+		}
+		scanScalarFrom(state, data, pos, len);
+	}
+#endif
+
+	std::vector<std::string> markers;
+	uint32_t allFound;
+	size_t maxLength;
+	std::string implementation;
+	ScanFunction scan;
+};
+
+#endif
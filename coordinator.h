@@ -0,0 +1,228 @@
+#ifndef HTTPMON_COORDINATOR_H
+#define HTTPMON_COORDINATOR_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Coordinator/worker protocol
+ *
+ * A coordinator splits the load across worker processes, each connected by
+ * a stream socket: a Unix socket pair for workers forked locally, TCP for
+ * remote workers started with --worker-listen.
+ *
+ * Remote workers first receive a handshake: a line "httpmon-worker INDEX
+ * COUNT", followed by the coordinator's command-line arguments, one per
+ * line, and an empty line. Local workers inherit them when forked.
+ *
+ * Then, the coordinator sends lines: key=value changes, as read from its
+ * standard input, "snapshot" to request the data of the last report
+ * interval, and "stop". Workers answer each snapshot with a message: a
+ * 32-bit length, a kind byte and a payload. Before exiting, e.g., once they
+ * sent all requests they were asked to, workers send a final message, which
+ * also answers any pending snapshot request.
+ */
+
+const char WorkerHello[] = "httpmon-worker";
+
+enum WorkerMessageKind {
+	WORKER_SNAPSHOT = 'S',
+	WORKER_FINAL = 'F',
+};
+
+/* Write everything, also to non-blocking sockets; returns false on errors, e.g., if the peer exited */
+inline bool writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while (len > 0) {
+		ssize_t written = send(fd, p, len, MSG_NOSIGNAL);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { fd, POLLOUT, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return false;
+		}
+		p += written;
+		len -= written;
+	}
+	return true;
+}
+
+/* Read exactly len bytes; returns false on errors or end of file */
+inline bool readAll(int fd, void *buf, size_t len)
+{
+	char *p = (char *)buf;
+	while (len > 0) {
+		ssize_t got = read(fd, p, len);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { fd, POLLIN, 0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return false;
+		}
+		if (got == 0)
+			return false;
+		p += got;
+		len -= got;
+	}
+	return true;
+}
+
+inline bool sendLine(int fd, const std::string &line)
+{
+	std::string s = line + "\n";
+	return writeAll(fd, s.data(), s.size());
+}
+
+inline bool sendMessage(int fd, WorkerMessageKind kind, const std::string &payload)
+{
+	std::string message;
+	uint32_t len = payload.size() + 1;
+	message.append((const char *)&len, sizeof(len));
+	message += (char)kind;
+	message += payload;
+	return writeAll(fd, message.data(), message.size());
+}
+
+inline bool receiveMessage(int fd, WorkerMessageKind &kind, std::string &payload)
+{
+	uint32_t len;
+	if (!readAll(fd, &len, sizeof(len)) || len < 1)
+		return false;
+	std::string message(len, '\0');
+	if (!readAll(fd, &message[0], len))
+		return false;
+	kind = (WorkerMessageKind)message[0];
+	payload = message.substr(1);
+	return true;
+}
+
+/* Connect to host:port; returns -1 and sets error on failure */
+inline int connectTcp(const std::string &hostPort, std::string &error)
+{
+	size_t colon = hostPort.rfind(':');
+	if (colon == std::string::npos) {
+		error = "expected host:port";
+		return -1;
+	}
+	std::string host = hostPort.substr(0, colon);
+	std::string port = hostPort.substr(colon + 1);
+
+	struct addrinfo hints, *addresses;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses);
+	if (ret != 0) {
+		error = gai_strerror(ret);
+		return -1;
+	}
+
+	int fd = -1;
+	error = "no address";
+	for (struct addrinfo *a = addresses; a != NULL; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0)
+			break;
+		error = strerror(errno);
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+/* Wait for a single connection on a TCP port; returns -1 and sets error on failure */
+inline int acceptTcp(int port, std::string &error)
+{
+	int listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenFd < 0) {
+		error = strerror(errno);
+		return -1;
+	}
+	int one = 1, zero = 0;
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)); /* also accept IPv4 */
+
+	struct sockaddr_in6 address;
+	memset(&address, 0, sizeof(address));
+	address.sin6_family = AF_INET6;
+	address.sin6_addr = in6addr_any;
+	address.sin6_port = htons(port);
+	if (bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listenFd, 1) < 0) {
+		error = strerror(errno);
+		close(listenFd);
+		return -1;
+	}
+
+	int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		error = strerror(errno);
+	else
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	close(listenFd);
+	return fd;
+}
+
+inline bool sendHandshake(int fd, int index, int count, const std::vector<std::string> &args)
+{
+	std::string handshake = std::string(WorkerHello) + " " + std::to_string(index) + " " + std::to_string(count) + "\n";
+	for (const std::string &arg : args)
+		handshake += arg + "\n";
+	handshake += "\n";
+	return writeAll(fd, handshake.data(), handshake.size());
+}
+
+inline bool receiveHandshake(int fd, int &index, int &count, std::vector<std::string> &args)
+{
+	/* Read line by line; the handshake is short */
+	std::vector<std::string> lines;
+	std::string line;
+	for (;;) {
+		char c;
+		if (!readAll(fd, &c, 1))
+			return false;
+		if (c != '\n') {
+			line += c;
+			continue;
+		}
+		if (line.empty())
+			break;
+		lines.push_back(line);
+		line.clear();
+	}
+
+	if (lines.empty() || sscanf(lines[0].c_str(), "httpmon-worker %d %d", &index, &count) != 2 ||
+		index < 0 || count < 1 || index >= count)
+		return false;
+	args.assign(lines.begin() + 1, lines.end());
+	return true;
+}
+
+#endif
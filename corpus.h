@@ -0,0 +1,305 @@
+#ifndef HTTPMON_CORPUS_H
+#define HTTPMON_CORPUS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <curl/curl.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Body corpora
+ *
+ * A corpus provides many distinct request bodies: either a file with one
+ * body per line, e.g., JSON documents, or a directory with one body per
+ * file, e.g., large uploads, taken in file name order. Files are mapped
+ * into memory once and bodies are sent straight from the mapping, through
+ * CURL's read callback, without being copied for each request.
+ *
+ * Bodies are picked round-robin, at random, or in a pseudo-random order
+ * that only depends on a seed, hence is the same from one run to the next.
+ * Bodies may contain the placeholders {{seq}}, the number of the body
+ * drawn from the corpus, {{rand}}, a random 64-bit number, and {{client}},
+ * the id of the client sending it. These are substituted into a scratch
+ * buffer of the client; bodies without placeholders are never copied.
+ */
+
+enum BodyOrder {
+	BODY_ROUND_ROBIN,
+	BODY_RANDOM,
+	BODY_SEEDED,
+};
+
+/* Parse a body order; throws std::invalid_argument on errors */
+inline BodyOrder parseBodyOrder(const std::string &order)
+{
+	if (order == "round-robin")
+		return BODY_ROUND_ROBIN;
+	if (order == "random")
+		return BODY_RANDOM;
+	if (order == "seeded")
+		return BODY_SEEDED;
+	throw std::invalid_argument("unknown body order '" + order + "', expected 'round-robin', 'random' or 'seeded'");
+}
+
+/* Body being sent by a client, read by CURL through readBody() */
+struct BodyCursor {
+	const char *data;
+	size_t size;
+	size_t position;
+};
+
+inline size_t readBody(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	BodyCursor *cursor = (BodyCursor *)userdata;
+	size_t n = std::min(size * nitems, cursor->size - cursor->position);
+	memcpy(buffer, cursor->data + cursor->position, n);
+	cursor->position += n;
+	return n;
+}
+
+/* Lets CURL rewind, e.g., to resend a body on a new connection */
+inline int seekBody(void *userdata, curl_off_t offset, int origin)
+{
+	BodyCursor *cursor = (BodyCursor *)userdata;
+	if (origin != SEEK_SET || offset < 0 || (size_t)offset > cursor->size)
+		return CURL_SEEKFUNC_CANTSEEK;
+	cursor->position = offset;
+	return CURL_SEEKFUNC_OK;
+}
+
+class BodyCorpus {
+public:
+	/* Map a corpus file or directory, see above; throws std::runtime_error on errors */
+	BodyCorpus(const std::string &path, BodyOrder order, uint64_t seed) :
+		order(order),
+		seed(seed),
+		numDrawn(0)
+	{
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0)
+			throw std::runtime_error("cannot read body corpus '" + path + "': " + strerror(errno));
+		try {
+			if (S_ISDIR(st.st_mode)) {
+				for (const std::string &name : listDirectory(path)) {
+					const char *data;
+					size_t size;
+					if (map(path + "/" + name, data, size))
+						addBody(data, size);
+				}
+			}
+			else {
+				const char *data;
+				size_t size;
+				map(path, data, size);
+				for (const char *p = data, *end = data + size; p < end; ) {
+					const char *eol = (const char *)memchr(p, '\n', end - p);
+					const char *next = eol ? eol + 1 : end;
+					if (eol && eol > p && eol[-1] == '\r')
+						eol--;
+					if ((eol ? eol : end) > p)
+						addBody(p, (eol ? eol : end) - p);
+					p = next;
+				}
+			}
+			if (bodies.empty())
+				throw std::runtime_error("body corpus '" + path + "' contains no bodies");
+		}
+		catch (...) {
+			unmapAll();
+			throw;
+		}
+	}
+
+	~BodyCorpus()
+	{
+		unmapAll();
+	}
+
+	size_t size() const { return bodies.size(); }
+
+	/*
+	 * Draw the next body for a client with the given global id, of one of
+	 * numWorkers processes, and let cursor point to it. Bodies drawn by
+	 * workers are numbered as if a single process drew them all.
+	 */
+	template<typename RNG>
+	void next(BodyCursor &cursor, std::string &scratch, RNG &rng, int clientId, int workerIndex, int numWorkers) const
+	{
+		uint64_t seq = numDrawn.fetch_add(1, std::memory_order_relaxed) * numWorkers + workerIndex;
+		size_t index;
+		if (order == BODY_RANDOM)
+			index = std::uniform_int_distribution<size_t>(0, bodies.size() - 1)(rng);
+		else if (order == BODY_SEEDED)
+			index = mix(seed + seq) % bodies.size();
+		else
+			index = seq % bodies.size();
+
+		const Body &body = bodies[index];
+		cursor.position = 0;
+		if (body.segments.empty()) {
+			cursor.data = body.data;
+			cursor.size = body.size;
+			return;
+		}
+		scratch.clear();
+		for (const Segment &segment : body.segments) {
+			switch (segment.placeholder) {
+			case PLACEHOLDER_SEQ:
+				scratch += std::to_string(seq);
+				break;
+			case PLACEHOLDER_RAND:
+				scratch += std::to_string(std::uniform_int_distribution<uint64_t>()(rng));
+				break;
+			case PLACEHOLDER_CLIENT:
+				scratch += std::to_string(clientId);
+				break;
+			default:
+				scratch.append(segment.data, segment.size);
+			}
+		}
+		cursor.data = scratch.data();
+		cursor.size = scratch.size();
+	}
+
+private:
+	enum Placeholder {
+		PLACEHOLDER_NONE,
+		PLACEHOLDER_SEQ,
+		PLACEHOLDER_RAND,
+		PLACEHOLDER_CLIENT,
+	};
+
+	struct Segment {
+		const char *data; /* literal text, if no placeholder */
+		size_t size;
+		Placeholder placeholder;
+	};
+
+	struct Body {
+		const char *data;
+		size_t size;
+		std::vector<Segment> segments; /* empty if the body has no placeholder */
+	};
+
+	struct Mapping {
+		void *address;
+		size_t size;
+	};
+
+	/* Split a body into literal text and placeholders, once */
+	void addBody(const char *data, size_t size)
+	{
+		static const struct { const char *text; Placeholder placeholder; } Placeholders[] = {
+			{ "{{seq}}", PLACEHOLDER_SEQ },
+			{ "{{rand}}", PLACEHOLDER_RAND },
+			{ "{{client}}", PLACEHOLDER_CLIENT },
+		};
+
+		Body body = { data, size, std::vector<Segment>() };
+		const char *literal = data, *end = data + size;
+		for (const char *p = data; p + 1 < end; p++) {
+			if (p[0] != '{' || p[1] != '{')
+				continue;
+			for (const auto &placeholder : Placeholders) {
+				size_t length = strlen(placeholder.text);
+				if ((size_t)(end - p) < length || memcmp(p, placeholder.text, length) != 0)
+					continue;
+				if (p > literal)
+					body.segments.push_back(Segment{ literal, (size_t)(p - literal), PLACEHOLDER_NONE });
+				body.segments.push_back(Segment{ NULL, 0, placeholder.placeholder });
+				p += length - 1;
+				literal = p + 1;
+				break;
+			}
+		}
+		if (!body.segments.empty() && literal < end)
+			body.segments.push_back(Segment{ literal, (size_t)(end - literal), PLACEHOLDER_NONE });
+		bodies.push_back(body);
+	}
+
+	/* Map a regular file read-only; returns false if it is not one, e.g., a subdirectory */
+	bool map(const std::string &path, const char *&data, size_t &size)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			std::string error = strerror(errno);
+			if (fd >= 0)
+				close(fd);
+			throw std::runtime_error("cannot read body corpus file '" + path + "': " + error);
+		}
+		if (!S_ISREG(st.st_mode)) {
+			close(fd);
+			return false;
+		}
+		size = st.st_size;
+		data = "";
+		if (size > 0) {
+			void *address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (address == MAP_FAILED) {
+				std::string error = strerror(errno);
+				close(fd);
+				throw std::runtime_error("cannot map body corpus file '" + path + "': " + error);
+			}
+			madvise(address, size, MADV_WILLNEED);
+			mappings.push_back(Mapping{ address, size });
+			data = (const char *)address;
+		}
+		close(fd);
+		return true;
+	}
+
+	void unmapAll()
+	{
+		for (const Mapping &m : mappings)
+			munmap(m.address, m.size);
+		mappings.clear();
+	}
+
+	/* Names of the entries of a directory, except hidden ones, sorted */
+	static std::vector<std::string> listDirectory(const std::string &path)
+	{
+		DIR *dir = opendir(path.c_str());
+		if (dir == NULL)
+			throw std::runtime_error("cannot list body corpus directory '" + path + "': " + strerror(errno));
+		std::vector<std::string> names;
+		while (struct dirent *entry = readdir(dir)) {
+			if (entry->d_name[0] != '.')
+				names.push_back(entry->d_name);
+		}
+		closedir(dir);
+		std::sort(names.begin(), names.end());
+		return names;
+	}
+
+	/* SplitMix64 finalizer: a well-mixed function of x */
+	static uint64_t mix(uint64_t x)
+	{
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	const BodyOrder order;
+	const uint64_t seed;
+	mutable std::atomic<uint64_t> numDrawn;
+	std::vector<Body> bodies;
+	std::vector<Mapping> mappings;
+
+	BodyCorpus(const BodyCorpus &);
+	BodyCorpus &operator=(const BodyCorpus &);
+};
+
+#endif
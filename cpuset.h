@@ -0,0 +1,99 @@
+#ifndef HTTPMON_CPUSET_H
+#define HTTPMON_CPUSET_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <pthread.h>
+#include <sched.h>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * CPU sets
+ *
+ * Lets httpmon run on chosen CPUs, so that it does not compete with other
+ * processes, e.g., the server under test, or migrate between NUMA nodes.
+ * A CPU set is written as a list of CPUs and ranges, such as "0-3,8", or as
+ * "node:N,..." for all CPUs of the given NUMA nodes, as listed by Linux in
+ * /sys/devices/system/node.
+ */
+
+/* Parse a CPU list such as "0-3,8"; throws std::invalid_argument on errors */
+inline std::vector<int> parseCpuList(const std::string &list)
+{
+	std::set<int> cpus;
+	size_t start = 0;
+	while (start < list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string item = list.substr(start, end - start);
+		start = end + 1;
+
+		char *rest;
+		long first = strtol(item.c_str(), &rest, 10);
+		long last = first;
+		if (*rest == '-')
+			last = strtol(rest + 1, &rest, 10);
+		if (item.empty() || *rest != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+			throw std::invalid_argument("invalid CPU or range '" + item + "'");
+		for (long cpu = first; cpu <= last; cpu++)
+			cpus.insert(cpu);
+	}
+	if (cpus.empty())
+		throw std::invalid_argument("empty CPU list");
+	return std::vector<int>(cpus.begin(), cpus.end());
+}
+
+/* Parse a CPU set, see above, in ascending order; throws std::invalid_argument on errors */
+inline std::vector<int> parseCpuSet(const std::string &spec)
+{
+	if (spec.compare(0, 5, "node:") != 0)
+		return parseCpuList(spec);
+
+	std::set<int> cpus;
+	for (int node : parseCpuList(spec.substr(5))) {
+		std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+		std::ifstream f(path);
+		std::string list;
+		if (!std::getline(f, list))
+			throw std::invalid_argument("no NUMA node " + std::to_string(node));
+		if (list.empty())
+			continue; /* memory-only node */
+		for (int cpu : parseCpuList(list))
+			cpus.insert(cpu);
+	}
+	if (cpus.empty())
+		throw std::invalid_argument("NUMA nodes '" + spec.substr(5) + "' have no CPU");
+	return std::vector<int>(cpus.begin(), cpus.end());
+}
+
+/* Share of the CPUs for one of count processes, if there are enough CPUs for each to have its own */
+inline std::vector<int> cpuShare(const std::vector<int> &cpus, int index, int count)
+{
+	if ((int)cpus.size() < count)
+		return cpus;
+	std::vector<int> share;
+	for (size_t i = index; i < cpus.size(); i += count)
+		share.push_back(cpus[i]);
+	return share;
+}
+
+/*
+ * Restrict a thread to the given CPUs; threads it creates later inherit
+ * this. Returns 0 or an error number.
+ */
+inline int pinThread(pthread_t thread, const std::vector<int> &cpus)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+		CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef HTTPMON_DECODER_H
+#define HTTPMON_DECODER_H
+
+#include <algorithm>
+#include <brotli/decode.h>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+/*
+ * Response decoding
+ *
+ * By default, httpmon never decodes replies: with --compressed, it merely
+ * asks for compressed replies, hence only sees how many bytes went over the
+ * wire. With --decode, it decodes gzip, deflate and Brotli replies itself,
+ * rather than letting CURL do so, so that the time spent decoding each
+ * reply can be measured apart from receiving it. Decoded bytes are passed
+ * on, e.g., to the classifier looking for markers, in small chunks, without
+ * ever holding a whole reply.
+ */
+
+enum ContentEncoding {
+	ENCODING_IDENTITY,
+	ENCODING_GZIP, /* also deflate, told apart by zlib */
+	ENCODING_BROTLI,
+	ENCODING_UNKNOWN, /* passed on as is */
+};
+
+/* Parse a Content-Encoding header value, e.g., "gzip" */
+inline ContentEncoding parseContentEncoding(const char *value, size_t size)
+{
+	while (size > 0 && (*value == ' ' || *value == '\t')) {
+		value++;
+		size--;
+	}
+	while (size > 0 && (value[size - 1] == ' ' || value[size - 1] == '\t' || value[size - 1] == '\r' || value[size - 1] == '\n'))
+		size--;
+	auto is = [&](const char *name) {
+		return size == strlen(name) && strncasecmp(value, name, size) == 0;
+	};
+	if (size == 0 || is("identity"))
+		return ENCODING_IDENTITY;
+	if (is("gzip") || is("x-gzip") || is("deflate"))
+		return ENCODING_GZIP;
+	if (is("br"))
+		return ENCODING_BROTLI;
+	return ENCODING_UNKNOWN;
+}
+
+class ResponseDecoder {
+public:
+	ResponseDecoder() :
+		encoding(ENCODING_IDENTITY),
+		zlibReady(false),
+		brotli(NULL),
+		input(NULL),
+		inputSize(0),
+		ended(false),
+		failed(false)
+	{
+		memset(&zlib, 0, sizeof(zlib));
+	}
+
+	~ResponseDecoder()
+	{
+		if (zlibReady)
+			inflateEnd(&zlib);
+		if (brotli)
+			BrotliDecoderDestroyInstance(brotli);
+	}
+
+	/* Prepare for a reply with the given encoding; state is reused across replies */
+	void start(ContentEncoding encoding)
+	{
+		this->encoding = encoding;
+		input = NULL;
+		inputSize = 0;
+		ended = false;
+		failed = false;
+		if (encoding == ENCODING_GZIP) {
+			if (!zlibReady)
+				zlibReady = (inflateInit2(&zlib, 15 + 32 /* detect gzip or zlib header */) == Z_OK);
+			else
+				inflateReset(&zlib);
+			failed = !zlibReady;
+		}
+		else if (encoding == ENCODING_BROTLI) {
+			if (brotli)
+				BrotliDecoderDestroyInstance(brotli); /* no reset in the API */
+			brotli = BrotliDecoderCreateInstance(NULL, NULL, NULL);
+			failed = (brotli == NULL);
+		}
+	}
+
+	ContentEncoding contentEncoding() const { return encoding; }
+
+	/* Whether replies with this encoding need decoding */
+	bool decodes() const { return encoding == ENCODING_GZIP || encoding == ENCODING_BROTLI; }
+
+	/* Give the next encoded bytes received; they must stay valid until read() returned 0 */
+	void feed(const char *data, size_t size)
+	{
+		input = data;
+		inputSize = size;
+	}
+
+	/*
+	 * Decode bytes fed so far into out, of the given size. Returns the
+	 * number of decoded bytes, 0 once all bytes fed were consumed, or -1 if
+	 * the reply is corrupt.
+	 */
+	ssize_t read(char *out, size_t size)
+	{
+		if (failed)
+			return -1;
+		if (ended) {
+			inputSize = 0; /* ignore trailing garbage, as CURL does */
+			return 0;
+		}
+		if (!decodes()) {
+			size_t n = std::min(size, inputSize);
+			memcpy(out, input, n);
+			input += n;
+			inputSize -= n;
+			return n;
+		}
+		if (encoding == ENCODING_GZIP) {
+			zlib.next_in = (Bytef *)input;
+			zlib.avail_in = inputSize;
+			zlib.next_out = (Bytef *)out;
+			zlib.avail_out = size;
+			int result = inflate(&zlib, Z_NO_FLUSH);
+			input = (const char *)zlib.next_in;
+			inputSize = zlib.avail_in;
+			if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+				failed = true;
+			ended = (result == Z_STREAM_END);
+			return failed ? -1 : (ssize_t)(size - zlib.avail_out);
+		}
+		const uint8_t *nextIn = (const uint8_t *)input;
+		uint8_t *nextOut = (uint8_t *)out;
+		size_t availOut = size;
+		BrotliDecoderResult result = BrotliDecoderDecompressStream(brotli, &inputSize, &nextIn, &availOut, &nextOut, NULL);
+		input = (const char *)nextIn;
+		if (result == BROTLI_DECODER_RESULT_ERROR) {
+			failed = true;
+			return -1;
+		}
+		ended = (result == BROTLI_DECODER_RESULT_SUCCESS);
+		return size - availOut;
+	}
+
+private:
+	ContentEncoding encoding;
+	z_stream zlib;
+	bool zlibReady;
+	BrotliDecoderState *brotli;
+	const char *input;
+	size_t inputSize;
+	bool ended; /* the end of the encoded stream was reached */
+	bool failed;
+
+	ResponseDecoder(const ResponseDecoder &);
+	ResponseDecoder &operator=(const ResponseDecoder &);
+};
+
+#endif
@@ -0,0 +1,415 @@
+#ifndef HTTPMON_DUMP_H
+#define HTTPMON_DUMP_H
+
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Request dumps
+ *
+ * Requests are dumped while httpmon runs, either as CSV or in a compact
+ * binary format made of a DumpHeader followed by fixed-width DumpRecords.
+ * httpmon-dump2csv converts the latter into the former.
+ */
+
+const char DumpMagic[8] = { 'H', 'T', 'T', 'P', 'M', 'O', 'N', 'D' };
+const uint32_t DumpVersion = 3;
+
+/* Marks times that are not known, e.g., repliedAt of abandoned requests */
+const int64_t DumpNoTime = std::numeric_limits<int64_t>::min();
+
+/*
+ * Phases of a request, as timed by CURL: name lookup, TCP connect, TLS
+ * handshake, time to first byte, i.e., from the request being ready to be
+ * sent until the first byte of the reply, and transfer of the reply.
+ */
+enum RequestPhase {
+	PHASE_DNS,
+	PHASE_CONNECT,
+	PHASE_TLS,
+	PHASE_TTFB,
+	PHASE_TRANSFER,
+	NUM_PHASES
+};
+
+const char *const RequestPhaseNames[NUM_PHASES] = { "dns", "connect", "tls", "ttfb", "transfer" };
+
+/*
+ * Why a request failed: the server replied with an HTTP error status, or
+ * the request timed out, its connection was refused, its host name could
+ * not be resolved, its connection was dropped, e.g., reset, or TLS failed,
+ * or the user gave up on it before it could be sent.
+ */
+enum ErrorClass {
+	ERROR_NONE,
+	ERROR_HTTP,
+	ERROR_TIMEOUT,
+	ERROR_REFUSED,
+	ERROR_DNS,
+	ERROR_RESET,
+	ERROR_TLS,
+	ERROR_ABANDONED,
+	ERROR_OTHER,
+	NUM_ERROR_CLASSES
+};
+
+const char *const ErrorClassNames[NUM_ERROR_CLASSES] = {
+	"none", "http", "timeout", "refused", "dns", "reset", "tls", "abandoned", "other"
+};
+
+/* Marks phase durations that are not known, e.g., of abandoned requests */
+const uint32_t DumpNoDuration = std::numeric_limits<uint32_t>::max();
+
+#define DUMPFLAGS_ERROR   0x01
+#define DUMPFLAGS_OPTION1 0x02
+#define DUMPFLAGS_OPTION2 0x04
+
+struct DumpHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	int64_t clockOffset; /*< add to record times to obtain nanoseconds since the UNIX epoch */
+} __attribute__((packed));
+
+struct DumpRecord {
+	int64_t generatedAt; /*< all times in nanoseconds, see DumpHeader::clockOffset */
+	int64_t sentAt;
+	int64_t repliedAt;
+	uint32_t flags;
+	uint32_t phases[NUM_PHASES]; /*< durations in microseconds, see RequestPhase */
+	uint16_t status; /*< HTTP status code, 0 if no reply was received */
+	uint8_t errorClass; /*< see ErrorClass */
+	uint8_t reserved;
+} __attribute__((packed));
+
+const char DumpCsvHeader[] = "generatedAt,sentAt,repliedAt,responseTime,option1,option2,error,clientQueue,dns,connect,tls,ttfb,transfer,status,errorClass\n";
+
+/* Convert a record time to seconds since the UNIX epoch */
+inline double dumpTimeToSeconds(int64_t t, int64_t clockOffset)
+{
+	if (t == DumpNoTime)
+		return NAN;
+	return (t + clockOffset) / 1e9;
+}
+
+/*
+ * Size of records of each dump version: each version appended fields to
+ * the previous one, version 1 lacking phases, version 2 status and error
+ * class. Returns 0 for unknown versions.
+ */
+inline uint32_t dumpRecordSize(uint32_t version)
+{
+	switch (version) {
+	case 1: return offsetof(DumpRecord, phases);
+	case 2: return offsetof(DumpRecord, status);
+	case DumpVersion: return sizeof(DumpRecord);
+	default: return 0;
+	}
+}
+
+/* Whether records of a dump with this header can be read with readDumpRecord() */
+inline bool isSupportedDump(const DumpHeader &header)
+{
+	return header.recordSize != 0 && header.recordSize == dumpRecordSize(header.version);
+}
+
+/* Read a record of a supported dump version, filling in fields it lacks */
+inline void readDumpRecord(const char *p, const DumpHeader &header, DumpRecord &r)
+{
+	if (header.recordSize == sizeof(DumpRecord)) {
+		memcpy(&r, p, sizeof(r));
+		return;
+	}
+	memset(&r, 0, sizeof(r));
+	memcpy(&r, p, header.recordSize);
+	if (header.recordSize <= offsetof(DumpRecord, phases)) {
+		for (int i = 0; i < NUM_PHASES; i++)
+			r.phases[i] = DumpNoDuration;
+	}
+	if (r.flags & DUMPFLAGS_ERROR)
+		r.errorClass = (r.repliedAt == DumpNoTime) ? ERROR_ABANDONED : ERROR_OTHER; /* unknown */
+}
+
+/* Format a record as a CSV line; returns the number of characters written */
+inline int formatDumpRecordCsv(char *buf, size_t size, const DumpRecord &r, int64_t clockOffset)
+{
+	double generatedAt = dumpTimeToSeconds(r.generatedAt, clockOffset);
+	double sentAt = dumpTimeToSeconds(r.sentAt, clockOffset);
+	double repliedAt = dumpTimeToSeconds(r.repliedAt, clockOffset);
+	double phases[NUM_PHASES];
+	for (int i = 0; i < NUM_PHASES; i++)
+		phases[i] = (r.phases[i] == DumpNoDuration) ? NAN : r.phases[i] / 1e6;
+	const char *errorClass = (r.errorClass < NUM_ERROR_CLASSES) ? ErrorClassNames[r.errorClass] : "other";
+	return snprintf(buf, size, "%f,%f,%f,%f,%d,%d,%d,%f,%f,%f,%f,%f,%f,%u,%s\n",
+		generatedAt, sentAt, repliedAt, repliedAt - generatedAt,
+		!!(r.flags & DUMPFLAGS_OPTION1), !!(r.flags & DUMPFLAGS_OPTION2),
+		!!(r.flags & DUMPFLAGS_ERROR), sentAt - generatedAt,
+		phases[PHASE_DNS], phases[PHASE_CONNECT], phases[PHASE_TLS],
+		phases[PHASE_TTFB], phases[PHASE_TRANSFER], r.status, errorClass);
+}
+
+/* Read all records of a binary dump; returns false and sets error on failure */
+inline bool readDump(const std::string &path, DumpHeader &header, std::vector<DumpRecord> &records, std::string &error)
+{
+	FILE *f = fopen(path.c_str(), "rb");
+	if (f == NULL) {
+		error = strerror(errno);
+		return false;
+	}
+	bool ok = false;
+	if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, DumpMagic, sizeof(DumpMagic)) != 0)
+		error = "not an httpmon binary dump";
+	else if (!isSupportedDump(header))
+		error = "unsupported dump version " + std::to_string(header.version);
+	else {
+		char buf[sizeof(DumpRecord)];
+		DumpRecord r;
+		while (fread(buf, header.recordSize, 1, f) == 1) {
+			readDumpRecord(buf, header, r);
+			records.push_back(r);
+		}
+		ok = true;
+	}
+	fclose(f);
+	return ok;
+}
+
+enum DumpFormat {
+	DUMP_CSV,
+	DUMP_BINARY,
+};
+
+/*
+ * Streams records to disk from a background thread, using bounded memory.
+ *
+ * Clients append records to one of several stripes, to avoid contending on
+ * a single lock. Full chunks of records are handed to the writer thread,
+ * which writes them with large appends and rotates files once they exceed
+ * a given size. If the disk cannot keep up and too many chunks are pending,
+ * chunks are dropped and counted rather than growing memory.
+ */
+class DumpWriter {
+public:
+	static const size_t ChunkRecords = 4096;
+	static const size_t MaxPendingChunks = 64;
+
+	DumpWriter(const std::string &path, DumpFormat format, int64_t clockOffset,
+		uint64_t rotateBytes, int numStripes) :
+		path(path),
+		format(format),
+		clockOffset(clockOffset),
+		rotateBytes(rotateBytes),
+		stripes(numStripes),
+		stopping(false),
+		numDropped(0),
+		fd(-1),
+		fileIndex(0),
+		fileBytes(0)
+	{
+		for (auto &stripe : stripes)
+			stripe.chunk.reserve(ChunkRecords);
+		openFile();
+		writerThread = std::thread(&DumpWriter::run, this);
+	}
+
+	~DumpWriter()
+	{
+		flush();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		pendingChanged.notify_all();
+		writerThread.join();
+		if (fd >= 0)
+			close(fd);
+	}
+
+	bool ok() const { return fd >= 0; }
+
+	/* Thread-safe; stripe should be stable per client, e.g., derived from its id */
+	void append(int stripeIndex, const DumpRecord &record)
+	{
+		Stripe &stripe = stripes[stripeIndex % stripes.size()];
+		std::lock_guard<std::mutex> lock(stripe.mutex);
+		stripe.chunk.push_back(record);
+		if (stripe.chunk.size() >= ChunkRecords)
+			handOver(stripe.chunk);
+	}
+
+	/* Hand partially filled chunks to the writer, e.g., once per report */
+	void flush()
+	{
+		for (auto &stripe : stripes) {
+			std::lock_guard<std::mutex> lock(stripe.mutex);
+			if (!stripe.chunk.empty())
+				handOver(stripe.chunk);
+		}
+	}
+
+	/* Number of records dropped because the disk could not keep up */
+	uint64_t dropped()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return numDropped;
+	}
+
+private:
+	typedef std::vector<DumpRecord> Chunk;
+
+	struct Stripe {
+		std::mutex mutex;
+		Chunk chunk;
+	};
+
+	/* Replace chunk with an empty one and queue it for writing */
+	void handOver(Chunk &chunk)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pending.size() >= MaxPendingChunks) {
+			numDropped += chunk.size();
+			chunk.clear();
+			return;
+		}
+		pending.emplace_back();
+		pending.back().swap(chunk);
+		if (!spare.empty()) {
+			chunk.swap(spare.back());
+			spare.pop_back();
+		}
+		else {
+			chunk.reserve(ChunkRecords);
+		}
+		pendingChanged.notify_one();
+	}
+
+	void run()
+	{
+		/* Leave signals, e.g., SIGINT, to the thread waiting for them */
+		sigset_t sigset;
+		sigfillset(&sigset);
+		pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+		std::vector<char> text;
+		for (;;) {
+			Chunk chunk;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (pending.empty() && !stopping)
+					pendingChanged.wait(lock);
+				if (pending.empty())
+					return; /* stopping and all written */
+				chunk.swap(pending.front());
+				pending.pop_front();
+			}
+
+			if (format == DUMP_BINARY) {
+				writeAll(chunk.data(), chunk.size() * sizeof(DumpRecord));
+			}
+			else {
+				const size_t MaxLineLength = 256;
+				text.resize(chunk.size() * MaxLineLength);
+				size_t len = 0;
+				for (const DumpRecord &r : chunk)
+					len += formatDumpRecordCsv(&text[len], MaxLineLength, r, clockOffset);
+				writeAll(text.data(), len);
+			}
+
+			chunk.clear();
+			std::lock_guard<std::mutex> lock(mutex);
+			if (spare.size() < stripes.size())
+				spare.emplace_back(std::move(chunk));
+		}
+	}
+
+	void openFile()
+	{
+		std::string name = path;
+		if (fileIndex > 0)
+			name += "." + std::to_string(fileIndex);
+		fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			fprintf(stderr, "Cannot open dump file %s: %s\n", name.c_str(), strerror(errno));
+			return;
+		}
+		fileBytes = 0;
+
+		if (format == DUMP_BINARY) {
+			DumpHeader header;
+			memcpy(header.magic, DumpMagic, sizeof(header.magic));
+			header.version = DumpVersion;
+			header.recordSize = sizeof(DumpRecord);
+			header.clockOffset = clockOffset;
+			writeAll(&header, sizeof(header));
+		}
+		else {
+			writeAll(DumpCsvHeader, strlen(DumpCsvHeader));
+		}
+	}
+
+	void writeAll(const void *buf, size_t len)
+	{
+		if (fd < 0)
+			return;
+		/* Rotate only at chunk boundaries, so files always contain whole records */
+		if (rotateBytes > 0 && fileBytes > 0 && fileBytes + len > rotateBytes) {
+			close(fd);
+			fileIndex++;
+			openFile();
+			if (fd < 0)
+				return;
+		}
+
+		const char *p = (const char *)buf;
+		while (len > 0) {
+			ssize_t written = write(fd, p, len);
+			if (written < 0) {
+				if (errno == EINTR)
+					continue;
+				fprintf(stderr, "Writing to dumpfile failed: %s\n", strerror(errno));
+				close(fd);
+				fd = -1;
+				return;
+			}
+			p += written;
+			len -= written;
+			fileBytes += written;
+		}
+	}
+
+	const std::string path;
+	const DumpFormat format;
+	const int64_t clockOffset;
+	const uint64_t rotateBytes;
+	std::vector<Stripe> stripes;
+
+	std::mutex mutex; /* protects members below */
+	std::condition_variable pendingChanged;
+	std::deque<Chunk> pending;
+	std::vector<Chunk> spare; /* recycled chunks, to avoid reallocating */
+	bool stopping;
+	uint64_t numDropped;
+
+	/* Only accessed by the writer thread after construction */
+	int fd;
+	int fileIndex;
+	uint64_t fileBytes;
+	std::thread writerThread;
+};
+
+#endif
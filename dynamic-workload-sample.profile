@@ -0,0 +1,10 @@
+# The same experiment as dynamic-workload-sample.sh, as a profile, run with:
+#
+#   ./httpmon --url http://example.com --open --thinktime 1 --timeout 4 --count 120900 --profile dynamic-workload-sample.profile
+#
+# duration shape target
+100 step concurrency=326
+100 step concurrency=15
+100 step concurrency=382
+100 step concurrency=473
+110 step concurrency=13
@@ -0,0 +1,314 @@
+#ifndef HTTPMON_HISTOGRAM_H
+#define HTTPMON_HISTOGRAM_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+/* Helpers to (de)serialize plain values, e.g., to send statistics between processes */
+template<typename T>
+void appendValue(std::string &out, const T &value)
+{
+	out.append((const char *)&value, sizeof(value));
+}
+
+template<typename T>
+bool readValue(const char *&p, const char *end, T &value)
+{
+	if (end - p < (ptrdiff_t)sizeof(value))
+		return false;
+	memcpy(&value, p, sizeof(value));
+	p += sizeof(value);
+	return true;
+}
+
+/*
+ * Log-linear bucketed histogram, in the spirit of HdrHistogram.
+ *
+ * Values are non-negative integers (httpmon uses nanoseconds). Values below
+ * 2^subBucketBits are recorded exactly, larger values fall into buckets whose
+ * width is at most 2^-(subBucketBits-1) of the value, so the relative error
+ * of any reported value is bounded by the configured number of significant
+ * decimal digits. Recording is O(1), memory only depends on the precision and
+ * the highest trackable value, and histograms with the same configuration
+ * can be merged.
+ */
+class HistogramLayout {
+public:
+	explicit HistogramLayout(int significantDigits = 2,
+		uint64_t highestTrackableValue = 3600ULL * 1000000000ULL /* 1 hour in ns */) :
+		significantDigits(std::max(1, std::min(significantDigits, 5))),
+		highestTrackableValue(highestTrackableValue)
+	{
+		/* Smallest power of two that distinguishes 2 * 10^digits values */
+		uint64_t largestSingleUnitResolution = 2 * std::pow(10, this->significantDigits);
+		subBucketBits = 1;
+		while ((1ULL << subBucketBits) < largestSingleUnitResolution)
+			subBucketBits++;
+	}
+
+	int digits() const { return significantDigits; }
+	uint64_t highest() const { return highestTrackableValue; }
+	size_t numBuckets() const { return bucketIndex(highestTrackableValue) + 1; }
+
+	uint64_t bucketLowest(size_t index) const
+	{
+		if (index < (1ULL << (subBucketBits - 1)))
+			return index;
+		int shift = (index >> (subBucketBits - 1)) - 1;
+		return (index - ((uint64_t)shift << (subBucketBits - 1))) << shift;
+	}
+	uint64_t bucketWidth(size_t index) const
+	{
+		if (index < (1ULL << (subBucketBits - 1)))
+			return 1;
+		return 1ULL << ((index >> (subBucketBits - 1)) - 1);
+	}
+
+protected:
+	size_t bucketIndex(uint64_t value) const
+	{
+		value = std::min(value, highestTrackableValue);
+		if (value < (1ULL << subBucketBits))
+			return value;
+		int msb = 63 - __builtin_clzll(value);
+		int shift = msb - subBucketBits + 1;
+		return ((size_t)shift << (subBucketBits - 1)) + (value >> shift);
+	}
+
+	int significantDigits;
+	int subBucketBits;
+	uint64_t highestTrackableValue;
+};
+
+class Histogram : public HistogramLayout {
+	friend class ConcurrentHistogram;
+public:
+	explicit Histogram(int significantDigits = 2,
+		uint64_t highestTrackableValue = 3600ULL * 1000000000ULL /* 1 hour in ns */) :
+		HistogramLayout(significantDigits, highestTrackableValue)
+	{
+		counts.resize(numBuckets());
+		reset();
+	}
+
+	void record(uint64_t value)
+	{
+		recordMany(value, 1);
+	}
+
+	void recordMany(uint64_t value, uint64_t count)
+	{
+		if (count == 0)
+			return;
+		counts[bucketIndex(value)] += count;
+		totalCount += count;
+		sum += (double)value * count;
+		minValue = std::min(minValue, value);
+		maxValue = std::max(maxValue, value);
+	}
+
+	/* Merge another histogram with the same configuration into this one */
+	void add(const Histogram &other)
+	{
+		for (size_t i = 0; i < counts.size(); i++)
+			counts[i] += other.counts[i];
+		totalCount += other.totalCount;
+		sum += other.sum;
+		minValue = std::min(minValue, other.minValue);
+		maxValue = std::max(maxValue, other.maxValue);
+	}
+
+	/*
+	 * Remove the values of another histogram with the same configuration,
+	 * previously added to this one. If they included the minimum or maximum,
+	 * these are recomputed from the remaining buckets, hence are then only
+	 * accurate to the configured precision.
+	 */
+	void subtract(const Histogram &other)
+	{
+		for (size_t i = 0; i < counts.size(); i++)
+			counts[i] -= other.counts[i];
+		totalCount -= other.totalCount;
+		sum -= other.sum;
+		if (totalCount == 0) {
+			reset();
+			return;
+		}
+		if (other.minValue <= minValue) {
+			size_t i = 0;
+			while (counts[i] == 0)
+				i++;
+			minValue = bucketLowest(i);
+		}
+		if (other.maxValue >= maxValue) {
+			size_t i = counts.size() - 1;
+			while (counts[i] == 0)
+				i--;
+			maxValue = std::min(highestTrackableValue, bucketLowest(i) + bucketWidth(i) - 1);
+		}
+	}
+
+	void reset()
+	{
+		std::fill(counts.begin(), counts.end(), 0);
+		totalCount = 0;
+		sum = 0;
+		minValue = std::numeric_limits<uint64_t>::max();
+		maxValue = 0;
+	}
+
+	uint64_t count() const { return totalCount; }
+	uint64_t min() const { return minValue; }
+	uint64_t max() const { return maxValue; }
+	double mean() const { return totalCount ? sum / totalCount : NAN; }
+
+	/*
+	 * Value below which the given percentage of values fall (nearest rank),
+	 * reported as the middle of the corresponding bucket.
+	 */
+	double valueAtPercentile(double percentile) const
+	{
+		if (totalCount == 0)
+			return NAN;
+		if (percentile <= 0)
+			return minValue;
+		if (percentile >= 100)
+			return maxValue;
+
+		uint64_t rank = std::max<uint64_t>(1, std::ceil(percentile / 100.0 * totalCount));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			seen += counts[i];
+			if (seen >= rank) {
+				double value = bucketLowest(i) + (bucketWidth(i) - 1) / 2.0;
+				return std::max<double>(minValue, std::min<double>(maxValue, value));
+			}
+		}
+		return maxValue;
+	}
+
+	/* Raw access to buckets, e.g., for serialization */
+	uint64_t bucketCount(size_t index) const { return counts[index]; }
+
+	/* Append a compact representation listing only non-empty buckets */
+	void serialize(std::string &out) const
+	{
+		appendValue(out, (uint32_t)significantDigits);
+		appendValue(out, highestTrackableValue);
+		appendValue(out, totalCount);
+		appendValue(out, sum);
+		appendValue(out, minValue);
+		appendValue(out, maxValue);
+		uint32_t numNonEmpty = counts.size() - std::count(counts.begin(), counts.end(), 0);
+		appendValue(out, numNonEmpty);
+		for (uint32_t i = 0; i < counts.size(); i++) {
+			if (counts[i]) {
+				appendValue(out, i);
+				appendValue(out, counts[i]);
+			}
+		}
+	}
+
+	/*
+	 * Merge a histogram serialized as above into this one. Returns false if
+	 * it is malformed or has a different configuration.
+	 */
+	bool addSerialized(const char *&p, const char *end)
+	{
+		uint32_t digits, numNonEmpty;
+		uint64_t highest, otherCount, otherMin, otherMax;
+		double otherSum;
+		if (!readValue(p, end, digits) || !readValue(p, end, highest) ||
+			!readValue(p, end, otherCount) || !readValue(p, end, otherSum) ||
+			!readValue(p, end, otherMin) || !readValue(p, end, otherMax) ||
+			!readValue(p, end, numNonEmpty))
+			return false;
+		if ((int)digits != significantDigits || highest != highestTrackableValue)
+			return false;
+		for (uint32_t j = 0; j < numNonEmpty; j++) {
+			uint32_t i;
+			uint64_t count;
+			if (!readValue(p, end, i) || !readValue(p, end, count) || i >= counts.size())
+				return false;
+			counts[i] += count;
+		}
+		totalCount += otherCount;
+		sum += otherSum;
+		minValue = std::min(minValue, otherMin);
+		maxValue = std::max(maxValue, otherMax);
+		return true;
+	}
+
+private:
+	std::vector<uint64_t> counts;
+	uint64_t totalCount;
+	double sum;
+	uint64_t minValue, maxValue;
+};
+
+/*
+ * Histogram with the same layout as above, which many threads may record
+ * into concurrently without locking. Reading it requires that no thread
+ * records at the same time (see StatsShard in httpmon.cc).
+ */
+class ConcurrentHistogram : public HistogramLayout {
+public:
+	explicit ConcurrentHistogram(const HistogramLayout &layout) :
+		HistogramLayout(layout),
+		counts(new std::atomic<uint64_t>[numBuckets()])
+	{
+		for (size_t i = 0; i < numBuckets(); i++)
+			counts[i].store(0, std::memory_order_relaxed);
+		totalCount = 0;
+		sum = 0;
+		minValue = std::numeric_limits<uint64_t>::max();
+		maxValue = 0;
+	}
+
+	void record(uint64_t value)
+	{
+		counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+		totalCount.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+
+		uint64_t m = minValue.load(std::memory_order_relaxed);
+		while (value < m && !minValue.compare_exchange_weak(m, value, std::memory_order_relaxed))
+			;
+		m = maxValue.load(std::memory_order_relaxed);
+		while (value > m && !maxValue.compare_exchange_weak(m, value, std::memory_order_relaxed))
+			;
+	}
+
+	/* Add recorded values to h and reset; h must have the same layout */
+	void drainInto(Histogram &h)
+	{
+		if (totalCount.load(std::memory_order_relaxed) == 0)
+			return;
+		for (size_t i = 0, n = numBuckets(); i < n; i++) {
+			uint64_t count = counts[i].load(std::memory_order_relaxed);
+			if (count) {
+				h.counts[i] += count;
+				counts[i].store(0, std::memory_order_relaxed);
+			}
+		}
+		h.totalCount += totalCount.exchange(0, std::memory_order_relaxed);
+		h.sum += sum.exchange(0, std::memory_order_relaxed);
+		h.minValue = std::min(h.minValue, minValue.exchange(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed));
+		h.maxValue = std::max(h.maxValue, maxValue.exchange(0, std::memory_order_relaxed));
+	}
+
+private:
+	std::unique_ptr<std::atomic<uint64_t>[]> counts;
+	std::atomic<uint64_t> totalCount;
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> minValue, maxValue;
+};
+
+#endif
@@ -0,0 +1,634 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "dump.h"
+#include "histogram.h"
+
+namespace po = boost::program_options;
+
+/*
+ * Offline analysis of request dumps produced by httpmon --dump, in CSV or
+ * binary format, of any version. Files are mapped into memory and split
+ * into chunks, which threads process in parallel, each into its own
+ * statistics, which are then merged.
+ *
+ * Statistics of a window take two histograms, hence a long run has many
+ * more windows than fit in memory. A first pass finds the time range of
+ * each chunk. Windows are then processed in time order, in batches that fit
+ * in --max-memory, counting each thread's statistics: each batch reads the
+ * chunks overlapping it, and its windows are printed and freed once merged.
+ * Hence, memory is bounded by --max-memory, plus the pages of the dumps
+ * the kernel keeps mapped, whatever the length of the run or the number of
+ * requests. httpmon writes records roughly in the order replies arrive, so
+ * each chunk is usually read twice: once per pass.
+ *
+ * By default, requests are grouped into windows of a given length, by the
+ * time their reply was received, like httpmon's reports, or, for requests
+ * that were abandoned, by the time they were generated. For each window,
+ * the analyzer prints latency percentiles, throughput, error and option
+ * rates, and the client-side queuing delay, then the same over all
+ * windows.
+ *
+ * With --compare, it instead compares two runs, e.g., made with
+ * --deterministic against two versions of a server: for several latency
+ * percentiles, it prints the difference between the runs with a bootstrap
+ * confidence interval. Resampling uses the Poisson bootstrap on the
+ * latency histograms: each bucket's count is redrawn from a Poisson
+ * distribution with that mean, hence each resample costs O(buckets),
+ * whatever the number of requests.
+ */
+
+const int64_t NanosPerSecond = 1000000000;
+
+struct Options {
+	double window; /* seconds, infinite for a single window */
+	double from, to; /* seconds since the first request */
+	int threads;
+	int histogramDigits;
+	int bootstrap; /* resamples */
+	double confidence; /* percent */
+	uint64_t seed;
+	size_t maxMemory; /* bytes for window statistics */
+};
+
+/* A dump file, mapped into memory */
+struct InputFile {
+	std::string path;
+	const char *map;
+	size_t size;
+	bool binary;
+	DumpHeader header; /* binary only */
+	size_t dataStart; /* offset of the first record or CSV line */
+	std::vector<int> columns; /* CSV only: index of each CsvField in a line, -1 if missing */
+
+	InputFile() : map(NULL), size(0), binary(false), dataStart(0) {}
+	~InputFile() { if (map) munmap((void *)map, size); }
+};
+
+/* CSV columns used, by header name; older dumps lack some */
+enum CsvField {
+	CSV_GENERATED_AT,
+	CSV_SENT_AT,
+	CSV_REPLIED_AT,
+	CSV_OPTION1,
+	CSV_OPTION2,
+	CSV_ERROR,
+	CSV_STATUS,
+	CSV_ERROR_CLASS,
+	NUM_CSV_FIELDS
+};
+
+const char *const CsvFieldNames[NUM_CSV_FIELDS] = {
+	"generatedAt", "sentAt", "repliedAt", "option1", "option2", "error", "status", "errorClass"
+};
+
+/* Map a dump and recognize its format; throws std::runtime_error on errors */
+std::unique_ptr<InputFile> openInput(const std::string &path)
+{
+	std::unique_ptr<InputFile> file(new InputFile);
+	file->path = path;
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+		throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+	file->size = st.st_size;
+	if (file->size > 0) {
+		void *map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error("cannot map " + path + ": " + strerror(errno));
+		}
+		madvise(map, file->size, MADV_SEQUENTIAL);
+		file->map = (const char *)map;
+	}
+	close(fd);
+
+	if (file->size >= sizeof(DumpHeader) && memcmp(file->map, DumpMagic, sizeof(DumpMagic)) == 0) {
+		file->binary = true;
+		memcpy(&file->header, file->map, sizeof(DumpHeader));
+		if (!isSupportedDump(file->header))
+			throw std::runtime_error(path + ": unsupported dump version " + std::to_string(file->header.version));
+		file->dataStart = sizeof(DumpHeader);
+		return file;
+	}
+
+	/* CSV: find columns in the header line */
+	const char *end = file->map + file->size;
+	const char *eol = file->size ? (const char *)memchr(file->map, '\n', file->size) : NULL;
+	if (eol == NULL || strncmp(file->map, "generatedAt,", strlen("generatedAt,")) != 0)
+		throw std::runtime_error(path + ": neither a binary nor a CSV httpmon dump");
+	std::vector<std::string> names;
+	for (const char *p = file->map; p < eol; ) {
+		const char *comma = std::find(p, eol, ',');
+		names.push_back(std::string(p, comma));
+		p = comma + 1;
+	}
+	file->columns.assign(NUM_CSV_FIELDS, -1);
+	for (int i = 0; i < NUM_CSV_FIELDS; i++) {
+		auto it = std::find(names.begin(), names.end(), CsvFieldNames[i]);
+		if (it != names.end())
+			file->columns[i] = it - names.begin();
+	}
+	if (file->columns[CSV_GENERATED_AT] < 0 || file->columns[CSV_REPLIED_AT] < 0 || file->columns[CSV_ERROR] < 0)
+		throw std::runtime_error(path + ": CSV dump lacks generatedAt, repliedAt or error");
+	file->dataStart = std::min(eol + 1, end) - file->map;
+	return file;
+}
+
+/* Seconds since the epoch, as written in CSV dumps, to nanoseconds; DumpNoTime if unknown */
+int64_t csvTime(const char *field)
+{
+	double seconds = strtod(field, NULL);
+	if (std::isnan(seconds))
+		return DumpNoTime;
+	return llround(seconds * NanosPerSecond);
+}
+
+/* Parse a CSV line into a record with times since the epoch; returns false if malformed */
+bool parseCsvLine(const InputFile &file, const char *line, const char *eol, DumpRecord &r)
+{
+	const int MaxColumns = 32;
+	const char *fields[MaxColumns];
+	int numFields = 0;
+	for (const char *p = line; p <= eol && numFields < MaxColumns; ) {
+		fields[numFields++] = p;
+		p = std::find(p, eol, ',') + 1;
+	}
+	auto field = [&](CsvField f) -> const char * {
+		int column = file.columns[f];
+		return (column >= 0 && column < numFields) ? fields[column] : NULL;
+	};
+	if (field(CSV_REPLIED_AT) == NULL || field(CSV_ERROR) == NULL)
+		return false;
+
+	memset(&r, 0, sizeof(r));
+	r.generatedAt = csvTime(field(CSV_GENERATED_AT));
+	r.sentAt = field(CSV_SENT_AT) ? csvTime(field(CSV_SENT_AT)) : r.generatedAt;
+	r.repliedAt = csvTime(field(CSV_REPLIED_AT));
+	if (atoi(field(CSV_ERROR)))
+		r.flags |= DUMPFLAGS_ERROR;
+	if (field(CSV_OPTION1) && atoi(field(CSV_OPTION1)))
+		r.flags |= DUMPFLAGS_OPTION1;
+	if (field(CSV_OPTION2) && atoi(field(CSV_OPTION2)))
+		r.flags |= DUMPFLAGS_OPTION2;
+	if (field(CSV_STATUS))
+		r.status = atoi(field(CSV_STATUS));
+	if (const char *errorClass = field(CSV_ERROR_CLASS)) {
+		size_t length = std::find(errorClass, eol, ',') - errorClass;
+		for (int i = 0; i < NUM_ERROR_CLASSES; i++) {
+			if (strlen(ErrorClassNames[i]) == length && strncmp(errorClass, ErrorClassNames[i], length) == 0)
+				r.errorClass = i;
+		}
+	}
+	else if (r.flags & DUMPFLAGS_ERROR)
+		r.errorClass = (r.repliedAt == DumpNoTime) ? ERROR_ABANDONED : ERROR_OTHER;
+	return r.generatedAt != DumpNoTime;
+}
+
+/* Part of a file processed by one thread at a time */
+struct Chunk {
+	const InputFile *file;
+	size_t begin, end; /* byte offsets; CSV chunks start at a line and end after one */
+	int64_t firstTime, lastTime; /* range of the times its records are accounted at, see recordTime() */
+};
+
+/* Split files into about n chunks per file, at record or line boundaries */
+std::vector<Chunk> splitChunks(const std::vector<std::unique_ptr<InputFile>> &files, int n)
+{
+	std::vector<Chunk> chunks;
+	for (auto &file : files) {
+		size_t dataSize = file->size - file->dataStart;
+		size_t unit = file->binary ? file->header.recordSize : 1;
+		size_t chunkSize = std::max<size_t>(1, dataSize / unit / n) * unit;
+		size_t begin = file->dataStart;
+		while (begin < file->size) {
+			size_t end = std::min(file->size, begin + chunkSize);
+			if (file->binary)
+				end = begin + (end - begin) / unit * unit; /* ignore a truncated last record */
+			else {
+				const char *eol = (const char *)memchr(file->map + end - 1, '\n', file->size - end + 1);
+				end = eol ? eol - file->map + 1 : file->size;
+			}
+			if (end <= begin)
+				break;
+			chunks.push_back(Chunk{ file.get(), begin, end,
+				std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min() });
+			begin = end;
+		}
+	}
+	return chunks;
+}
+
+/* Call f for each record of a chunk, with times converted to nanoseconds since the epoch */
+template<typename F>
+void forEachRecord(const Chunk &chunk, F f)
+{
+	const InputFile &file = *chunk.file;
+	DumpRecord r;
+	if (file.binary) {
+		int64_t offset = file.header.clockOffset;
+		for (size_t p = chunk.begin; p + file.header.recordSize <= chunk.end; p += file.header.recordSize) {
+			readDumpRecord(file.map + p, file.header, r);
+			r.generatedAt += offset;
+			r.sentAt += offset;
+			if (r.repliedAt != DumpNoTime)
+				r.repliedAt += offset;
+			f(r);
+		}
+		return;
+	}
+	const char *p = file.map + chunk.begin, *end = file.map + chunk.end;
+	while (p < end) {
+		const char *eol = (const char *)memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		if (parseCsvLine(file, p, eol, r))
+			f(r);
+		p = eol + 1;
+	}
+}
+
+/* Run f(threadIndex, chunk) over all chunks, on the given number of threads */
+template<typename F>
+void parallelForEachChunk(std::vector<Chunk> &chunks, int numThreads, F f)
+{
+	std::atomic<size_t> next(0);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < numThreads; i++) {
+		threads.emplace_back([&, i] {
+			for (size_t c = next++; c < chunks.size(); c = next++)
+				f(i, chunks[c]);
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+}
+
+/* Statistics of requests in one window */
+struct WindowStats {
+	Histogram latencies; /* successful requests, nanoseconds */
+	Histogram queueDelays; /* sentAt - generatedAt, nanoseconds */
+	uint64_t numRequests;
+	uint64_t numErrors;
+	uint64_t numOptions[2];
+	uint64_t numErrorClasses[NUM_ERROR_CLASSES];
+
+	explicit WindowStats(int histogramDigits) :
+		latencies(histogramDigits),
+		queueDelays(histogramDigits),
+		numRequests(0),
+		numErrors(0)
+	{
+		std::fill(numOptions, numOptions + 2, 0);
+		std::fill(numErrorClasses, numErrorClasses + NUM_ERROR_CLASSES, 0);
+	}
+
+	void record(const DumpRecord &r)
+	{
+		numRequests++;
+		if (r.repliedAt != DumpNoTime || !(r.flags & DUMPFLAGS_ERROR))
+			queueDelays.record(std::max<int64_t>(0, r.sentAt - r.generatedAt));
+		if (r.flags & DUMPFLAGS_ERROR) {
+			numErrors++;
+			numErrorClasses[std::min<int>(r.errorClass, ERROR_OTHER)]++;
+			return;
+		}
+		latencies.record(std::max<int64_t>(0, r.repliedAt - r.generatedAt));
+		if (r.flags & DUMPFLAGS_OPTION1)
+			numOptions[0]++;
+		if (r.flags & DUMPFLAGS_OPTION2)
+			numOptions[1]++;
+	}
+
+	void add(const WindowStats &other)
+	{
+		latencies.add(other.latencies);
+		queueDelays.add(other.queueDelays);
+		numRequests += other.numRequests;
+		numErrors += other.numErrors;
+		for (int i = 0; i < 2; i++)
+			numOptions[i] += other.numOptions[i];
+		for (int i = 0; i < NUM_ERROR_CLASSES; i++)
+			numErrorClasses[i] += other.numErrorClasses[i];
+	}
+};
+
+/* Statistics of a run; those of windows are passed on as they are complete, see analyze() */
+struct RunStats {
+	int64_t start; /* generation time of the first request, nanoseconds since the epoch */
+	int64_t from, to; /* time range analyzed, relative to start */
+	int64_t window; /* length of windows */
+	WindowStats total;
+
+	explicit RunStats(int histogramDigits) : start(0), from(0), to(0), window(1), total(histogramDigits) {}
+
+	/* Start of window i, relative to start */
+	int64_t windowStart(size_t i) const { return from + (int64_t)i * window; }
+
+	/* Length of window i in seconds; the last one may be cut short by the end of the range */
+	double windowLength(size_t i) const { return std::min(window, to - windowStart(i)) / 1e9; }
+};
+
+/* When a request is accounted: when its reply was received, or it was generated if it was abandoned */
+int64_t recordTime(const DumpRecord &r)
+{
+	return (r.repliedAt != DumpNoTime) ? r.repliedAt : r.generatedAt;
+}
+
+/*
+ * Analyze the dumps of one run. Calls onWindow(run, i, stats) for each
+ * non-empty window i, in time order; stats are freed afterwards.
+ */
+std::unique_ptr<RunStats> analyze(const std::vector<std::string> &paths, const Options &options,
+	const std::function<void(const RunStats &, size_t, const WindowStats &)> &onWindow)
+{
+	std::vector<std::unique_ptr<InputFile>> files;
+	for (const std::string &path : paths)
+		files.push_back(openInput(path));
+	std::vector<Chunk> chunks = splitChunks(files, 4 * options.threads);
+	std::unique_ptr<RunStats> run(new RunStats(options.histogramDigits));
+
+	/* First pass: when did the run start and end, and which times does each chunk cover? */
+	std::vector<int64_t> starts(options.threads, std::numeric_limits<int64_t>::max());
+	parallelForEachChunk(chunks, options.threads, [&](int thread, Chunk &chunk) {
+		forEachRecord(chunk, [&](const DumpRecord &r) {
+			starts[thread] = std::min(starts[thread], r.generatedAt);
+			chunk.firstTime = std::min(chunk.firstTime, recordTime(r));
+			chunk.lastTime = std::max(chunk.lastTime, recordTime(r));
+		});
+	});
+	run->start = *std::min_element(starts.begin(), starts.end());
+	int64_t end = std::numeric_limits<int64_t>::min();
+	for (const Chunk &chunk : chunks)
+		end = std::max(end, chunk.lastTime);
+	if (run->start > end)
+		return run; /* no requests */
+
+	int64_t from = run->from = std::max<int64_t>(0, options.from * NanosPerSecond);
+	int64_t to = run->to = std::min<double>(end - run->start + 1, options.to * NanosPerSecond);
+	int64_t window = run->window = std::isinf(options.window) ? std::max<int64_t>(1, to - from) : options.window * NanosPerSecond;
+	size_t numWindows = (to > from) ? (to - from + window - 1) / window : 0;
+
+	/* As many windows per batch as fit in memory, for each thread; merging reuses one thread's */
+	size_t windowBytes = sizeof(WindowStats) + 2 * Histogram(options.histogramDigits).numBuckets() * sizeof(uint64_t);
+	size_t batchSize = std::max<size_t>(1, options.maxMemory / windowBytes / options.threads);
+
+	for (size_t first = 0; first < numWindows; first += batchSize) {
+		size_t n = std::min(batchSize, numWindows - first);
+		int64_t batchFrom = from + (int64_t)first * window;
+		int64_t batchTo = std::min(to, batchFrom + (int64_t)n * window);
+
+		/* Second pass, over chunks overlapping the batch: account requests in their window, lazily allocated per thread */
+		std::vector<Chunk> overlapping;
+		for (const Chunk &chunk : chunks) {
+			if (chunk.firstTime - run->start < batchTo && chunk.lastTime - run->start >= batchFrom)
+				overlapping.push_back(chunk);
+		}
+		std::vector<std::vector<std::unique_ptr<WindowStats>>> partial(options.threads);
+		for (auto &p : partial)
+			p.resize(n);
+		parallelForEachChunk(overlapping, options.threads, [&](int thread, Chunk &chunk) {
+			forEachRecord(chunk, [&](const DumpRecord &r) {
+				int64_t t = recordTime(r) - run->start;
+				if (t < batchFrom || t >= batchTo)
+					return;
+				std::unique_ptr<WindowStats> &w = partial[thread][(t - batchFrom) / window];
+				if (!w)
+					w.reset(new WindowStats(options.histogramDigits));
+				w->record(r);
+			});
+		});
+
+		/* Merge into the first thread's, in parallel over windows */
+		std::atomic<size_t> next(0);
+		std::vector<std::thread> threads;
+		for (int i = 0; i < options.threads; i++) {
+			threads.emplace_back([&] {
+				for (size_t w = next++; w < n; w = next++) {
+					for (size_t t = 1; t < partial.size(); t++) {
+						if (!partial[t][w])
+							continue;
+						if (!partial[0][w])
+							partial[0][w].swap(partial[t][w]);
+						else
+							partial[0][w]->add(*partial[t][w]);
+						partial[t][w].reset();
+					}
+				}
+			});
+		}
+		for (auto &t : threads)
+			t.join();
+
+		for (size_t w = 0; w < n; w++) {
+			if (!partial[0][w])
+				continue;
+			run->total.add(*partial[0][w]);
+			onWindow(*run, first + w, *partial[0][w]);
+			partial[0][w].reset();
+		}
+	}
+	return run;
+}
+
+/* Print statistics of a window of the given length in seconds, after the given keys */
+void printWindow(const std::string &keys, const WindowStats &w, double length)
+{
+	const double ms = 1e-6;
+	const Histogram &h = w.latencies, &q = w.queueDelays;
+	uint64_t numSuccessful = h.count();
+	printf("%s requests=%llu errors=%llu errorRate=%.2f%% throughput=%.1frps "
+		"latency=%.2f:%.2f:%.2f:%.2f:%.2f:(%.2f)ms latency95=%.2fms latency99=%.2fms latency999=%.2fms "
+		"rr=%.2f%% cr=%.2f%% queueDelay=%.2f:%.2f:%.2f:%.2f:%.2f:(%.2f)ms queueDelay99=%.2fms",
+		keys.c_str(),
+		(unsigned long long)w.numRequests,
+		(unsigned long long)w.numErrors,
+		w.numRequests ? 100.0 * w.numErrors / w.numRequests : 0.0,
+		length > 0 ? numSuccessful / length : 0.0,
+		h.count() ? h.min() * ms : NAN, h.valueAtPercentile(25) * ms, h.valueAtPercentile(50) * ms,
+		h.valueAtPercentile(75) * ms, h.count() ? h.max() * ms : NAN, h.mean() * ms,
+		h.valueAtPercentile(95) * ms, h.valueAtPercentile(99) * ms, h.valueAtPercentile(99.9) * ms,
+		numSuccessful ? 100.0 * w.numOptions[0] / numSuccessful : 0.0,
+		numSuccessful ? 100.0 * w.numOptions[1] / numSuccessful : 0.0,
+		q.count() ? q.min() * ms : NAN, q.valueAtPercentile(25) * ms, q.valueAtPercentile(50) * ms,
+		q.valueAtPercentile(75) * ms, q.count() ? q.max() * ms : NAN, q.mean() * ms,
+		q.valueAtPercentile(99) * ms);
+	for (int i = ERROR_NONE + 1; i < NUM_ERROR_CLASSES; i++) {
+		if (w.numErrorClasses[i])
+			printf(" %sErrors=%llu", ErrorClassNames[i], (unsigned long long)w.numErrorClasses[i]);
+	}
+	printf("\n");
+}
+
+int printWindows(const std::vector<std::string> &paths, const Options &options)
+{
+	char keys[128];
+	double span = 0;
+	std::unique_ptr<RunStats> run = analyze(paths, options, [&](const RunStats &run, size_t i, const WindowStats &w) {
+		int64_t start = run.windowStart(i);
+		snprintf(keys, sizeof(keys), "start=%.3f time=%.3f", start / 1e9, (run.start + start) / 1e9);
+		printWindow(keys, w, run.windowLength(i));
+		span = (start - run.from) / 1e9 + run.windowLength(i);
+	});
+	snprintf(keys, sizeof(keys), "window=all start=%.3f time=%.3f span=%.3fs",
+		run->from / 1e9, (run->start + run->from) / 1e9, span);
+	printWindow(keys, run->total, span);
+	return 0;
+}
+
+/* Latency histogram as (bucket value, count) pairs, for resampling */
+struct Buckets {
+	std::vector<uint64_t> values, counts;
+
+	explicit Buckets(const Histogram &h)
+	{
+		for (size_t i = 0; i < h.numBuckets(); i++) {
+			if (h.bucketCount(i)) {
+				values.push_back(h.bucketLowest(i) + (h.bucketWidth(i) - 1) / 2);
+				counts.push_back(h.bucketCount(i));
+			}
+		}
+	}
+
+	/* Poisson bootstrap resample into h */
+	template<typename RNG>
+	void resample(Histogram &h, RNG &rng) const
+	{
+		h.reset();
+		for (size_t i = 0; i < values.size(); i++)
+			h.recordMany(values[i], std::poisson_distribution<uint64_t>(counts[i])(rng));
+	}
+};
+
+int compareRuns(const std::vector<std::string> &pathsA, const std::vector<std::string> &pathsB, Options options)
+{
+	const double Percentiles[] = { 50, 90, 95, 99, 99.9 };
+	const size_t NumPercentiles = sizeof(Percentiles) / sizeof(Percentiles[0]);
+
+	options.window = INFINITY;
+	auto ignore = [](const RunStats &, size_t, const WindowStats &) {};
+	std::unique_ptr<RunStats> a = analyze(pathsA, options, ignore);
+	std::unique_ptr<RunStats> b = analyze(pathsB, options, ignore);
+	const Histogram &ha = a->total.latencies, &hb = b->total.latencies;
+	if (ha.count() == 0 || hb.count() == 0) {
+		fprintf(stderr, "Both runs need successful requests to be compared\n");
+		return 1;
+	}
+
+	/* Resample differences of percentiles, in parallel */
+	Buckets bucketsA(ha), bucketsB(hb);
+	std::vector<std::vector<double>> diffs(NumPercentiles, std::vector<double>(options.bootstrap));
+	std::vector<std::thread> threads;
+	for (int t = 0; t < options.threads; t++) {
+		threads.emplace_back([&, t] {
+			std::mt19937_64 rng(options.seed + t);
+			Histogram ra(options.histogramDigits), rb(options.histogramDigits);
+			for (int i = t; i < options.bootstrap; i += options.threads) {
+				bucketsA.resample(ra, rng);
+				bucketsB.resample(rb, rng);
+				for (size_t p = 0; p < NumPercentiles; p++)
+					diffs[p][i] = rb.valueAtPercentile(Percentiles[p]) - ra.valueAtPercentile(Percentiles[p]);
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+
+	const double ms = 1e-6;
+	double alpha = (100 - options.confidence) / 100;
+	printf("runs=a,b requestsA=%llu requestsB=%llu errorRateA=%.2f%% errorRateB=%.2f%% meanA=%.2fms meanB=%.2fms\n",
+		(unsigned long long)a->total.numRequests, (unsigned long long)b->total.numRequests,
+		a->total.numRequests ? 100.0 * a->total.numErrors / a->total.numRequests : 0.0,
+		b->total.numRequests ? 100.0 * b->total.numErrors / b->total.numRequests : 0.0,
+		ha.mean() * ms, hb.mean() * ms);
+	for (size_t p = 0; p < NumPercentiles; p++) {
+		std::vector<double> &d = diffs[p];
+		std::sort(d.begin(), d.end());
+		size_t low = std::min(d.size() - 1, (size_t)std::floor(alpha / 2 * d.size()));
+		size_t high = std::min(d.size() - 1, (size_t)std::ceil((1 - alpha / 2) * d.size()) - 1);
+		double va = ha.valueAtPercentile(Percentiles[p]), vb = hb.valueAtPercentile(Percentiles[p]);
+		bool significant = d[low] > 0 || d[high] < 0;
+		printf("percentile=%g a=%.2fms b=%.2fms diff=%.2fms diffLow=%.2fms diffHigh=%.2fms relDiff=%.1f%% confidence=%g%% significant=%d\n",
+			Percentiles[p], va * ms, vb * ms, (vb - va) * ms, d[low] * ms, d[high] * ms,
+			(vb - va) / va * 100, options.confidence, significant);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	std::vector<std::string> paths, comparePaths;
+	size_t maxMemoryMiB;
+
+	po::options_description desc("Analyze httpmon request dumps, in CSV or binary format:\n"
+		"  httpmon-analyze [options] DUMP...\n"
+		"  httpmon-analyze [options] DUMP... --compare DUMP...\n"
+		"Several dumps of a run, e.g., rotated or of workers, are analyzed together.\n\nOptions");
+	desc.add_options()
+		("help", "produce help message")
+		("window", po::value<double>(&options.window)->default_value(1), "report statistics per window of this many seconds; 0 for a single window")
+		("from", po::value<double>(&options.from)->default_value(0), "ignore requests accounted before this many seconds after the first request, e.g., warm-up")
+		("to", po::value<double>(&options.to)->default_value(INFINITY), "ignore requests accounted from this many seconds after the first request")
+		("threads", po::value<int>(&options.threads)->default_value(std::max(1u, std::thread::hardware_concurrency())), "set number of threads (default: one per core)")
+		("histogram-digits", po::value<int>(&options.histogramDigits)->default_value(3), "set the number of significant decimal digits kept by latency histograms (1 to 5)")
+		("compare", po::value<std::vector<std::string>>(&comparePaths)->multitoken(), "compare the latencies of the run given by DUMP... (a) to the run given by these dumps (b)")
+		("bootstrap", po::value<int>(&options.bootstrap)->default_value(1000), "with --compare, number of bootstrap resamples")
+		("confidence", po::value<double>(&options.confidence)->default_value(95), "with --compare, confidence level of intervals in percent")
+		("seed", po::value<uint64_t>(&options.seed)->default_value(1), "with --compare, seed of the resampling")
+		("max-memory", po::value<size_t>(&maxMemoryMiB)->default_value(256), "keep statistics of at most this many MiB of windows in memory; longer runs are processed in several batches of windows, each reading the part of the dumps it covers")
+		("dump", po::value<std::vector<std::string>>(&paths), "dump to analyze, may also be given without --dump")
+	;
+	po::positional_options_description positional;
+	positional.add("dump", -1);
+
+	po::variables_map vm;
+	try {
+		po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+		po::notify(vm);
+	}
+	catch (const po::error &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	if (vm.count("help") || paths.empty()) {
+		std::cerr << desc << std::endl;
+		return 1;
+	}
+	if (options.window <= 0)
+		options.window = INFINITY;
+	if (options.threads < 1 || options.bootstrap < 1 || options.confidence <= 0 || options.confidence >= 100 ||
+		options.from < 0 || options.to <= options.from || maxMemoryMiB < 1) {
+		std::cerr << "Invalid --threads, --bootstrap, --confidence, --from, --to or --max-memory" << std::endl;
+		return 1;
+	}
+	options.maxMemory = maxMemoryMiB << 20;
+
+	try {
+		if (!comparePaths.empty())
+			return compareRuns(paths, comparePaths, options);
+		return printWindows(paths, options);
+	}
+	catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <iostream>
+#include <numeric>
+#include <signal.h>
+#include <sstream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "dump.h"
+#include "loopback-server.h"
+
+namespace po = boost::program_options;
+
+/*
+ * Benchmark and accuracy suite of httpmon itself, run against a loopback
+ * HTTP server embedded in this program, hence offline on a single machine.
+ * Each scenario starts httpmon, lets it warm up, then measures for a given
+ * duration:
+ *
+ * - throughput: the maximum rate httpmon achieves against a server that
+ *   replies immediately, per CPU-second it consumes, and its CPU time per
+ *   request;
+ * - pacing: how well the arrivals seen by the server follow the configured
+ *   rate and the exponential distribution of inter-arrival times, with
+ *   --rate and with --open --thinktime;
+ * - bias: how much the latencies httpmon measures exceed the delays the
+ *   server injected, fixed or exponentially distributed.
+ */
+
+struct Options {
+	std::string httpmon;
+	double duration;
+	double warmup;
+	int concurrency;
+	double rate;
+	double delayUs;
+	size_t bodySize;
+	bool verbose;
+};
+
+struct Measurement {
+	int64_t start, end; /* CLOCK_MONOTONIC nanoseconds */
+	double cpuSeconds;  /* user and system time of httpmon between start and end */
+};
+
+/* User and system time consumed so far by all threads of a process */
+double cpuSeconds(pid_t pid)
+{
+	std::string path = "/proc/" + std::to_string(pid) + "/stat";
+	FILE *f = fopen(path.c_str(), "r");
+	if (f == NULL)
+		return NAN;
+	char buf[1024];
+	size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[len] = '\0';
+
+	/* Fields after the command name, which may contain spaces */
+	const char *p = strrchr(buf, ')');
+	unsigned long utime, stime;
+	if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return NAN;
+	return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+void sleepFor(double seconds)
+{
+	struct timespec ts = { (time_t)seconds, (long)((seconds - (time_t)seconds) * 1e9) };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/* Run httpmon with the given arguments; returns false if it did not run until stopped */
+bool runHttpmon(const Options &options, const std::vector<std::string> &args, Measurement &m)
+{
+	std::vector<char *> argv;
+	argv.push_back((char *)options.httpmon.c_str());
+	for (const std::string &arg : args)
+		argv.push_back((char *)arg.c_str());
+	argv.push_back(NULL);
+
+	if (options.verbose) {
+		fprintf(stderr, "Running");
+		for (const std::string &arg : args)
+			fprintf(stderr, " %s", arg.c_str());
+		fprintf(stderr, "\n");
+	}
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("Cannot fork");
+		return false;
+	}
+	if (pid == 0) {
+		if (!options.verbose) {
+			int devnull = open("/dev/null", O_WRONLY);
+			dup2(devnull, 1);
+			dup2(devnull, 2);
+		}
+		execv(argv[0], argv.data());
+		fprintf(stderr, "Cannot execute %s: %s\n", argv[0], strerror(errno));
+		_exit(127);
+	}
+
+	sleepFor(options.warmup);
+	double cpuStart = cpuSeconds(pid);
+	m.start = LoopbackServer::now();
+	sleepFor(options.duration);
+	double cpuEnd = cpuSeconds(pid);
+	m.end = LoopbackServer::now();
+	m.cpuSeconds = cpuEnd - cpuStart;
+
+	bool running = (kill(pid, SIGINT) == 0) && !std::isnan(m.cpuSeconds);
+	int status;
+	waitpid(pid, &status, 0);
+	if (!running || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "httpmon did not run until stopped (status %d); rerun with --verbose\n", status);
+		return false;
+	}
+	return true;
+}
+
+std::string url(const LoopbackServer &server)
+{
+	return "http://127.0.0.1:" + std::to_string(server.port()) + "/";
+}
+
+/* Samples at times within [m.start, m.end) */
+std::vector<int64_t> during(const Measurement &m, const std::vector<int64_t> &times, const std::vector<int64_t> &samples)
+{
+	std::vector<int64_t> selected;
+	for (size_t i = 0; i < times.size(); i++) {
+		if (times[i] >= m.start && times[i] < m.end)
+			selected.push_back(samples[i]);
+	}
+	return selected;
+}
+
+/* Quantile of sorted values */
+double quantile(const std::vector<double> &sorted, double q)
+{
+	if (sorted.empty())
+		return NAN;
+	return sorted[std::min(sorted.size() - 1, (size_t)(q * sorted.size()))];
+}
+
+double mean(const std::vector<double> &values)
+{
+	return std::accumulate(values.begin(), values.end(), 0.0) / values.size();
+}
+
+/*
+ * One-sample Kolmogorov-Smirnov test of samples against the exponential
+ * distribution with the given rate: computes the distance d between the
+ * empirical and the expected distribution functions, and the asymptotic
+ * p-value of observing at least this distance if samples followed it.
+ */
+void ksTestExponential(std::vector<double> samples, double rate, double &d, double &p)
+{
+	std::sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	d = 0;
+	for (size_t i = 0; i < n; i++) {
+		double expected = 1 - exp(-rate * samples[i]);
+		d = std::max(d, std::max(expected - (double)i / n, (double)(i + 1) / n - expected));
+	}
+
+	double lambda = (sqrt(n) + 0.12 + 0.11 / sqrt(n)) * d;
+	p = 0;
+	for (int k = 1; k <= 100; k++)
+		p += 2 * ((k % 2) ? 1 : -1) * exp(-2 * k * k * lambda * lambda);
+	p = std::min(1.0, std::max(0.0, p));
+}
+
+bool benchThroughput(const Options &options, const std::string &engine)
+{
+	LoopbackServer server(DELAY_FIXED, 0, options.bodySize);
+	Measurement m;
+	if (!runHttpmon(options, { "--url", url(server), "--engine", engine,
+		"--concurrency", std::to_string(options.concurrency), "--thinktime", "0" }, m))
+		return false;
+	server.stop();
+
+	double seconds = (m.end - m.start) / 1e9;
+	size_t requests = during(m, server.arrivals(), server.arrivals()).size();
+	printf("scenario=throughput engine=%s concurrency=%d requests=%zu rps=%.0f cpu=%.2fs "
+		"rpsPerCore=%.0f cpuPerRequest=%.1fus\n",
+		engine.c_str(), options.concurrency, requests, requests / seconds, m.cpuSeconds,
+		requests / m.cpuSeconds, m.cpuSeconds / requests * 1e6);
+	return true;
+}
+
+bool benchPacing(const Options &options, bool openModel)
+{
+	LoopbackServer server(DELAY_FIXED, 0, options.bodySize);
+	const int Clients = 100;
+	std::vector<std::string> args = { "--url", url(server), "--concurrency", std::to_string(Clients) };
+	if (openModel)
+		args.insert(args.end(), { "--open", "--thinktime", std::to_string(Clients / options.rate) });
+	else
+		args.insert(args.end(), { "--rate", std::to_string(options.rate) });
+	Measurement m;
+	if (!runHttpmon(options, args, m))
+		return false;
+	server.stop();
+
+	std::vector<int64_t> arrivals = during(m, server.arrivals(), server.arrivals());
+	if (arrivals.size() < 2) {
+		fprintf(stderr, "Too few arrivals to check pacing\n");
+		return false;
+	}
+	std::sort(arrivals.begin(), arrivals.end()); /* connections are served in any order */
+	std::vector<double> interArrivals;
+	for (size_t i = 1; i < arrivals.size(); i++)
+		interArrivals.push_back((arrivals[i] - arrivals[i - 1]) / 1e9);
+	double achievedRate = interArrivals.size() / ((arrivals.back() - arrivals.front()) / 1e9);
+	double d, p;
+	ksTestExponential(interArrivals, options.rate, d, p);
+
+	printf("scenario=pacing mode=%s configuredRate=%.0f achievedRate=%.1f rateError=%+.2f%% "
+		"interArrivals=%zu ks=%.4f ksP=%.3f\n",
+		openModel ? "open-thinktime" : "rate", options.rate, achievedRate,
+		(achievedRate / options.rate - 1) * 100, interArrivals.size(), d, p);
+	return true;
+}
+
+bool benchBias(const Options &options, DelayDistribution distribution)
+{
+	LoopbackServer server(distribution, options.delayUs / 1e6, options.bodySize);
+	char dumpPath[] = "/tmp/httpmon-bench-XXXXXX";
+	int fd = mkstemp(dumpPath);
+	if (fd < 0) {
+		perror("Cannot create temporary dump file");
+		return false;
+	}
+	close(fd);
+
+	/* Low rate, many clients: requests should not queue, neither in httpmon nor in the server */
+	double rate = std::min(options.rate, 0.1 / (options.delayUs / 1e6));
+	Measurement m;
+	bool ok = runHttpmon(options, { "--url", url(server), "--concurrency", "100",
+		"--rate", std::to_string(rate), "--dump", "--dump-format", "binary", "--dump-file", dumpPath }, m);
+	server.stop();
+	DumpHeader header;
+	std::vector<DumpRecord> records;
+	std::string error;
+	if (ok && !readDump(dumpPath, header, records, error)) {
+		fprintf(stderr, "Cannot read dump %s: %s\n", dumpPath, error.c_str());
+		ok = false;
+	}
+	unlink(dumpPath);
+	if (!ok)
+		return false;
+
+	std::vector<double> measured, injected;
+	for (const DumpRecord &r : records) {
+		if (!(r.flags & DUMPFLAGS_ERROR) && r.repliedAt != DumpNoTime && r.generatedAt >= m.start && r.generatedAt < m.end)
+			measured.push_back((r.repliedAt - r.generatedAt) / 1e3);
+	}
+	for (int64_t delay : during(m, server.arrivals(), server.delays()))
+		injected.push_back(delay / 1e3);
+	if (measured.empty() || injected.empty()) {
+		fprintf(stderr, "No requests to compare latencies\n");
+		return false;
+	}
+	std::sort(measured.begin(), measured.end());
+	std::sort(injected.begin(), injected.end());
+	std::vector<double> lateness;
+	for (int64_t late : server.lateness())
+		lateness.push_back(late / 1e3);
+	std::sort(lateness.begin(), lateness.end());
+
+	printf("scenario=bias delay=%s:%.0fus rate=%.0f requests=%zu "
+		"injected=%.0f:%.0f:%.0f:(%.0f)us measured=%.0f:%.0f:%.0f:(%.0f)us "
+		"bias=%+.0fus bias50=%+.0fus bias99=%+.0fus serverLate50=%.0fus serverLate99=%.0fus\n",
+		distribution == DELAY_FIXED ? "fixed" : "exponential", options.delayUs, rate, measured.size(),
+		quantile(injected, 0), quantile(injected, 0.5), quantile(injected, 0.99), mean(injected),
+		quantile(measured, 0), quantile(measured, 0.5), quantile(measured, 0.99), mean(measured),
+		mean(measured) - mean(injected),
+		quantile(measured, 0.5) - quantile(injected, 0.5),
+		quantile(measured, 0.99) - quantile(injected, 0.99),
+		quantile(lateness, 0.5), quantile(lateness, 0.99));
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	std::string scenarios;
+
+	po::options_description desc("Benchmark httpmon against a loopback HTTP server");
+	desc.add_options()
+		("help", "produce help message")
+		("httpmon", po::value<std::string>(&options.httpmon)->default_value("./httpmon"), "set httpmon executable to benchmark")
+		("scenarios", po::value<std::string>(&scenarios)->default_value("throughput,pacing,bias"), "run these comma-separated scenarios: 'throughput', 'pacing', 'bias'")
+		("duration", po::value<double>(&options.duration)->default_value(5), "measure each scenario for this many seconds")
+		("warmup", po::value<double>(&options.warmup)->default_value(1), "let httpmon start for this many seconds before measuring")
+		("concurrency", po::value<int>(&options.concurrency)->default_value(64), "set concurrency of the throughput scenario")
+		("rate", po::value<double>(&options.rate)->default_value(1000), "set arrival rate of the pacing scenario, in requests per second")
+		("delay-us", po::value<double>(&options.delayUs)->default_value(1000), "set mean delay injected by the server in the bias scenario, in microseconds")
+		("body-size", po::value<size_t>(&options.bodySize)->default_value(64), "set size of reply bodies in bytes")
+		("verbose", "show httpmon's command-line and output")
+	;
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	}
+	catch (po::error &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	if (vm.count("help")) {
+		std::cerr << desc << "\n";
+		return 1;
+	}
+	options.verbose = vm.count("verbose");
+	if (options.duration <= 0 || options.warmup < 0 || options.concurrency < 1 || options.rate <= 0 || options.delayUs <= 0) {
+		fprintf(stderr, "Durations, concurrency, rate and delay must be positive\n");
+		return 1;
+	}
+	if (access(options.httpmon.c_str(), X_OK) != 0) {
+		fprintf(stderr, "Cannot execute %s; build it first\n", options.httpmon.c_str());
+		return 1;
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	bool ok = true;
+	std::string scenario;
+	std::istringstream scenarioList(scenarios);
+	while (ok && std::getline(scenarioList, scenario, ',')) {
+		if (scenario == "throughput")
+			ok = benchThroughput(options, "threads") && benchThroughput(options, "event");
+		else if (scenario == "pacing")
+			ok = benchPacing(options, false) && benchPacing(options, true);
+		else if (scenario == "bias")
+			ok = benchBias(options, DELAY_FIXED) && benchBias(options, DELAY_EXPONENTIAL);
+		else {
+			fprintf(stderr, "Unknown scenario %s\n", scenario.c_str());
+			ok = false;
+		}
+	}
+	return ok ? 0 : 1;
+}
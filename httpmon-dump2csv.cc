@@ -0,0 +1,88 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dump.h"
+
+/*
+ * Convert binary dumps produced by httpmon --dump --dump-format binary to
+ * the same CSV as httpmon --dump. Several files, e.g., rotated dumps, are
+ * concatenated in the given order. Dumps of older versions are converted
+ * too, with the fields they lack left unknown.
+ */
+
+int convert(const char *path, FILE *out)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+
+	struct stat st;
+	fstat(fd, &st);
+	size_t size = st.st_size;
+	if (size < sizeof(DumpHeader)) {
+		fprintf(stderr, "%s: too short to be a dump\n", path);
+		close(fd);
+		return 1;
+	}
+
+	const char *map = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	madvise((void *)map, size, MADV_SEQUENTIAL);
+
+	DumpHeader header;
+	memcpy(&header, map, sizeof(header));
+	if (memcmp(header.magic, DumpMagic, sizeof(DumpMagic)) != 0) {
+		fprintf(stderr, "%s: not an httpmon binary dump\n", path);
+		munmap((void *)map, size);
+		return 1;
+	}
+	if (!isSupportedDump(header)) {
+		fprintf(stderr, "%s: unsupported dump version %u (record size %u)\n",
+			path, header.version, header.recordSize);
+		munmap((void *)map, size);
+		return 1;
+	}
+
+	size_t numRecords = (size - sizeof(header)) / header.recordSize;
+	if (sizeof(header) + numRecords * header.recordSize != size)
+		fprintf(stderr, "%s: ignoring truncated last record\n", path);
+
+	char line[256];
+	const char *p = map + sizeof(header);
+	for (size_t i = 0; i < numRecords; i++, p += header.recordSize) {
+		DumpRecord r;
+		readDumpRecord(p, header, r);
+		int len = formatDumpRecordCsv(line, sizeof(line), r, header.clockOffset);
+		fwrite(line, 1, len, out);
+	}
+
+	munmap((void *)map, size);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s dump.bin [dump.bin.1 ...] > dump.csv\n", argv[0]);
+		return 1;
+	}
+
+	static char buf[1 << 20];
+	setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+
+	fputs(DumpCsvHeader, stdout);
+	int ret = 0;
+	for (int i = 1; i < argc; i++)
+		ret |= convert(argv[i], stdout);
+	return ret;
+}
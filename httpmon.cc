@@ -6,26 +6,72 @@
 #include <boost/date_time/posix_time/posix_time_duration.hpp>
 #include <boost/program_options.hpp>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdarg>
 #include <curl/curl.h>
+#include <deque>
 #include <fcntl.h>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <numeric>
+#include <openssl/ssl.h>
 #include <poll.h>
+#include <queue>
 #include <random>
 #include <signal.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
 #include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <thread>
+#include <tuple>
+#include <unistd.h>
 #include <vector>
 
-#define RESPONSEFLAGS_CONTENT 0x01
-#define RESPONSEFLAGS_OPTION1 0x02
-#define RESPONSEFLAGS_OPTION2 0x04
+#include "capacity.h"
+#include "classifier.h"
+#include "coordinator.h"
+#include "cpuset.h"
+#include "decoder.h"
+#include "dump.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "profile.h"
+#include "share.h"
+#include "trace.h"
+#include "warmup.h"
+#include "window.h"
+#include "workload.h"
 
-const int OptionalStuffMarker1 = 128;
-const int OptionalStuffMarker2 = 129;
 const long MicroSecondsInASecond = 1000000;
 const long NanoSecondsInASecond = 1000000000;
+const long NanoSecondsInAMicroSecond = 1000;
+
+/*
+ * All measurements and scheduling use CLOCK_MONOTONIC in integer nanoseconds,
+ * which NTP cannot step. Wall-clock time is only used for timestamps shown
+ * to the user.
+ */
+typedef int64_t Nanos;
+const Nanos NoTime = DumpNoTime; /*< unknown, e.g., repliedAt of abandoned requests */
+const Nanos Never = std::numeric_limits<Nanos>::max(); /*< e.g., next arrival of a replayed trace */
+const Nanos ControlPeriod = NanoSecondsInASecond / 100; /*< how soon threads notice control changes, e.g., by a profile */
+
+/* Distribution of inter-arrival times in rate mode */
+enum ArrivalDistribution {
+	ARRIVALS_POISSON,  /*< exponential inter-arrival times */
+	ARRIVALS_CONSTANT, /*< evenly spaced arrivals */
+	ARRIVALS_UNIFORM,  /*< inter-arrival times uniform in [0, 2/rate] */
+};
 
 struct ClientControl {
 	/* Control */
@@ -35,52 +81,356 @@ struct ClientControl {
 	/* Client parameters */
 	std::string url;
 	int concurrency;
+	int poolSize; /* clients kept ready, active or parked; grows with concurrency */
+	bool prewarm; /* new clients open their connection with a request that is not accounted */
 	double thinkTime;
 	double timeout;
 	bool open;
 	bool deterministic;
 	bool compressed;
+	bool decode; /* decode compressed replies, timing it, see decoder.h */
 	bool post;
+	Nanos spinTime; /* busy-wait this long before deadlines, instead of sleeping */
 	std::string body;
+	std::shared_ptr<const BodyCorpus> bodyCorpus; /* if not NULL, send bodies from it instead */
 	std::vector<std::string> headers;
+	const BodyClassifier *classifier; /* markers to look for in replies */
+
+	/* Protocol and connections */
+	long httpVersion; /* CURL_HTTP_VERSION_* */
+	int streamsPerConnection; /* event engine: requests multiplexed on one HTTP/2 connection */
+	int connectionReuse; /* close connections after this many requests; 0 to keep them alive */
+	const CurlShares *shares; /* caches shared between clients, NULL if none */
+	struct curl_slist *resolve; /* host names pinned to addresses, NULL if none */
+
+	/* What to request, see workload.h */
+	std::vector<RequestSpec> requestSpecs; /* only accessed by the main thread */
+	bool workloadFromFile; /* otherwise, a single template derived from the parameters above */
+	std::mutex workloadMutex; /* protects workload */
+	std::shared_ptr<const Workload> workload;
+	std::atomic<unsigned> workloadGeneration; /* incremented whenever workload changes */
+
+	/* Rate mode: arrivals are generated centrally at a given rate, independent of concurrency */
+	bool rateMode;
+	double rate; /* arrivals per second */
+	ArrivalDistribution arrivals;
+	size_t maxBacklog; /* arrivals allowed to wait for a free client */
+
+	/* Trace replay (a special case of rate mode): arrivals and requests come from a trace */
+	const TraceFile *trace; /* NULL if not replaying */
+	Nanos traceStartTime; /* when the trace's first request is due */
+	double traceSpeed; /* replay speed-up factor */
+	double traceRate; /* if positive, replay at this fixed rate, ignoring trace times */
+	std::atomic<int> numTraceReplayers; /* replayers that still have arrivals to dispatch */
+
+	/* Worker mode: this process generates its share of the load of a coordinator */
+	int workerIndex; /* 0 if not a worker */
+	int numWorkers; /* 1 if not a worker */
 };
 
+/* Share of a total, e.g., of the concurrency, that this process is responsible for */
+int workerShare(int total, const ClientControl &control)
+{
+	return total / control.numWorkers + (control.workerIndex < total % control.numWorkers);
+}
+
+/* HTTP status codes counted individually are below; 0 counts requests without a reply */
+const int NumStatusCodes = 600;
+
 struct RequestData {
-	double generatedAt; /*< When was the request generated (according to the model) */
-	double sentAt; /*< What was the request effectively sent to the server; normally the same as generatedAt, except when client-side queuing happened */
-	double repliedAt;
+	Nanos generatedAt; /*< When was the request generated (according to the model) */
+	Nanos sentAt; /*< What was the request effectively sent to the server; normally the same as generatedAt, except when client-side queuing happened */
+	Nanos repliedAt;
 	bool error;
-	bool option1;
-	bool option2;
+	ErrorClass errorClass; /*< why the request failed, if it did */
+	int status; /*< HTTP status code, 0 if no reply was received */
+	uint32_t options; /*< bit i set if the reply contained marker i */
+	Nanos phases[NUM_PHASES]; /*< durations, NoTime if unknown */
+	long numConnects; /*< new connections CURL made for this request; -1 if not sent */
+	uint64_t rxBytes; /*< received, headers included, as sent over the wire */
+	uint64_t txBytes; /*< sent, headers included */
+	uint64_t bodyBytes; /*< body of the reply, as sent over the wire */
+	uint64_t decodedBytes; /*< body of the reply once decoded, with --decode only */
+	Nanos decodeTime; /*< spent decoding the reply, NoTime if it was not encoded */
+	int tlsResumed; /*< for requests that opened a TLS connection: 1 if it resumed a session, 0 if not; otherwise -1 */
+};
+
+/* Data collected per request template, if the workload has several */
+struct TemplateBuffer {
+	ConcurrentHistogram latencies; /* in nanoseconds */
+	std::atomic<uint32_t> numRequests;
+	std::atomic<uint32_t> numErrors;
+
+	explicit TemplateBuffer(const HistogramLayout &layout) :
+		latencies(layout),
+		numRequests(0),
+		numErrors(0)
+	{
+	}
+};
+
+/* Data collected by clients during one report interval */
+struct ShardBuffer {
+	ConcurrentHistogram latencies; /* in nanoseconds */
+	std::atomic<uint32_t> numRequests;
+	std::atomic<uint32_t> numOptions[MaxMarkers]; /* replies containing each marker */
+	std::atomic<uint32_t> numOpenQueuing;
+	std::atomic<uint32_t> numErrors;
+	std::atomic<uint32_t> numErrorClasses[NUM_ERROR_CLASSES]; /* failed requests by ErrorClass */
+	std::atomic<uint32_t> numStatuses[NumStatusCodes]; /* requests by HTTP status */
+	std::vector<std::unique_ptr<ConcurrentHistogram>> errorLatencies; /* per ErrorClass, except none and abandoned */
+	std::atomic<uint32_t> numArrivals; /* rate mode only */
+	std::atomic<uint32_t> numQueued; /* arrivals that found no free client */
+	std::atomic<uint32_t> numDropped; /* arrivals that found the backlog full */
+	std::atomic<uint32_t> numNewConnections;
+	std::atomic<uint32_t> numReusedConnections; /* requests sent on an existing connection */
+	std::atomic<uint32_t> numTlsFull; /* full TLS handshakes */
+	std::atomic<uint32_t> numTlsResumed; /* abbreviated TLS handshakes, resuming a session */
+	std::atomic<uint64_t> rxBytes; /* see RequestData */
+	std::atomic<uint64_t> txBytes;
+	std::atomic<uint64_t> encodedBytes; /* bodies of decoded replies, before and after decoding */
+	std::atomic<uint64_t> decodedBytes;
+	ConcurrentHistogram responseSizes; /* bodies of successful replies, in bytes over the wire */
+	ConcurrentHistogram decodeTimes; /* of encoded replies, in nanoseconds */
+	ConcurrentHistogram sendLags; /* sentAt - generatedAt, in nanoseconds */
+	ConcurrentHistogram schedLags; /* how late pacers woke up, in nanoseconds */
+	std::vector<std::unique_ptr<TemplateBuffer>> templates;
+	std::vector<std::unique_ptr<ConcurrentHistogram>> phases; /* per RequestPhase, if requested */
+
+	ShardBuffer(const HistogramLayout &layout, size_t numTemplates, bool recordPhases) :
+		latencies(layout),
+		numRequests(0),
+		numOpenQueuing(0),
+		numErrors(0),
+		numArrivals(0),
+		numQueued(0),
+		numDropped(0),
+		numNewConnections(0),
+		numReusedConnections(0),
+		numTlsFull(0),
+		numTlsResumed(0),
+		rxBytes(0),
+		txBytes(0),
+		encodedBytes(0),
+		decodedBytes(0),
+		responseSizes(layout),
+		decodeTimes(layout),
+		sendLags(layout),
+		schedLags(layout)
+	{
+		for (size_t i = 0; i < MaxMarkers; i++)
+			numOptions[i] = 0;
+		for (int i = 0; i < NUM_ERROR_CLASSES; i++) {
+			numErrorClasses[i] = 0;
+			bool timed = (i != ERROR_NONE && i != ERROR_ABANDONED);
+			errorLatencies.emplace_back(timed ? new ConcurrentHistogram(layout) : NULL);
+		}
+		for (int i = 0; i < NumStatusCodes; i++)
+			numStatuses[i] = 0;
+		for (size_t i = 0; i < numTemplates; i++)
+			templates.emplace_back(new TemplateBuffer(layout));
+		for (int i = 0; recordPhases && i < NUM_PHASES; i++)
+			phases.emplace_back(new ConcurrentHistogram(layout));
+	}
+};
+
+/*
+ * Statistics are sharded, so that clients running on different cores do not
+ * contend on the same cache lines. Each shard is double-buffered: clients
+ * record into the active buffer, while the reporter switches buffers and
+ * drains the inactive one without ever blocking clients (a writer-reader
+ * phaser, as used by HdrHistogram's recorders).
+ */
+struct StatsShard {
+	char padBefore[64]; /* avoid false sharing with neighbouring allocations */
+
+	std::atomic<int> activeBuffer;
+	std::atomic<int> numWriters[2];
+	std::atomic<int> queueLength; /* requests in flight; never reset */
+	std::atomic<uint64_t> pacerBusyTime; /* ns the event loop or arrival scheduler recording here did not wait; never reset */
+	uint64_t collectedPacerBusyTime; /* value of the above at the last collection; reporter only */
+	std::unique_ptr<ShardBuffer> buffers[2];
+
+	char padAfter[64];
+
+	StatsShard(const HistogramLayout &layout, size_t numTemplates, bool recordPhases) :
+		activeBuffer(0),
+		queueLength(0),
+		pacerBusyTime(0),
+		collectedPacerBusyTime(0)
+	{
+		for (int i = 0; i < 2; i++) {
+			numWriters[i] = 0;
+			buffers[i].reset(new ShardBuffer(layout, numTemplates, recordPhases));
+		}
+	}
+
+	/* Called by clients: returns index of the buffer to record into */
+	int beginWrite()
+	{
+		for (;;) {
+			int i = activeBuffer.load();
+			numWriters[i]++;
+			if (activeBuffer.load() == i)
+				return i;
+			numWriters[i]--; /* reporter switched buffers meanwhile, retry */
+		}
+	}
+
+	void endWrite(int i)
+	{
+		numWriters[i]--;
+	}
+
+	/*
+	 * Called by the reporter only: switches buffers and returns the one
+	 * clients recorded into so far, as soon as no client writes to it.
+	 * Counts how many times the reporter had to wait for clients.
+	 */
+	ShardBuffer &collect(uint32_t &numWaits)
+	{
+		int i = activeBuffer.load();
+		activeBuffer.store(1 - i);
+		while (numWriters[i].load() != 0) {
+			numWaits++;
+			std::this_thread::yield();
+		}
+		return *buffers[i];
+	}
 };
 
 struct ClientData {
-	/* Protect this structure from concurrent access */
-	std::mutex mutex;
+	std::vector<std::unique_ptr<StatsShard>> shards;
+
+	StatsShard &shardFor(int id)
+	{
+		return *shards[id % shards.size()];
+	}
+
+	/* Number of requests in flight */
+	int queueLength() const
+	{
+		int queueLength = 0;
+		for (auto &shard : shards)
+			queueLength += shard->queueLength;
+		return queueLength;
+	}
+
+	/* Where to dump per-request data; NULL if not requested */
+	DumpWriter *dump;
+
+	/* Whether to time the phases of requests */
+	bool recordPhases;
+
+	/* When data was last collected, and how much CPU time httpmon had used by then */
+	Nanos lastCollectTime;
+	Nanos lastCpuTime;
+};
+
+/* Data per request template, either of one report interval or accumulated */
+struct TemplateData {
+	Histogram latencies; /* in nanoseconds */
+	uint32_t numRequests;
+	uint32_t numErrors;
+};
 
-	/* Data collected by clients */
-	std::vector<double> latencies; /* TODO: avoid duplicate with information below */
-	std::vector<RequestData> requests;
+/*
+ * Data collected during one report interval, from all shards and, in
+ * coordinator mode, merged over all workers.
+ */
+struct IntervalData {
+	std::vector<TemplateData> templates;
+	Histogram latencies; /* in nanoseconds */
+	Histogram sendLags; /* in nanoseconds */
+	Histogram schedLags; /* in nanoseconds */
+	std::vector<Histogram> phases; /* per RequestPhase, in nanoseconds, if requested */
 	uint32_t numRequests;
-	uint32_t numOption1;
-	uint32_t numOption2;
+	uint32_t numOptions[MaxMarkers];
 	uint32_t numOpenQueuing;
 	uint32_t numErrors;
-	uint32_t queueLength;
+	uint32_t numErrorClasses[NUM_ERROR_CLASSES];
+	uint32_t numStatuses[NumStatusCodes];
+	std::vector<Histogram> errorLatencies; /* of failed requests per ErrorClass, in nanoseconds */
+	uint32_t numArrivals;
+	uint32_t numQueued;
+	uint32_t numDropped;
+	uint32_t numNewConnections;
+	uint32_t numReusedConnections;
+	uint32_t numTlsFull;
+	uint32_t numTlsResumed;
+	uint64_t rxBytes;
+	uint64_t txBytes;
+	uint64_t encodedBytes;
+	uint64_t decodedBytes;
+	Histogram responseSizes; /* in bytes */
+	Histogram decodeTimes; /* in nanoseconds */
+	int32_t queueLength;
+	uint32_t statsWaits; /* summed over workers */
+	Nanos statsTime; /* maximum over workers */
+	Nanos cpuTime; /* used by httpmon, summed over workers */
+	uint32_t numCpus; /* httpmon may run on, summed over workers */
+	double pacerUtilization; /* of the busiest event loop or arrival scheduler, maximum over workers */
+
+	IntervalData(int histogramDigits, size_t numTemplates, bool recordPhases);
+	void reset();
+	void add(const IntervalData &other);
+	void serialize(std::string &out) const;
+	bool addSerialized(const std::string &in);
 };
 
 struct AccumulatedData {
-	double reportTime;
-
-	std::vector<double> latencies; /* TODO: avoid duplicate with information below */
-	std::vector<RequestData> requests;
+	Nanos reportTime; /* monotonic, to compute report intervals */
+	Nanos lastInterval; /* length of the last report interval */
+	Nanos reportLoopTime; /* how long collecting, reporting and publishing took last time */
+	bool saturated; /* whether httpmon itself seemed to limit throughput during the last interval */
+	std::vector<TemplateData> templates;
+	std::unique_ptr<SlidingWindows> windows; /* if requested */
+	std::unique_ptr<WarmUp> warmUp; /* if requested; accumulated statistics restart once it ends */
+
+	Histogram latencies; /* in nanoseconds */
+	Histogram sendLags; /* in nanoseconds */
+	Histogram schedLags; /* in nanoseconds */
+	uint64_t numDumpDropped;
 	uint32_t numRequests;
-	uint32_t numOption1;
-	uint32_t numOption2;
+	uint32_t numOptions[MaxMarkers];
 	uint32_t numOpenQueuing;
 	uint32_t numErrors;
+	uint32_t numErrorClasses[NUM_ERROR_CLASSES];
+	uint32_t numStatuses[NumStatusCodes];
+	uint32_t numQueued;
+	uint32_t numDropped;
+	uint64_t rxBytes;
+	uint64_t txBytes;
+	uint32_t numTlsFull;
+	uint32_t numTlsResumed;
 };
 
+/* Clear accumulated counters and histograms, e.g., at the start of the steady state */
+void resetAccumulated(AccumulatedData &accData)
+{
+	accData.latencies.reset();
+	accData.sendLags.reset();
+	accData.schedLags.reset();
+	accData.numRequests = 0;
+	std::fill(accData.numOptions, accData.numOptions + MaxMarkers, 0);
+	accData.numOpenQueuing = 0;
+	accData.numErrors = 0;
+	std::fill(accData.numErrorClasses, accData.numErrorClasses + NUM_ERROR_CLASSES, 0);
+	std::fill(accData.numStatuses, accData.numStatuses + NumStatusCodes, 0);
+	accData.rxBytes = 0;
+	accData.txBytes = 0;
+	accData.numTlsFull = 0;
+	accData.numTlsResumed = 0;
+	accData.numQueued = 0;
+	accData.numDropped = 0;
+	for (TemplateData &t : accData.templates) {
+		t.latencies.reset();
+		t.numRequests = 0;
+		t.numErrors = 0;
+	}
+}
+
+/* Wall-clock time in seconds since the UNIX epoch; only for timestamps shown to the user */
 double inline now()
 {
 	struct timeval tv;
@@ -88,407 +438,2728 @@ double inline now()
 	return (double)tv.tv_usec / 1000000 + tv.tv_sec;
 }
 
-template<typename T>
-struct Statistics {
-	T minimum, lowerQuartile, median, upperQuartile, maximum;
-	T percentile95, percentile99;
-	T average;
-};
+Nanos inline monotonicNow()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Nanos)ts.tv_sec * NanoSecondsInASecond + ts.tv_nsec;
+}
 
-template<typename T>
-typename T::value_type median(T begin, T end)
+/* What to add to monotonic times to obtain nanoseconds since the UNIX epoch */
+Nanos wallClockOffset()
 {
-	/* assumes vector is sorted */
-	int n = end - begin;
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (Nanos)ts.tv_sec * NanoSecondsInASecond + ts.tv_nsec - monotonicNow();
+}
 
-	/* median is not defined for fewer than 2 items */
-	if (n < 2)
-		return NAN;
+/* Convert a duration in seconds, e.g., a think-time, to nanoseconds */
+Nanos toNanos(double seconds)
+{
+	if (seconds >= (double)Never / NanoSecondsInASecond)
+		return Never;
+	return std::llround(seconds * NanoSecondsInASecond);
+}
 
-	/* even number of items: take average of the middle ones */
-	if (n % 2 == 0) {
-		/* (begin-1) because index computations are 1-based */
-		auto left  = (begin-1) + n / 2;
-		auto right = (begin-1) + n / 2 + 1;
-		return (*left + *right) / 2.0;
-	}
-	else {
-		auto middle = begin + n / 2;
-		return *middle;
+double toSeconds(Nanos duration)
+{
+	return (double)duration / NanoSecondsInASecond;
+}
+
+struct timespec toTimespec(Nanos t)
+{
+	struct timespec ts = { (time_t)(t / NanoSecondsInASecond), (long)(t % NanoSecondsInASecond) };
+	return ts;
+}
+
+/* Let this thread's timers expire as precisely as the kernel can */
+void usePreciseTimers()
+{
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+}
+
+/*
+ * Sleep until an absolute deadline, so that time spent before sleeping does
+ * not add up, then spin for the last spinTime nanoseconds, which the kernel's
+ * wake-up latency would otherwise add.
+ */
+void sleepUntil(Nanos deadline, Nanos spinTime)
+{
+	if (deadline - spinTime > monotonicNow()) {
+		struct timespec ts = toTimespec(deadline - spinTime);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+			;
 	}
+	while (monotonicNow() < deadline)
+		;
 }
 
-size_t percentileRank(size_t n, double percentile)
+/* CPU time used by all threads of httpmon so far, in user and kernel mode */
+Nanos processCpuTime()
 {
-	/* Nearest rank: http://en.wikipedia.org/wiki/Percentile#Nearest_rank */
-	return static_cast<size_t>(percentile / 100.0 * n - 0.5);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (Nanos)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * NanoSecondsInASecond +
+		(Nanos)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * NanoSecondsInAMicroSecond;
 }
 
-template<typename T>
-double average(const T &a)
+/* Number of CPUs httpmon may run on, e.g., as restricted by --cpus */
+unsigned usableCpus()
 {
-	double sum = std::accumulate(a.begin(), a.end(), 0.0);
-	return sum / a.size();
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) != 0)
+		return std::max(1u, std::thread::hardware_concurrency());
+	return CPU_COUNT(&set);
+}
+
+/* Like sprintf, but returns a std::string */
+std::string strprintf(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+
+	std::string s(len + 1, '\0');
+	va_start(ap, format);
+	vsnprintf(&s[0], s.size(), format, ap);
+	va_end(ap);
+	s.resize(len);
+	return s;
 }
 
 template<typename T>
-Statistics<typename T::value_type> computeStatistics(T &a)
+struct Statistics {
+	T minimum, lowerQuartile, median, upperQuartile, maximum;
+	T percentile95, percentile99, percentile999;
+	T average;
+};
+
+/*
+ * Compute statistics of latencies recorded in nanoseconds, reported in
+ * seconds, or of other values, multiplied by scale
+ */
+Statistics<double> computeStatistics(const Histogram &h, double scale = 1.0 / NanoSecondsInASecond)
 {
-	Statistics<typename T::value_type> s =
-		{ NAN, NAN, NAN, NAN, NAN, NAN };
+	Statistics<double> s =
+		{ NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN, NAN };
 
-	size_t n = a.size();
-	if (n < 1)
+	if (h.count() < 1)
 		return s;
-	std::sort(a.begin(), a.end());
 
-	s.minimum = a[0]  ; /* minimum */
-	s.maximum = a[n-1]; /* maximum */
+	s.minimum = h.min() * scale;
+	s.maximum = h.max() * scale;
 
-	s.median = median(a.begin(), a.end());
-	s.lowerQuartile = median(a.begin(), a.begin() + n / 2);
-	s.upperQuartile = median(a.begin() + (n+1) / 2, a.end());
+	s.median = h.valueAtPercentile(50) * scale;
+	s.lowerQuartile = h.valueAtPercentile(25) * scale;
+	s.upperQuartile = h.valueAtPercentile(75) * scale;
 
-	s.percentile95 = a[percentileRank(n, 95)];
-	s.percentile99 = a[percentileRank(n, 99)];
+	s.percentile95 = h.valueAtPercentile(95) * scale;
+	s.percentile99 = h.valueAtPercentile(99) * scale;
+	s.percentile999 = h.valueAtPercentile(99.9) * scale;
 
-	s.average = average(a);
+	s.average = h.mean() * scale;
 
 	return s;
 }
 
-size_t nullWriter(char *ptr, size_t size, size_t nmemb, void *userdata)
+/* Convert a duration to a value recorded in histograms */
+uint64_t toHistogramValue(Nanos duration)
+{
+	return (uint64_t)std::max<Nanos>(0, duration);
+}
+
+/* Request to send instead of one picked from the workload, e.g., replayed from a trace */
+struct ExplicitRequest {
+	std::string method; /* empty if none */
+	std::string url;
+	std::shared_ptr<const std::string> body; /* NULL if none */
+};
+
+/* Rate mode: an arrival waiting to be served by a client */
+struct Arrival {
+	Nanos time; /* intended time */
+	bool queued; /* found no free client */
+	ExplicitRequest request;
+};
+
+/* State of one (virtual) HTTP client, shared by all client engines */
+struct VirtualClient {
+	int id;
+	StatsShard &shard; /* where to record statistics */
+	CURL *curl;
+	const BodyClassifier &classifier;
+	BodyClassifier::State bodyState; /* of the reply being received */
+
+	std::default_random_engine rng; /* random number generator */
+	double lastThinkTime;
+	std::exponential_distribution<double> waitDistribution;
+	Nanos lastArrivalTime;
+
+	/* Workload, refreshed when control's changes */
+	std::shared_ptr<const Workload> workload;
+	unsigned workloadGeneration;
+	const RequestTemplate *appliedTemplate; /* template the CURL handle is configured for */
+
+	/* Request currently being generated or in flight */
+	RequestData requestData;
+	bool didOpenQueuing;
+	size_t templateIndex;
+	int numRequestsOnConnection; /* for connection reuse policies */
+	BodyCursor bodyCursor; /* body read from a corpus */
+	std::string bodyScratch; /* body from a corpus, with placeholders substituted */
+	ExplicitRequest explicitRequest; /* rate mode only */
+
+	/* Decoding of the reply being received, with --decode only */
+	bool decode;
+	ContentEncoding contentEncoding; /* as announced by the reply's headers */
+	bool decoderStarted;
+	ResponseDecoder decoder;
+	uint64_t decodedBytes;
+	Nanos decodeTime;
+	int tlsResumed; /* of the connection the reply is received on, see RequestData */
+
+	/* Used by the event-driven engine only */
+	bool inFlight;
+	bool warming; /* the request in flight is a warm-up, see ClientControl::prewarm */
+	bool parked; /* beyond the current concurrency */
+	bool idle; /* rate mode: waiting for an arrival */
+	uint64_t timerSeq;
+
+	VirtualClient(int id, ClientControl &control, StatsShard &shard);
+	~VirtualClient();
+};
+
+/* Classify replies as they arrive, without storing them */
+size_t bodyWriter(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-	uint32_t *responseFlags = (uint32_t *)userdata;
+	VirtualClient *client = (VirtualClient *)userdata;
+
+	if (!client->decode) {
+		if (!client->classifier.empty())
+			client->classifier.classify(client->bodyState, ptr, size * nmemb);
+		return size * nmemb; /* i.e., pretend we are actually doing something */
+	}
 
-	if (size * nmemb > 0)
-		*responseFlags |= RESPONSEFLAGS_CONTENT;
-	if (memchr(ptr, OptionalStuffMarker1, size*nmemb) != NULL)
-		*responseFlags |= RESPONSEFLAGS_OPTION1;
-	if (memchr(ptr, OptionalStuffMarker2, size*nmemb) != NULL)
-		*responseFlags |= RESPONSEFLAGS_OPTION2;
-	return size * nmemb; /* i.e., pretend we are actually doing something */
+	/* Decode in small chunks, timing decoding only */
+	ResponseDecoder &decoder = client->decoder;
+	if (!client->decoderStarted) {
+		decoder.start(client->contentEncoding);
+		client->decoderStarted = true;
+	}
+	decoder.feed(ptr, size * nmemb);
+	for (;;) {
+		char decoded[16384];
+		Nanos start = decoder.decodes() ? monotonicNow() : 0;
+		ssize_t n = decoder.read(decoded, sizeof(decoded));
+		if (decoder.decodes())
+			client->decodeTime += monotonicNow() - start;
+		if (n < 0)
+			return 0; /* corrupt reply, fail the request */
+		if (n == 0)
+			break;
+		client->decodedBytes += n;
+		if (!client->classifier.empty())
+			client->classifier.classify(client->bodyState, decoded, n);
+	}
+	return size * nmemb;
 }
 
-int httpClientMain(int id, ClientControl &control, ClientData &data)
+/*
+ * Whether the TLS connection of a transfer resumed a session; -1 if unknown,
+ * e.g., without TLS or with a TLS library other than OpenSSL
+ */
+int tlsSessionResumed(CURL *curl)
 {
-	/* Block some signals to let master thread deal with them */
-	sigset_t sigset;
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGINT);
-	sigaddset(&sigset, SIGQUIT);
-	sigaddset(&sigset, SIGTERM);
-	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	struct curl_tlssessioninfo *info = NULL;
+	if (curl_easy_getinfo(curl, CURLINFO_TLS_SSL_PTR, &info) != CURLE_OK || info == NULL ||
+		info->backend != CURLSSLBACKEND_OPENSSL || info->internals == NULL)
+		return -1;
+	return SSL_session_reused((SSL *)info->internals);
+}
 
-	/* Block SIGUSR2 so we can deal with it synchronously */
-	sigemptyset(&sigset);
-	sigaddset(&sigset, SIGUSR2);
-	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+/* Note how each reply is encoded, with --decode, and whether its connection resumed a TLS session */
+size_t headerReader(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	VirtualClient *client = (VirtualClient *)userdata;
+	const char ContentEncodingHeader[] = "content-encoding:";
+	size_t length = size * nitems;
+
+	if (length >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+		client->contentEncoding = ENCODING_IDENTITY; /* a new reply, e.g., after a redirect */
+		if (client->tlsResumed < 0)
+			client->tlsResumed = tlsSessionResumed(client->curl); /* the connection is still up */
+	}
+	else if (client->decode && length >= sizeof(ContentEncodingHeader) - 1 &&
+		strncasecmp(buffer, ContentEncodingHeader, sizeof(ContentEncodingHeader) - 1) == 0)
+		client->contentEncoding = parseContentEncoding(buffer + sizeof(ContentEncodingHeader) - 1,
+			length - (sizeof(ContentEncodingHeader) - 1));
+	return length;
+}
 
-	uint32_t responseFlags;
+/* Prepare to receive the next reply */
+void resetReply(VirtualClient &client)
+{
+	client.classifier.reset(client.bodyState);
+	client.contentEncoding = ENCODING_IDENTITY;
+	client.decoderStarted = false;
+	client.decodedBytes = 0;
+	client.decodeTime = 0;
+	client.tlsResumed = -1;
+}
 
-	CURL *curl = curl_easy_init();
+VirtualClient::VirtualClient(int _id, ClientControl &control, StatsShard &_shard) :
+	id(_id),
+	shard(_shard),
+	classifier(*control.classifier),
+	lastThinkTime(control.thinkTime),
+	waitDistribution(1.0 / lastThinkTime),
+	lastArrivalTime(monotonicNow()),
+	workloadGeneration(0),
+	appliedTemplate(NULL),
+	didOpenQueuing(false),
+	templateIndex(0),
+	numRequestsOnConnection(0),
+	bodyCursor{ "", 0, 0 },
+	decode(control.decode),
+	contentEncoding(ENCODING_IDENTITY),
+	decoderStarted(false),
+	decodedBytes(0),
+	decodeTime(0),
+	tlsResumed(-1),
+	inFlight(false),
+	warming(false),
+	parked(false),
+	idle(false),
+	timerSeq(0)
+{
+	curl = curl_easy_init();
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-	curl_easy_setopt(curl, CURLOPT_URL, control.url.c_str());
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, nullWriter);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, bodyWriter);
 	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &responseFlags);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, this);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerReader);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, this);
+	if (control.shares)
+		curl_easy_setopt(curl, CURLOPT_SHARE, control.shares->forClient(id));
+	if (control.resolve)
+		curl_easy_setopt(curl, CURLOPT_RESOLVE, control.resolve);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, readBody);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &bodyCursor);
+	curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seekBody);
+	curl_easy_setopt(curl, CURLOPT_SEEKDATA, &bodyCursor);
 	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 60L);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, this);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
+	curl_easy_setopt(curl, CURLOPT_SSL_VERIFYSTATUS, false);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, control.httpVersion);
+	if (control.streamsPerConnection > 1)
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L); /* rather multiplex than open connections */
+
+	/* Seed as a client of a single process generating all the load would be */
+	int globalId = id * control.numWorkers + control.workerIndex;
+	if (control.deterministic)
+		rng.seed(globalId);
+	else
+		rng.seed(now() + globalId);
+}
 
-	std::default_random_engine rng; /* random number generator */
-	double lastThinkTime = control.thinkTime;
-	std::exponential_distribution<double> waitDistribution(1.0 / lastThinkTime);
+VirtualClient::~VirtualClient()
+{
+	curl_easy_cleanup(curl);
+}
 
-	if (control.deterministic)
-		rng.seed(id);
+/*
+ * Simulate think-time: returns when the client should issue its next
+ * request.
+ */
+Nanos thinkUntil(VirtualClient &client, ClientControl &control)
+{
+	client.didOpenQueuing = false;
+
+	/* Check to see if paramaters have changed and update distribution */
+	const double thinkTime = control.thinkTime; /* for atomicity */
+	if (client.lastThinkTime != thinkTime) {
+		client.waitDistribution = std::exponential_distribution<double>(1.0 / thinkTime);
+		client.lastThinkTime = thinkTime;
+	}
+
+	/* We make sure that we first wait, then initiate the first connection
+	 * to avoid spiky transient effects */
+	Nanos t = monotonicNow();
+	Nanos wakeUpAt = t;
+	if (thinkTime > 0) {
+		Nanos interval = toNanos(client.waitDistribution(client.rng));
+		client.requestData.generatedAt = t;
+		wakeUpAt = t + interval;
+
+		/* Behave open if requested */
+		/* NOTE: Requests may queue up on the client-side if the server is too slow */
+		if (control.open) {
+			/* Wake up relative to the previous arrival, so as not to depend on response time */
+			Nanos nextArrivalTime = client.lastArrivalTime + interval;
+			wakeUpAt = std::max(nextArrivalTime, t);
+			if (nextArrivalTime <= t)
+				client.didOpenQueuing = true;
+			client.lastArrivalTime = nextArrivalTime;
+		}
+	}
+	/* In worst case, wake up immediately, to yield and avoid spinning */
+	return wakeUpAt;
+}
+
+/* Let the client send the next body of a corpus, for a template that uses one */
+void nextBody(VirtualClient &client, const ClientControl &control, const BodyCorpus &corpus)
+{
+	int globalId = client.id * control.numWorkers + control.workerIndex;
+	corpus.next(client.bodyCursor, client.bodyScratch, client.rng, globalId, control.workerIndex, control.numWorkers);
+	curl_easy_setopt(client.curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)client.bodyCursor.size);
+}
+
+/*
+ * Prepare the client's CURL handle for sending a request. Returns the
+ * remaining time the user is willing to wait for a reply; if not positive,
+ * the request should not be sent at all.
+ */
+double startRequest(VirtualClient &client, ClientControl &control)
+{
+	CURL *curl = client.curl;
+	RequestData &requestData = client.requestData;
+
+	/* Set timeout */
+	double timeout = control.timeout; /* also for atomicity */
+	Nanos t = monotonicNow();
+	requestData.generatedAt = t;
+	requestData.sentAt = t;
+	if (control.open || control.rateMode) {
+		timeout = std::max(0.0, timeout - toSeconds(t - client.lastArrivalTime));
+		requestData.generatedAt = client.lastArrivalTime;
+	}
+
+	/* Convert to CURL timeout: measure in ms, 0 = infinity */
+	/* We use CURL timeout of 1ms instead of 0ms */
+	long curlTimeout = 0; /* infinity */
+	if (!std::isinf(timeout))
+		curlTimeout = std::max(static_cast<long>(timeout * 1000.0), 1L);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, curlTimeout);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, curlTimeout);
+
+	/* Pick what to request; only reconfigure CURL if needed */
+	if (client.workloadGeneration != control.workloadGeneration) {
+		std::lock_guard<std::mutex> lock(control.workloadMutex);
+		client.workload = control.workload;
+		client.workloadGeneration = control.workloadGeneration;
+		client.appliedTemplate = NULL;
+	}
+	if (!client.explicitRequest.method.empty()) {
+		/* Use the headers of the (single) template derived from the command-line */
+		const ExplicitRequest &r = client.explicitRequest;
+		applyRequest(curl, r.method, r.url, r.body.get(), (*client.workload)[0].headers);
+		client.templateIndex = 0;
+		client.appliedTemplate = NULL;
+	}
+	else {
+		client.templateIndex = client.workload->pick(client.rng);
+		const RequestTemplate &requestTemplate = (*client.workload)[client.templateIndex];
+		if (client.appliedTemplate != &requestTemplate) {
+			requestTemplate.apply(curl);
+			client.appliedTemplate = &requestTemplate;
+		}
+		if (requestTemplate.corpus)
+			nextBody(client, control, *requestTemplate.corpus);
+	}
+
+	/* Close the connection after this request, if it was used enough */
+	if (control.connectionReuse > 0) {
+		client.numRequestsOnConnection++;
+		bool lastRequest = (client.numRequestsOnConnection >= control.connectionReuse);
+		curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, lastRequest ? 1L : 0L);
+		if (lastRequest)
+			client.numRequestsOnConnection = 0;
+	}
+
+	client.shard.queueLength++;
+	resetReply(client);
+
+	return timeout;
+}
+
+/*
+ * Prepare the client's CURL handle for a warm-up request, which opens its
+ * connection ahead of time, but is not accounted. Uses the first template,
+ * so as not to consume random numbers.
+ */
+void startWarmUp(VirtualClient &client, ClientControl &control)
+{
+	{
+		std::lock_guard<std::mutex> lock(control.workloadMutex);
+		client.workload = control.workload;
+		client.workloadGeneration = control.workloadGeneration;
+	}
+	const RequestTemplate &requestTemplate = (*client.workload)[0];
+	requestTemplate.apply(client.curl);
+	client.appliedTemplate = &requestTemplate;
+	if (requestTemplate.corpus)
+		nextBody(client, control, *requestTemplate.corpus);
+	long curlTimeout = std::isinf(control.timeout) ? 0 : std::max(static_cast<long>(control.timeout * 1000.0), 1L);
+	curl_easy_setopt(client.curl, CURLOPT_TIMEOUT_MS, curlTimeout);
+	curl_easy_setopt(client.curl, CURLOPT_CONNECTTIMEOUT_MS, curlTimeout);
+	resetReply(client);
+}
+
+/* Record how late a pacer woke up, compared to when it was supposed to */
+void recordSchedLag(StatsShard &shard, Nanos lag)
+{
+	int i = shard.beginWrite();
+	shard.buffers[i]->schedLags.record(toHistogramValue(lag));
+	shard.endWrite(i);
+}
+
+/* Add data about the client's last request to report */
+void recordRequest(VirtualClient &client, ClientData &data)
+{
+	const RequestData &requestData = client.requestData;
+	StatsShard &shard = client.shard;
+
+	int i = shard.beginWrite();
+	ShardBuffer &buffer = *shard.buffers[i];
+	buffer.numRequests++;
+	if (requestData.numConnects > 0)
+		buffer.numNewConnections++;
+	else if (requestData.numConnects == 0)
+		buffer.numReusedConnections++;
+	if (requestData.tlsResumed == 1)
+		buffer.numTlsResumed++;
+	else if (requestData.tlsResumed == 0)
+		buffer.numTlsFull++;
+	buffer.sendLags.record(toHistogramValue(requestData.sentAt - requestData.generatedAt));
+	buffer.numStatuses[requestData.status]++;
+	buffer.rxBytes.fetch_add(requestData.rxBytes, std::memory_order_relaxed);
+	buffer.txBytes.fetch_add(requestData.txBytes, std::memory_order_relaxed);
+	if (requestData.decodeTime != NoTime) {
+		buffer.encodedBytes.fetch_add(requestData.bodyBytes, std::memory_order_relaxed);
+		buffer.decodedBytes.fetch_add(requestData.decodedBytes, std::memory_order_relaxed);
+		buffer.decodeTimes.record(toHistogramValue(requestData.decodeTime));
+	}
+	if (requestData.error) {
+		buffer.numErrors++;
+		buffer.numErrorClasses[requestData.errorClass]++;
+		if (buffer.errorLatencies[requestData.errorClass])
+			buffer.errorLatencies[requestData.errorClass]->record(toHistogramValue(requestData.repliedAt - requestData.generatedAt));
+	}
+	else {
+		buffer.latencies.record(toHistogramValue(requestData.repliedAt - requestData.generatedAt));
+		buffer.responseSizes.record(requestData.bodyBytes);
+		for (uint32_t options = requestData.options; options != 0; options &= options - 1)
+			buffer.numOptions[__builtin_ctz(options)]++;
+		if (client.didOpenQueuing)
+			buffer.numOpenQueuing++;
+		for (size_t p = 0; p < buffer.phases.size(); p++)
+			buffer.phases[p]->record(toHistogramValue(requestData.phases[p]));
+	}
+	if (!buffer.templates.empty()) {
+		TemplateBuffer &templateBuffer = *buffer.templates[client.templateIndex];
+		templateBuffer.numRequests++;
+		if (requestData.error)
+			templateBuffer.numErrors++;
+		else
+			templateBuffer.latencies.record(toHistogramValue(requestData.repliedAt - requestData.generatedAt));
+	}
+	shard.endWrite(i);
+	shard.queueLength--;
+
+	if (data.dump) {
+		DumpRecord record;
+		record.generatedAt = requestData.generatedAt;
+		record.sentAt = requestData.sentAt;
+		record.repliedAt = requestData.repliedAt;
+		record.flags = 0;
+		if (requestData.error)
+			record.flags |= DUMPFLAGS_ERROR;
+		if (requestData.options & 0x1)
+			record.flags |= DUMPFLAGS_OPTION1;
+		if (requestData.options & 0x2)
+			record.flags |= DUMPFLAGS_OPTION2;
+		for (int p = 0; p < NUM_PHASES; p++) {
+			Nanos phase = requestData.phases[p];
+			record.phases[p] = (phase == NoTime) ? DumpNoDuration :
+				std::min<Nanos>(phase / NanoSecondsInAMicroSecond, DumpNoDuration - 1);
+		}
+		record.status = requestData.status;
+		record.errorClass = requestData.errorClass;
+		record.reserved = 0;
+		data.dump->append(client.id, record);
+	}
+}
+
+/*
+ * Split the request CURL just finished into phases. CURL reports the time
+ * from the start of the transfer until the end of each phase; phases that
+ * did not happen, e.g., connecting on a reused connection, are reported as
+ * zero and take no time.
+ */
+void timePhases(CURL *curl, Nanos phases[NUM_PHASES])
+{
+	static const CURLINFO PhaseEnds[NUM_PHASES] = {
+		CURLINFO_NAMELOOKUP_TIME_T,
+		CURLINFO_CONNECT_TIME_T,
+		CURLINFO_APPCONNECT_TIME_T,
+		CURLINFO_STARTTRANSFER_TIME_T,
+		CURLINFO_TOTAL_TIME_T,
+	};
+
+	curl_off_t phaseStart = 0;
+	for (int i = 0; i < NUM_PHASES; i++) {
+		curl_off_t phaseEnd = 0; /* in microseconds */
+		curl_easy_getinfo(curl, PhaseEnds[i], &phaseEnd);
+		phaseEnd = std::max(phaseEnd, phaseStart);
+		phases[i] = (phaseEnd - phaseStart) * NanoSecondsInAMicroSecond;
+		phaseStart = phaseEnd;
+	}
+}
+
+/*
+ * Count the bytes CURL sent and received for the request it just finished.
+ * The body of the reply is counted as received, i.e., before decoding.
+ */
+void countBytes(VirtualClient &client, RequestData &requestData)
+{
+	long headerSize = 0, requestSize = 0;
+	curl_off_t downloaded = 0, uploaded = 0;
+	curl_easy_getinfo(client.curl, CURLINFO_HEADER_SIZE, &headerSize);
+	curl_easy_getinfo(client.curl, CURLINFO_REQUEST_SIZE, &requestSize);
+	curl_easy_getinfo(client.curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+	curl_easy_getinfo(client.curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+	/*
+	 * CURL sends bodies it was given in memory, if small, along with the
+	 * headers, and then counts them both in the request and as uploaded.
+	 * Bodies read from a corpus are always sent after the headers.
+	 */
+	bool readsBody = client.appliedTemplate && client.appliedTemplate->corpus;
+	if (!readsBody && requestSize > uploaded)
+		requestSize -= uploaded;
+	requestData.bodyBytes = downloaded;
+	requestData.rxBytes = headerSize + downloaded;
+	requestData.txBytes = requestSize + uploaded;
+	requestData.decodedBytes = client.decodedBytes;
+	requestData.decodeTime = (client.decoderStarted && client.decoder.decodes()) ? client.decodeTime : NoTime;
+}
+
+/* Why CURL failed a request */
+ErrorClass classifyError(CURLcode result)
+{
+	switch (result) {
+	case CURLE_OK:
+		return ERROR_NONE;
+	case CURLE_HTTP_RETURNED_ERROR:
+		return ERROR_HTTP;
+	case CURLE_OPERATION_TIMEDOUT:
+		return ERROR_TIMEOUT;
+	case CURLE_COULDNT_CONNECT:
+		return ERROR_REFUSED;
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_RESOLVE_PROXY:
+		return ERROR_DNS;
+	case CURLE_SEND_ERROR:
+	case CURLE_RECV_ERROR:
+	case CURLE_GOT_NOTHING:
+	case CURLE_PARTIAL_FILE:
+	case CURLE_HTTP2:
+	case CURLE_HTTP2_STREAM:
+		return ERROR_RESET;
+	case CURLE_SSL_CONNECT_ERROR:
+	case CURLE_PEER_FAILED_VERIFICATION:
+	case CURLE_SSL_CERTPROBLEM:
+	case CURLE_SSL_CIPHER:
+	case CURLE_SSL_CACERT_BADFILE:
+	case CURLE_SSL_SHUTDOWN_FAILED:
+	case CURLE_SSL_CRL_BADFILE:
+	case CURLE_SSL_ISSUER_ERROR:
+		return ERROR_TLS;
+	default:
+		return ERROR_OTHER;
+	}
+}
+
+/*
+ * Account for a request that finished, either because a reply was received,
+ * or because CURL gave up on it.
+ */
+void finishRequest(VirtualClient &client, CURLcode result, ClientData &data)
+{
+	RequestData &requestData = client.requestData;
+
+	requestData.error = (result != CURLE_OK);
+	requestData.errorClass = classifyError(result);
+	long status = 0;
+	curl_easy_getinfo(client.curl, CURLINFO_RESPONSE_CODE, &status);
+	requestData.status = (status > 0 && status < NumStatusCodes) ? status : 0;
+	requestData.repliedAt = monotonicNow();
+	requestData.options = client.bodyState.found;
+	curl_easy_getinfo(client.curl, CURLINFO_NUM_CONNECTS, &requestData.numConnects);
+	requestData.tlsResumed = (requestData.numConnects > 0) ? client.tlsResumed : -1;
+	if (data.recordPhases || data.dump)
+		timePhases(client.curl, requestData.phases);
 	else
-		rng.seed(now() + id);
-
-	double lastArrivalTime = now();
-	while (true) {
-		RequestData requestData;
-
-		bool didOpenQueuing = false;
-
-		/* Check to see if paramaters have changed and update distribution */
-		const double thinkTime = control.thinkTime; /* for atomicity */
-		if (lastThinkTime != thinkTime) {
-			waitDistribution = std::exponential_distribution<double>(1.0 / thinkTime);
-			lastThinkTime = thinkTime;
-		}
-
-		/* Simulate think-time */
-		/* We make sure that we first wait, then initiate the first connection
-		 * to avoid spiky transient effects */
-		double interval = 0.0;
-		if (thinkTime > 0) {
-			interval = waitDistribution(rng);
-			requestData.generatedAt = now();
-
-			/* Behave open if requested */
-			/* NOTE: Requests may queue up on the client-side if the server is too slow */
-			if (control.open) {
-				/* Adjust sleep interval, so that it does not depend on response time */
-				double nextArrivalTime = lastArrivalTime + interval;
-				interval = std::max(nextArrivalTime - now(), 0.0);
-				if (interval == 0.0)
-					didOpenQueuing = true;
-				lastArrivalTime = nextArrivalTime;
-			}
+		std::fill(requestData.phases, requestData.phases + NUM_PHASES, NoTime);
+	countBytes(client, requestData);
+	recordRequest(client, data);
+}
+
+/*
+ * Account for a request that the user gave up on before it could be sent
+ */
+void abandonRequest(VirtualClient &client, ClientData &data)
+{
+	RequestData &requestData = client.requestData;
+
+	requestData.error = true;
+	requestData.errorClass = ERROR_ABANDONED;
+	requestData.status = 0;
+	requestData.repliedAt = NoTime;
+	requestData.options = 0;
+	std::fill(requestData.phases, requestData.phases + NUM_PHASES, NoTime);
+	requestData.numConnects = -1;
+	requestData.rxBytes = requestData.txBytes = requestData.bodyBytes = requestData.decodedBytes = 0;
+	requestData.decodeTime = NoTime;
+	requestData.tlsResumed = -1;
+	recordRequest(client, data);
+}
+
+/* Rate mode: produces arrivals, each due at nextArrivalTime */
+struct ArrivalSource {
+	Nanos nextArrivalTime; /* Never if exhausted */
+
+	virtual ~ArrivalSource() {}
+
+	/*
+	 * Fill in the arrival due at nextArrivalTime and compute the next one.
+	 * Returns false if the arrival should be skipped, e.g., while paused.
+	 */
+	virtual bool take(ClientControl &control, Arrival &arrival) = 0;
+
+	/* Apply control changes, e.g., of the rate, to the pending arrival */
+	virtual void update(ClientControl &control, Nanos t) {}
+
+	/* True once no more arrivals will be produced */
+	virtual bool exhausted() const { return false; }
+};
+
+/*
+ * Generates intended arrival times of an open workload at the rate given in
+ * control, or at a share of it. Rate changes also apply to the pending
+ * arrival: the time left until it is scaled by the ratio of the old and new
+ * rates, which, exponential distributions being memoryless, keeps Poisson
+ * arrivals exact, also while the rate follows a ramp.
+ */
+struct ArrivalGenerator : ArrivalSource {
+	std::default_random_engine rng;
+	double share; /* fraction of control.rate to generate */
+	double lastRate; /* at which the pending arrival was computed */
+
+	ArrivalGenerator(ClientControl &control, unsigned seed, double share, double phase) :
+		share(share),
+		lastRate(0)
+	{
+		if (control.deterministic)
+			rng.seed(seed);
+		else
+			rng.seed(now() + seed);
+		nextArrivalTime = monotonicNow();
+		if (control.rate > 0)
+			nextArrivalTime += toNanos(phase / (control.rate * share));
+		advance(control);
+	}
+
+	bool take(ClientControl &control, Arrival &arrival)
+	{
+		arrival.time = nextArrivalTime;
+		arrival.request.method.clear(); /* pick from the workload */
+		return advance(control);
+	}
+
+	void update(ClientControl &control, Nanos t)
+	{
+		const double rate = control.rate * share; /* for atomicity */
+		if (rate == lastRate || rate <= 0 || nextArrivalTime <= t)
+			return;
+		if (lastRate <= 0) {
+			/* Resume right away instead of at the next check */
+			nextArrivalTime = t;
+			advance(control);
+			return;
 		}
-		/* In worst case, interval == 0, to yield and avoid spinning */
+		nextArrivalTime = t + (Nanos)((nextArrivalTime - t) * (lastRate / rate));
+		lastRate = rate;
+	}
 
-		/* Sleep (or yield) for a while */
-		struct timespec timeout = { int(interval), int((interval-(int)interval) * NanoSecondsInASecond)};
-		int signo = sigtimedwait(&sigset, NULL, &timeout);
+	/* Compute the arrival after nextArrivalTime; returns false if paused */
+	bool advance(ClientControl &control)
+	{
+		const double rate = control.rate * share; /* for atomicity */
+		lastRate = rate;
+		if (rate <= 0) {
+			/* Paused: check again later */
+			nextArrivalTime = std::max(nextArrivalTime, monotonicNow()) + NanoSecondsInASecond / 10;
+			return false;
+		}
 
-		if (signo > 0)
-			break; /* master thread asked us to exit */
+		double interval;
+		switch (control.arrivals) {
+		case ARRIVALS_CONSTANT:
+			interval = 1.0 / rate;
+			break;
+		case ARRIVALS_UNIFORM:
+			interval = std::uniform_real_distribution<double>(0, 2.0 / rate)(rng);
+			break;
+		default:
+			interval = std::exponential_distribution<double>(rate)(rng);
+			break;
+		}
+		nextArrivalTime += toNanos(interval);
+		return true;
+	}
+};
 
-		/* Check if we are allowed to send this request */
-		if (control.numRequestsLeft-- > 0) {
-			/* Set timeout */
-			double timeout = control.timeout; /* also for atomicity */
-			requestData.generatedAt = now();
-			requestData.sentAt = now();
-			if (control.open) {
-				timeout = std::max(0.0, lastArrivalTime + timeout - now());
-				requestData.generatedAt = lastArrivalTime;
-			}
+/*
+ * Replays every numShares-th request of the trace in control, starting with
+ * the shareIndex-th. Arrival times are computed ahead from trace times, so
+ * replayers of different threads stay in step without coordinating.
+ */
+struct TraceReplayer : ArrivalSource {
+	const TraceFile &trace;
+	TraceReader reader;
+	TraceEntry entry; /* due at nextArrivalTime */
+	std::string origin; /* scheme and host that trace paths are relative to */
+	std::map<std::string, std::shared_ptr<const std::string>> bodies; /* by body reference */
+
+	TraceReplayer(ClientControl &control, int shareIndex, int numShares) :
+		trace(*control.trace),
+		reader(trace, shareIndex, numShares)
+	{
+		size_t schemeEnd = control.url.find("://");
+		size_t pathStart = control.url.find('/', schemeEnd == std::string::npos ? 0 : schemeEnd + 3);
+		origin = control.url.substr(0, pathStart);
+		advance(control);
+	}
 
-			/* Convert to CURL timeout: measure in ms, 0 = infinity */
-			/* We use CURL timeout of 1ms instead of 0ms */
-			long curlTimeout = 0; /* infinity */
-			if (!std::isinf(timeout))
-				curlTimeout = std::max(static_cast<long>(timeout * 1000.0), 1L);
-			curl_easy_setopt(curl, CURLOPT_URL, control.url.c_str());
-			curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, curlTimeout);
-			curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, curlTimeout);
-			
-			struct curl_slist *headers = NULL;
-			if (control.compressed) {
-				headers = curl_slist_append(headers, "Accept-Encoding: gzip");
-			}
-			if (!control.headers.empty()) {
-				for(std::size_t i = 0; i < control.headers.size(); ++i) {
-					headers = curl_slist_append(headers, control.headers[i].c_str());
-				}
+	bool take(ClientControl &control, Arrival &arrival)
+	{
+		arrival.time = nextArrivalTime;
+		arrival.request.method = entry.method;
+		if (entry.path.find("://") != std::string::npos)
+			arrival.request.url = entry.path;
+		else
+			arrival.request.url = origin + entry.path;
+		arrival.request.body = body(entry.bodyRef);
+		advance(control);
+		return true;
+	}
 
-			}
-			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
-			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0);
-			curl_easy_setopt(curl, CURLOPT_SSL_VERIFYSTATUS, false);
-
-			/* configure POST  if needed */
-			if (control.post || !control.body.empty()){
-				curl_easy_setopt(curl, CURLOPT_POSTFIELDS, control.body);
-			}
-			/* Send HTTP request */
-			{
-				std::lock_guard<std::mutex> lock(data.mutex);
-				data.queueLength++;
-			}
-			responseFlags = 0;
-			if (timeout > 0) {
-				requestData.error = (curl_easy_perform(curl) != 0);
-				curl_slist_free_all(headers);
-				requestData.repliedAt = now();
-			}
-			else {
-				requestData.error = true; /* user gave up on this request a long time ago */
-				requestData.repliedAt = NAN;
-			}
-			requestData.option1 = responseFlags & RESPONSEFLAGS_OPTION1;
-			requestData.option2 = responseFlags & RESPONSEFLAGS_OPTION2;
+	bool exhausted() const { return nextArrivalTime == Never; }
+
+private:
+	void advance(ClientControl &control)
+	{
+		uint64_t index;
+		if (!reader.next(entry, index))
+			nextArrivalTime = Never;
+		else if (control.traceRate > 0)
+			nextArrivalTime = control.traceStartTime + toNanos(index / control.traceRate);
+		else
+			nextArrivalTime = control.traceStartTime +
+				toNanos((entry.timestamp - trace.firstTimestamp) / control.traceSpeed);
+	}
+
+	/* Load bodies lazily and only once; bodies that cannot be read are sent empty */
+	std::shared_ptr<const std::string> body(const std::string &ref)
+	{
+		if (ref.empty())
+			return NULL;
+		auto it = bodies.find(ref);
+		if (it != bodies.end())
+			return it->second;
+
+		std::string path = (ref[0] == '/') ? ref : trace.directory + ref;
+		std::shared_ptr<const std::string> content;
+		try {
+			content.reset(new std::string(readFile(path)));
+		}
+		catch (const std::exception &e) {
+			fprintf(stderr, "[%f] WARNING: %s, sending empty body instead\n", now(), e.what());
+			content.reset(new std::string());
+		}
+		bodies[ref] = content;
+		return content;
+	}
+};
+
+/* Create the arrival source of the shareIndex-th of this process's numShares dispatchers */
+ArrivalSource *newArrivalSource(ClientControl &control, int shareIndex, int numShares)
+{
+	/* Workers' dispatchers together generate the coordinator's arrivals */
+	shareIndex = shareIndex * control.numWorkers + control.workerIndex;
+	numShares *= control.numWorkers;
+
+	if (control.trace)
+		return new TraceReplayer(control, shareIndex, numShares);
+	/* Superposing the sources' arrivals yields the requested arrival process */
+	return new ArrivalGenerator(control, shareIndex, 1.0 / numShares, (double)shareIndex / numShares);
+}
+
+/* Prepare the client to serve the arrival */
+void takeArrival(VirtualClient &client, Arrival &arrival)
+{
+	client.lastArrivalTime = arrival.time;
+	client.didOpenQueuing = arrival.queued;
+	client.explicitRequest = std::move(arrival.request);
+}
+
+/*
+ * Central arrival scheduler of the thread engine: a single thread generates
+ * arrivals and dispatches them to idle client threads. Arrivals that find no
+ * idle client wait in a bounded backlog; arrivals that find the backlog full
+ * are dropped.
+ */
+struct ArrivalScheduler {
+	ClientControl &control;
+	StatsShard &shard; /* where arrivals are accounted */
+
+	std::mutex mutex; /* protects all below */
+	std::condition_variable arrived;
+	std::deque<Arrival> backlog;
+	int numIdle; /* client threads waiting for an arrival */
+
+	ArrivalScheduler(ClientControl &control, StatsShard &shard) :
+		control(control),
+		shard(shard),
+		numIdle(0)
+	{
+	}
+
+	void run();
+	bool take(VirtualClient &client, double maxWait);
+	void wakeAll();
+};
+
+void ArrivalScheduler::run()
+{
+	/* Block some signals to let master thread deal with them */
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGQUIT);
+	sigaddset(&sigset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	usePreciseTimers();
+
+	std::unique_ptr<ArrivalSource> source(newArrivalSource(control, 0, 1));
+	bool finished = false;
+	Arrival arrival;
+	Nanos busySince = monotonicNow();
+	while (control.running) {
+		Nanos t = monotonicNow();
+		source->update(control, t);
+		if (source->nextArrivalTime > t) {
+			/* Let the master thread know once the trace was entirely dispatched */
+			if (source->exhausted() && !finished) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (backlog.empty()) {
+					finished = true;
+					control.numTraceReplayers--;
+				}
+			}
+
+			/* Wake up regularly to notice control changes, e.g., that we should exit */
+			shard.pacerBusyTime += monotonicNow() - busySince;
+			sleepUntil(std::min(source->nextArrivalTime, t + ControlPeriod), control.spinTime);
+			busySince = monotonicNow();
+			continue;
+		}
+
+		if (!source->take(control, arrival))
+			continue; /* paused */
+
+		int i = shard.beginWrite();
+		ShardBuffer &buffer = *shard.buffers[i];
+		buffer.numArrivals++;
+		buffer.schedLags.record(toHistogramValue(t - arrival.time));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			arrival.queued = (numIdle <= (int)backlog.size());
+			if (arrival.queued && backlog.size() >= control.maxBacklog) {
+				buffer.numDropped++;
+			}
+			else {
+				if (arrival.queued)
+					buffer.numQueued++;
+				backlog.push_back(std::move(arrival));
+				arrived.notify_one();
+			}
+		}
+		shard.endWrite(i);
+	}
+}
+
+/*
+ * Called by client threads: wait at most maxWait seconds for an arrival. If
+ * one is available, prepare the client to send it and return true.
+ */
+bool ArrivalScheduler::take(VirtualClient &client, double maxWait)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (backlog.empty()) {
+		numIdle++;
+		arrived.wait_for(lock, std::chrono::duration<double>(maxWait));
+		numIdle--;
+		if (backlog.empty())
+			return false;
+	}
+
+	takeArrival(client, backlog.front());
+	backlog.pop_front();
+	return true;
+}
+
+/* Wake up client threads waiting for an arrival, e.g., so that they notice they should park */
+void ArrivalScheduler::wakeAll()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	arrived.notify_all();
+}
+
+/*
+ * Thread engine: client threads form a pool, which only grows. Threads
+ * whose id is not below the current concurrency park, keeping their CURL
+ * handle and connection, until concurrency grows again. Hence, changing
+ * the concurrency within the pool's size neither creates nor destroys
+ * threads, and takes effect as soon as parked threads are woken up.
+ */
+struct ClientPool {
+	ClientControl &control;
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	explicit ClientPool(ClientControl &control) :
+		control(control)
+	{
+	}
+
+	bool active(int id) const
+	{
+		return id < control.concurrency;
+	}
+
+	/* Called by the master thread after the concurrency changed, or to stop */
+	void notify()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		changed.notify_all();
+	}
+
+	/* Called by client threads: wait while inactive; returns false once httpmon stops */
+	bool park(int id)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&] { return !control.running || active(id); });
+		return control.running;
+	}
+
+	/*
+	 * Called by client threads: think until deadline, like sleepUntil(), but
+	 * return early if the thread becomes inactive or httpmon stops. Returns
+	 * false in that case.
+	 */
+	bool think(int id, Nanos deadline)
+	{
+		if (deadline - control.spinTime > monotonicNow()) {
+			/* NOTE: libstdc++'s steady_clock is CLOCK_MONOTONIC */
+			std::chrono::steady_clock::time_point until(std::chrono::nanoseconds(deadline - control.spinTime));
+			std::unique_lock<std::mutex> lock(mutex);
+			if (changed.wait_until(lock, until, [&] { return !control.running || !active(id); }))
+				return false;
+		}
+		sleepUntil(deadline, control.spinTime);
+		return control.running && active(id);
+	}
+};
+
+int httpClientMain(int id, ClientControl &control, ClientData &data, ClientPool &pool, ArrivalScheduler *scheduler)
+{
+	/* Block some signals to let master thread deal with them */
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGQUIT);
+	sigaddset(&sigset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	usePreciseTimers();
+
+	VirtualClient client(id, control, data.shardFor(id));
+	if (control.prewarm) {
+		startWarmUp(client, control);
+		curl_easy_perform(client.curl);
+	}
+	while (control.running) {
+		if (!pool.active(id)) {
+			if (!pool.park(id))
+				break;
+			client.lastArrivalTime = monotonicNow(); /* open model: do not catch up on time spent parked */
+			continue;
+		}
+
+		if (scheduler) {
+			/* Wait for an arrival; the master thread wakes us up if we should park or exit */
+			if (!scheduler->take(client, 0.1))
+				continue;
+		}
+		else {
+			/* Think, unless the master thread wakes us up to park or exit */
+			Nanos wakeUpAt = thinkUntil(client, control);
+			bool slept = wakeUpAt > monotonicNow();
+			if (!pool.think(id, wakeUpAt))
+				continue;
+			if (slept)
+				recordSchedLag(client.shard, monotonicNow() - wakeUpAt);
+		}
+
+		/* Check if we are allowed to send this request */
+		if (control.numRequestsLeft-- > 0) {
+			/* Send HTTP request */
+			if (startRequest(client, control) > 0)
+				finishRequest(client, curl_easy_perform(client.curl), data);
+			else
+				abandonRequest(client, data); /* user gave up on this request a long time ago */
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Event-driven client engine: a single thread drives many virtual clients
+ * through CURL's multi socket interface and epoll. Think-times are
+ * implemented using a timer heap instead of sleeping threads.
+ */
+struct EventLoop {
+	int id;
+	int numLoops;
+	ClientControl &control;
+	ClientData &data;
+
+	int epollFd;
+	CURLM *multi;
+	int timerFd; /*< wakes up epoll_wait at precise deadlines */
+	int wakeUpFd; /*< eventfd the master thread signals after changing the concurrency */
+	int appliedConcurrency, appliedPoolSize;
+	Nanos timerFdDeadline;
+	Nanos curlTimerDeadline; /*< when CURL wants to be called back; NoTime if not needed */
+
+	/* Virtual clients owned by this loop, active or parked; client at index i has global id i * numLoops + id */
+	std::vector<std::unique_ptr<VirtualClient>> clients;
+
+	/* Pending think-time expirations as (time, client index, sequence) */
+	typedef std::tuple<Nanos, size_t, uint64_t> Timer;
+	std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+	uint64_t timerSeq;
+
+	/* Rate mode: this loop generates its share of the arrivals */
+	std::unique_ptr<ArrivalSource> arrivalSource;
+	std::deque<Arrival> backlog; /* arrivals waiting for a client */
+	std::vector<size_t> idleClients; /* may contain stale entries, see popIdleClient() */
+	bool arrivalsFinished; /* trace replay: all arrivals were dispatched */
+
+	EventLoop(int id, int numLoops, ClientControl &control, ClientData &data, int wakeUpFd);
+	~EventLoop();
+
+	size_t share(int total) const;
+	void adjustClients();
+	void activateClient(size_t index);
+	void sendWarmUp(size_t index);
+	void scheduleClient(size_t index);
+	bool sendRequest(size_t index);
+	void fireTimers();
+	void serveBacklog(size_t index);
+	bool popIdleClient(size_t &index);
+	void fireArrivals();
+	void processCompletions();
+	void run();
+};
+
+int eventLoopSocketCallback(CURL *easy, curl_socket_t s, int what, void *userp, void *socketp)
+{
+	EventLoop *loop = (EventLoop *)userp;
+
+	struct epoll_event ev;
+	ev.events = 0;
+	ev.data.fd = s;
+	if (what & CURL_POLL_IN)
+		ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		ev.events |= EPOLLOUT;
+
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, s, NULL);
+	}
+	else if (socketp == NULL) {
+		epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, s, &ev);
+		curl_multi_assign(loop->multi, s, loop); /* mark socket as known */
+	}
+	else {
+		epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, s, &ev);
+	}
+	return 0;
+}
+
+int eventLoopTimerCallback(CURLM *multi, long timeoutMs, void *userp)
+{
+	EventLoop *loop = (EventLoop *)userp;
+
+	if (timeoutMs < 0)
+		loop->curlTimerDeadline = NoTime;
+	else
+		loop->curlTimerDeadline = monotonicNow() + timeoutMs * (NanoSecondsInASecond / 1000);
+	return 0;
+}
+
+EventLoop::EventLoop(int _id, int _numLoops, ClientControl &_control, ClientData &_data, int _wakeUpFd) :
+	id(_id),
+	numLoops(_numLoops),
+	control(_control),
+	data(_data),
+	wakeUpFd(_wakeUpFd),
+	appliedConcurrency(-1),
+	appliedPoolSize(-1),
+	timerFdDeadline(NoTime),
+	curlTimerDeadline(NoTime),
+	timerSeq(0),
+	arrivalsFinished(false)
+{
+	epollFd = epoll_create1(EPOLL_CLOEXEC);
+	timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = timerFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+	ev.data.fd = wakeUpFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeUpFd, &ev);
+	multi = curl_multi_init();
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, eventLoopSocketCallback);
+	curl_multi_setopt(multi, CURLMOPT_SOCKETDATA, this);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, eventLoopTimerCallback);
+	curl_multi_setopt(multi, CURLMOPT_TIMERDATA, this);
+	if (control.streamsPerConnection > 1) {
+		curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+		curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, (long)control.streamsPerConnection);
+	}
+	else {
+		curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_NOTHING); /* one request per connection at a time */
+	}
+
+	if (control.rateMode)
+		arrivalSource.reset(newArrivalSource(control, id, numLoops));
+}
+
+EventLoop::~EventLoop()
+{
+	for (auto &client : clients) {
+		if (client->inFlight)
+			curl_multi_remove_handle(multi, client->curl);
+	}
+	clients.clear();
+	curl_multi_cleanup(multi);
+	close(timerFd);
+	close(epollFd);
+}
+
+/* This loop's share of a total number of clients */
+size_t EventLoop::share(int total) const
+{
+	return (total > id) ? (total - id + numLoops - 1) / numLoops : 0;
+}
+
+/*
+ * Match the requested concurrency: activate the clients below it, creating
+ * them if needed, and park those beyond it. Clients are never destroyed,
+ * hence the concurrency can grow again without creating clients. Clients
+ * with a request in flight are allowed to finish it first.
+ */
+void EventLoop::adjustClients()
+{
+	int concurrency = control.concurrency; /* for atomicity */
+	int poolSize = control.poolSize;
+	if (concurrency == appliedConcurrency && poolSize == appliedPoolSize)
+		return;
+	appliedConcurrency = concurrency;
+	appliedPoolSize = poolSize;
+	size_t target = share(concurrency);
+
+	while (clients.size() < std::max(target, share(poolSize))) {
+		size_t i = clients.size();
+		clients.emplace_back(new VirtualClient(i * numLoops + id, control, data.shardFor(id)));
+		clients[i]->parked = true;
+		if (control.prewarm)
+			sendWarmUp(i);
+	}
+	for (size_t i = 0; i < clients.size(); i++) {
+		VirtualClient &client = *clients[i];
+		if (i < target && client.parked) {
+			client.parked = false;
+			if (!client.inFlight)
+				activateClient(i);
+		}
+		else if (i >= target && !client.parked) {
+			client.parked = true;
+			client.idle = false;
+			client.timerSeq = ++timerSeq; /* cancel its think-time */
+		}
+	}
+
+	/*
+	 * Connections are cached by the multi handle, by default for four times
+	 * the requests in flight; keep one per client, also parked ones, so
+	 * that connections are not closed just because few requests happen to
+	 * be in flight.
+	 */
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)std::max<size_t>(clients.size(), 1));
+}
+
+/* Let a client that was created or parked work */
+void EventLoop::activateClient(size_t index)
+{
+	clients[index]->lastArrivalTime = monotonicNow(); /* open model: do not catch up on time spent parked */
+	if (control.rateMode)
+		serveBacklog(index);
+	else
+		scheduleClient(index);
+}
+
+/* Open the client's connection ahead of time, see ClientControl::prewarm */
+void EventLoop::sendWarmUp(size_t index)
+{
+	VirtualClient &client = *clients[index];
+	startWarmUp(client, control);
+	client.inFlight = true;
+	client.warming = true;
+	curl_multi_add_handle(multi, client.curl);
+}
+
+/* Let the client think, then wake it up to issue its next request */
+void EventLoop::scheduleClient(size_t index)
+{
+	VirtualClient &client = *clients[index];
+	Nanos wakeUpAt = thinkUntil(client, control);
+	client.timerSeq = ++timerSeq;
+	timers.emplace(wakeUpAt, index, client.timerSeq);
+}
+
+/* Send the client's request; returns false if it could not be sent */
+bool EventLoop::sendRequest(size_t index)
+{
+	VirtualClient &client = *clients[index];
+
+	/* Check if we are allowed to send this request */
+	if (control.numRequestsLeft-- <= 0)
+		return false;
+
+	if (startRequest(client, control) <= 0) {
+		abandonRequest(client, data); /* user gave up on this request a long time ago */
+		return false;
+	}
+	client.inFlight = true;
+	curl_multi_add_handle(multi, client.curl);
+	return true;
+}
+
+/* Issue requests of clients whose think-time expired */
+void EventLoop::fireTimers()
+{
+	Nanos t = monotonicNow();
+	while (!timers.empty() && std::get<0>(timers.top()) <= t) {
+		Nanos deadline = std::get<0>(timers.top());
+		size_t index = std::get<1>(timers.top());
+		uint64_t seq = std::get<2>(timers.top());
+		timers.pop();
+
+		/* Ignore timers of clients that were parked in the meantime */
+		if (clients[index]->timerSeq != seq)
+			continue;
+
+		recordSchedLag(data.shardFor(id), t - deadline);
+		if (!sendRequest(index))
+			scheduleClient(index);
+	}
+}
+
+/* Rate mode: give the client the oldest waiting arrival, or let it wait for the next one */
+void EventLoop::serveBacklog(size_t index)
+{
+	VirtualClient &client = *clients[index];
+	while (!backlog.empty()) {
+		takeArrival(client, backlog.front());
+		backlog.pop_front();
+		if (sendRequest(index))
+			return;
+	}
+	client.idle = true;
+	idleClients.push_back(index);
+}
+
+/* Rate mode: find a client waiting for an arrival */
+bool EventLoop::popIdleClient(size_t &index)
+{
+	while (!idleClients.empty()) {
+		index = idleClients.back();
+		idleClients.pop_back();
+
+		/* Skip clients that were parked or reused in the meantime */
+		if (clients[index]->idle) {
+			clients[index]->idle = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Rate mode: dispatch arrivals that are due to idle clients or the backlog */
+void EventLoop::fireArrivals()
+{
+	size_t maxBacklog = control.maxBacklog / numLoops + (control.maxBacklog % numLoops != 0);
+	StatsShard &shard = data.shardFor(id);
+
+	Arrival arrival;
+	Nanos t = monotonicNow();
+	while (arrivalSource->nextArrivalTime <= t) {
+		if (!arrivalSource->take(control, arrival))
+			continue; /* paused */
+
+		int i = shard.beginWrite();
+		ShardBuffer &buffer = *shard.buffers[i];
+		buffer.numArrivals++;
+		buffer.schedLags.record(toHistogramValue(t - arrival.time));
+		size_t index;
+		if (popIdleClient(index)) {
+			arrival.queued = false;
+			takeArrival(*clients[index], arrival);
+			if (!sendRequest(index))
+				serveBacklog(index);
+		}
+		else if (backlog.size() >= maxBacklog) {
+			buffer.numDropped++;
+		}
+		else {
+			buffer.numQueued++;
+			arrival.queued = true;
+			backlog.push_back(std::move(arrival));
+		}
+		shard.endWrite(i);
+	}
+
+	/* Let the master thread know once the trace was entirely dispatched */
+	if (arrivalSource->exhausted() && backlog.empty() && !arrivalsFinished) {
+		arrivalsFinished = true;
+		control.numTraceReplayers--;
+	}
+}
+
+/* Account for requests that CURL finished */
+void EventLoop::processCompletions()
+{
+	CURLMsg *msg;
+	int msgsLeft;
+	while ((msg = curl_multi_info_read(multi, &msgsLeft)) != NULL) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		CURL *curl = msg->easy_handle;
+		CURLcode result = msg->data.result;
+		curl_multi_remove_handle(multi, curl);
+
+		VirtualClient *client;
+		curl_easy_getinfo(curl, CURLINFO_PRIVATE, &client);
+		client->inFlight = false;
+		size_t index = (client->id - id) / numLoops;
+		if (client->warming) {
+			client->warming = false; /* not accounted */
+			if (!client->parked)
+				activateClient(index);
+		}
+		else {
+			finishRequest(*client, result, data);
+			if (client->parked)
+				; /* until activated again */
+			else if (control.rateMode)
+				serveBacklog(index);
+			else
+				scheduleClient(index);
+		}
+	}
+}
+
+void EventLoop::run()
+{
+	const int MaxEvents = 1024;
+	const Nanos MaxWait = ControlPeriod; /* to notice control changes */
+	struct epoll_event events[MaxEvents];
+	int stillRunning;
+	StatsShard &shard = data.shardFor(id);
+	Nanos busySince = monotonicNow();
+
+	usePreciseTimers();
+	while (control.running) {
+		adjustClients();
+
+		/* Compute how long we may sleep */
+		Nanos t = monotonicNow();
+		if (arrivalSource)
+			arrivalSource->update(control, t);
+		Nanos wakeUpAt = t + MaxWait;
+		if (!timers.empty())
+			wakeUpAt = std::min(wakeUpAt, std::get<0>(timers.top()));
+		if (curlTimerDeadline != NoTime)
+			wakeUpAt = std::min(wakeUpAt, curlTimerDeadline);
+		if (arrivalSource)
+			wakeUpAt = std::min(wakeUpAt, arrivalSource->nextArrivalTime);
+
+		/*
+		 * epoll_wait's timeout only has millisecond resolution: sleep on a
+		 * timerfd armed for the precise deadline instead, or just poll if
+		 * the deadline is close enough to spin.
+		 */
+		int timeoutMs = 0;
+		if (wakeUpAt - control.spinTime > t) {
+			timeoutMs = -1;
+			if (wakeUpAt - control.spinTime != timerFdDeadline) {
+				timerFdDeadline = wakeUpAt - control.spinTime;
+				struct itimerspec its = { { 0, 0 }, toTimespec(timerFdDeadline) };
+				timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+			}
+		}
+
+		/* Time not spent blocked here, including spinning, is busy time */
+		if (timeoutMs != 0)
+			shard.pacerBusyTime += monotonicNow() - busySince;
+		int n = epoll_wait(epollFd, events, MaxEvents, timeoutMs);
+		if (timeoutMs != 0)
+			busySince = monotonicNow();
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == timerFd || events[i].data.fd == wakeUpFd) {
+				uint64_t expirations; /* just acknowledge them */
+				while (read(events[i].data.fd, &expirations, sizeof(expirations)) > 0)
+					;
+				continue;
+			}
+			int flags = 0;
+			if (events[i].events & EPOLLIN)
+				flags |= CURL_CSELECT_IN;
+			if (events[i].events & EPOLLOUT)
+				flags |= CURL_CSELECT_OUT;
+			if (events[i].events & (EPOLLERR | EPOLLHUP))
+				flags |= CURL_CSELECT_ERR;
+			curl_multi_socket_action(multi, events[i].data.fd, flags, &stillRunning);
+		}
+
+		if (curlTimerDeadline != NoTime && curlTimerDeadline <= monotonicNow()) {
+			curlTimerDeadline = NoTime;
+			curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &stillRunning);
+		}
+
+		if (arrivalSource)
+			fireArrivals();
+		else
+			fireTimers();
+		processCompletions();
+	}
+}
+
+int eventLoopMain(int id, int numLoops, ClientControl &control, ClientData &data, int wakeUpFd)
+{
+	/* Block some signals to let master thread deal with them */
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGQUIT);
+	sigaddset(&sigset, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	EventLoop loop(id, numLoops, control, data, wakeUpFd);
+	loop.run();
+
+	return 0;
+}
+
+IntervalData::IntervalData(int histogramDigits, size_t numTemplates, bool recordPhases) :
+	latencies(histogramDigits),
+	sendLags(histogramDigits),
+	schedLags(histogramDigits),
+	responseSizes(histogramDigits),
+	decodeTimes(histogramDigits)
+{
+	errorLatencies.assign(NUM_ERROR_CLASSES, Histogram(histogramDigits));
+	TemplateData t = { Histogram(histogramDigits), 0, 0 };
+	templates.assign(numTemplates, t);
+	if (recordPhases)
+		phases.assign(NUM_PHASES, Histogram(histogramDigits));
+	reset();
+}
+
+void IntervalData::reset()
+{
+	for (auto &t : templates) {
+		t.latencies.reset();
+		t.numRequests = 0;
+		t.numErrors = 0;
+	}
+	latencies.reset();
+	sendLags.reset();
+	schedLags.reset();
+	for (auto &h : phases)
+		h.reset();
+	numRequests = 0;
+	std::fill(numOptions, numOptions + MaxMarkers, 0);
+	numOpenQueuing = 0;
+	numErrors = 0;
+	std::fill(numErrorClasses, numErrorClasses + NUM_ERROR_CLASSES, 0);
+	std::fill(numStatuses, numStatuses + NumStatusCodes, 0);
+	for (auto &h : errorLatencies)
+		h.reset();
+	numArrivals = 0;
+	numQueued = 0;
+	numDropped = 0;
+	numNewConnections = 0;
+	numReusedConnections = 0;
+	numTlsFull = 0;
+	numTlsResumed = 0;
+	rxBytes = 0;
+	txBytes = 0;
+	encodedBytes = 0;
+	decodedBytes = 0;
+	responseSizes.reset();
+	decodeTimes.reset();
+	queueLength = 0;
+	statsWaits = 0;
+	statsTime = 0;
+	cpuTime = 0;
+	numCpus = 0;
+	pacerUtilization = 0;
+}
+
+void IntervalData::add(const IntervalData &other)
+{
+	for (size_t i = 0; i < templates.size(); i++) {
+		templates[i].latencies.add(other.templates[i].latencies);
+		templates[i].numRequests += other.templates[i].numRequests;
+		templates[i].numErrors += other.templates[i].numErrors;
+	}
+	latencies.add(other.latencies);
+	sendLags.add(other.sendLags);
+	schedLags.add(other.schedLags);
+	for (size_t i = 0; i < phases.size(); i++)
+		phases[i].add(other.phases[i]);
+	numRequests += other.numRequests;
+	for (size_t i = 0; i < MaxMarkers; i++)
+		numOptions[i] += other.numOptions[i];
+	numOpenQueuing += other.numOpenQueuing;
+	numErrors += other.numErrors;
+	for (int i = 0; i < NUM_ERROR_CLASSES; i++) {
+		numErrorClasses[i] += other.numErrorClasses[i];
+		errorLatencies[i].add(other.errorLatencies[i]);
+	}
+	for (int i = 0; i < NumStatusCodes; i++)
+		numStatuses[i] += other.numStatuses[i];
+	numArrivals += other.numArrivals;
+	numQueued += other.numQueued;
+	numDropped += other.numDropped;
+	numNewConnections += other.numNewConnections;
+	numReusedConnections += other.numReusedConnections;
+	numTlsFull += other.numTlsFull;
+	numTlsResumed += other.numTlsResumed;
+	rxBytes += other.rxBytes;
+	txBytes += other.txBytes;
+	encodedBytes += other.encodedBytes;
+	decodedBytes += other.decodedBytes;
+	responseSizes.add(other.responseSizes);
+	decodeTimes.add(other.decodeTimes);
+	queueLength += other.queueLength;
+	statsWaits += other.statsWaits;
+	statsTime = std::max(statsTime, other.statsTime);
+	cpuTime += other.cpuTime;
+	numCpus += other.numCpus;
+	pacerUtilization = std::max(pacerUtilization, other.pacerUtilization);
+}
+
+/* Serialize, e.g., to send from a worker to the coordinator, which must use the same configuration */
+void IntervalData::serialize(std::string &out) const
+{
+	appendValue(out, (uint32_t)templates.size());
+	for (auto &t : templates) {
+		t.latencies.serialize(out);
+		appendValue(out, t.numRequests);
+		appendValue(out, t.numErrors);
+	}
+	latencies.serialize(out);
+	sendLags.serialize(out);
+	schedLags.serialize(out);
+	appendValue(out, (uint32_t)phases.size());
+	for (auto &h : phases)
+		h.serialize(out);
+	appendValue(out, numRequests);
+	for (size_t i = 0; i < MaxMarkers; i++)
+		appendValue(out, numOptions[i]);
+	appendValue(out, numOpenQueuing);
+	appendValue(out, numErrors);
+	for (int i = 0; i < NUM_ERROR_CLASSES; i++) {
+		appendValue(out, numErrorClasses[i]);
+		errorLatencies[i].serialize(out);
+	}
+	/* Only statuses that occurred, as (status, count) */
+	appendValue(out, (uint32_t)(NumStatusCodes - std::count(numStatuses, numStatuses + NumStatusCodes, 0)));
+	for (uint32_t i = 0; i < (uint32_t)NumStatusCodes; i++) {
+		if (numStatuses[i]) {
+			appendValue(out, i);
+			appendValue(out, numStatuses[i]);
+		}
+	}
+	appendValue(out, numArrivals);
+	appendValue(out, numQueued);
+	appendValue(out, numDropped);
+	appendValue(out, numNewConnections);
+	appendValue(out, numReusedConnections);
+	appendValue(out, numTlsFull);
+	appendValue(out, numTlsResumed);
+	appendValue(out, rxBytes);
+	appendValue(out, txBytes);
+	appendValue(out, encodedBytes);
+	appendValue(out, decodedBytes);
+	responseSizes.serialize(out);
+	decodeTimes.serialize(out);
+	appendValue(out, queueLength);
+	appendValue(out, statsWaits);
+	appendValue(out, statsTime);
+	appendValue(out, cpuTime);
+	appendValue(out, numCpus);
+	appendValue(out, pacerUtilization);
+}
+
+/* Merge serialized data into this; returns false if malformed */
+bool IntervalData::addSerialized(const std::string &in)
+{
+	IntervalData other(latencies.digits(), templates.size(), !phases.empty());
+	const char *p = in.data(), *end = in.data() + in.size();
+
+	uint32_t numTemplates;
+	if (!readValue(p, end, numTemplates) || numTemplates != templates.size())
+		return false;
+	for (auto &t : other.templates) {
+		if (!t.latencies.addSerialized(p, end) ||
+			!readValue(p, end, t.numRequests) || !readValue(p, end, t.numErrors))
+			return false;
+	}
+	if (!other.latencies.addSerialized(p, end) ||
+		!other.sendLags.addSerialized(p, end) ||
+		!other.schedLags.addSerialized(p, end))
+		return false;
+	uint32_t numPhases;
+	if (!readValue(p, end, numPhases) || numPhases != phases.size())
+		return false;
+	for (auto &h : other.phases) {
+		if (!h.addSerialized(p, end))
+			return false;
+	}
+	if (!readValue(p, end, other.numRequests))
+		return false;
+	for (size_t i = 0; i < MaxMarkers; i++) {
+		if (!readValue(p, end, other.numOptions[i]))
+			return false;
+	}
+	if (!readValue(p, end, other.numOpenQueuing) ||
+		!readValue(p, end, other.numErrors))
+		return false;
+	for (int i = 0; i < NUM_ERROR_CLASSES; i++) {
+		if (!readValue(p, end, other.numErrorClasses[i]) || !other.errorLatencies[i].addSerialized(p, end))
+			return false;
+	}
+	uint32_t numStatuses;
+	if (!readValue(p, end, numStatuses))
+		return false;
+	for (uint32_t j = 0; j < numStatuses; j++) {
+		uint32_t status;
+		if (!readValue(p, end, status) || status >= (uint32_t)NumStatusCodes ||
+			!readValue(p, end, other.numStatuses[status]))
+			return false;
+	}
+	if (!readValue(p, end, other.numArrivals) ||
+		!readValue(p, end, other.numQueued) ||
+		!readValue(p, end, other.numDropped) ||
+		!readValue(p, end, other.numNewConnections) ||
+		!readValue(p, end, other.numReusedConnections) ||
+		!readValue(p, end, other.numTlsFull) ||
+		!readValue(p, end, other.numTlsResumed) ||
+		!readValue(p, end, other.rxBytes) ||
+		!readValue(p, end, other.txBytes) ||
+		!readValue(p, end, other.encodedBytes) ||
+		!readValue(p, end, other.decodedBytes) ||
+		!other.responseSizes.addSerialized(p, end) ||
+		!other.decodeTimes.addSerialized(p, end) ||
+		!readValue(p, end, other.queueLength) ||
+		!readValue(p, end, other.statsWaits) ||
+		!readValue(p, end, other.statsTime) ||
+		!readValue(p, end, other.cpuTime) ||
+		!readValue(p, end, other.numCpus) ||
+		!readValue(p, end, other.pacerUtilization) ||
+		p != end)
+		return false;
+	add(other);
+	return true;
+}
+
+/* Retrieve data collected since the last call and add it to interval, without blocking clients */
+void collect(ClientData &data, IntervalData &interval)
+{
+	Nanos collectStart = monotonicNow();
+	for (auto &shard : data.shards) {
+		ShardBuffer &buffer = shard->collect(interval.statsWaits);
+		buffer.latencies.drainInto(interval.latencies);
+		buffer.sendLags.drainInto(interval.sendLags);
+		buffer.schedLags.drainInto(interval.schedLags);
+		for (size_t i = 0; i < buffer.phases.size(); i++)
+			buffer.phases[i]->drainInto(interval.phases[i]);
+		for (size_t i = 0; i < buffer.templates.size(); i++) {
+			TemplateData &t = interval.templates[i];
+			buffer.templates[i]->latencies.drainInto(t.latencies);
+			t.numRequests += buffer.templates[i]->numRequests.exchange(0);
+			t.numErrors += buffer.templates[i]->numErrors.exchange(0);
+		}
+		interval.numRequests += buffer.numRequests.exchange(0);
+		for (size_t i = 0; i < MaxMarkers; i++)
+			interval.numOptions[i] += buffer.numOptions[i].exchange(0);
+		interval.numOpenQueuing += buffer.numOpenQueuing.exchange(0);
+		interval.numErrors += buffer.numErrors.exchange(0);
+		for (int i = 0; i < NUM_ERROR_CLASSES; i++) {
+			interval.numErrorClasses[i] += buffer.numErrorClasses[i].exchange(0);
+			if (buffer.errorLatencies[i])
+				buffer.errorLatencies[i]->drainInto(interval.errorLatencies[i]);
+		}
+		for (int i = 0; i < NumStatusCodes; i++) {
+			if (buffer.numStatuses[i].load(std::memory_order_relaxed)) /* most are never seen */
+				interval.numStatuses[i] += buffer.numStatuses[i].exchange(0);
+		}
+		interval.numArrivals += buffer.numArrivals.exchange(0);
+		interval.numQueued += buffer.numQueued.exchange(0);
+		interval.numDropped += buffer.numDropped.exchange(0);
+		interval.numNewConnections += buffer.numNewConnections.exchange(0);
+		interval.numReusedConnections += buffer.numReusedConnections.exchange(0);
+		interval.numTlsFull += buffer.numTlsFull.exchange(0);
+		interval.numTlsResumed += buffer.numTlsResumed.exchange(0);
+		interval.rxBytes += buffer.rxBytes.exchange(0);
+		interval.txBytes += buffer.txBytes.exchange(0);
+		interval.encodedBytes += buffer.encodedBytes.exchange(0);
+		interval.decodedBytes += buffer.decodedBytes.exchange(0);
+		buffer.responseSizes.drainInto(interval.responseSizes);
+		buffer.decodeTimes.drainInto(interval.decodeTimes);
+	}
+	interval.queueLength += data.queueLength(); /* not reset by collecting */
+
+	/* How busy httpmon itself was since the last collection */
+	Nanos elapsed = collectStart - data.lastCollectTime;
+	for (auto &shard : data.shards) {
+		uint64_t busyTime = shard->pacerBusyTime;
+		if (elapsed > 0)
+			interval.pacerUtilization = std::max(interval.pacerUtilization,
+				std::min(1.0, (double)(busyTime - shard->collectedPacerBusyTime) / elapsed));
+		shard->collectedPacerBusyTime = busyTime;
+	}
+	Nanos cpuTime = processCpuTime();
+	interval.cpuTime += cpuTime - data.lastCpuTime;
+	interval.numCpus += usableCpus();
+	data.lastCollectTime = collectStart;
+	data.lastCpuTime = cpuTime;
+
+	interval.statsTime += monotonicNow() - collectStart;
+}
+
+/* Report key counting failed requests of an ErrorClass, e.g., errorTimeout */
+std::string errorClassKey(int errorClass)
+{
+	std::string name = ErrorClassNames[errorClass];
+	name[0] = toupper(name[0]);
+	return "error" + name;
+}
+
+/*
+ * Reasons why httpmon itself, rather than the server, may have limited
+ * throughput during an interval of length dt; empty if none. The report
+ * loop time is that of the previous interval, of length lastDt.
+ */
+std::string saturationReasons(const ClientControl &control, const IntervalData &data,
+	const AccumulatedData &accData, double dt, double lastDt, double schedLag99)
+{
+	const double MaxUtilization = 0.9;
+	const double MaxSchedLag = 0.005; /* seconds */
+	const double MaxQueuedShare = 0.1; /* of arrivals */
+	const double MaxReportLoopShare = 0.1; /* of the report interval */
+
+	std::string reasons;
+	auto add = [&](const std::string &reason) {
+		reasons += (reasons.empty() ? "" : "; ") + reason;
+	};
+	double cpu = toSeconds(data.cpuTime) / dt;
+	unsigned numCpus = std::max(1u, data.numCpus);
+	if (cpu >= MaxUtilization * numCpus)
+		add(strprintf("CPU use at %.0f%% of %u CPUs", cpu * 100, numCpus));
+	if (data.pacerUtilization >= MaxUtilization)
+		add(strprintf("busiest event loop or arrival scheduler %.0f%% busy", data.pacerUtilization * 100));
+	if (schedLag99 > MaxSchedLag)
+		add(strprintf("requests scheduled %.0fus late (99th percentile)", schedLag99 * MicroSecondsInASecond));
+	if (control.rateMode && data.numQueued > MaxQueuedShare * data.numArrivals)
+		add(strprintf("%u of %u arrivals waited for a free client, raise --concurrency",
+			data.numQueued, data.numArrivals));
+	if (data.numDropped > 0)
+		add(strprintf("%u arrivals dropped, raise --max-backlog or --concurrency", data.numDropped));
+	if (toSeconds(accData.reportLoopTime) > MaxReportLoopShare * lastDt)
+		add(strprintf("reporting took %.0fms", toSeconds(accData.reportLoopTime) * 1000));
+	return reasons;
+}
+
+void report(ClientControl &control, const IntervalData &data, AccumulatedData &accData)
+{
+	/* Compute how much time passed */
+	double reportTime = now(); /* wall-clock, to be shown */
+	Nanos t = monotonicNow();
+	double dt = toSeconds(t - accData.reportTime);
+	double lastDt = toSeconds(accData.lastInterval);
+	accData.lastInterval = t - accData.reportTime;
+	accData.reportTime = t;
+
+	/* Compute statistics since last reporting */
+	const Histogram &latencies = data.latencies;
+	double throughput = (double)latencies.count() / dt;
+	double recommendationRate = (double)data.numOptions[0] / latencies.count();
+	double commentRate = (double)data.numOptions[1] / latencies.count();
+	int queueLength = data.queueLength;
+	auto stats = computeStatistics(latencies);
+	auto schedLagStats = computeStatistics(data.schedLags);
+
+	/* This interval still belongs to the warm-up, if any, possibly its last one */
+	bool warmingUp = accData.warmUp && accData.warmUp->active();
+	bool warmUpEnded = warmingUp && accData.warmUp->addInterval(dt, data.numRequests, throughput, stats.median);
+
+	/* Compute accumulated statistics */
+	accData.numRequests += data.numRequests;
+	for (size_t i = 0; i < MaxMarkers; i++)
+		accData.numOptions[i] += data.numOptions[i];
+	accData.numOpenQueuing += data.numOpenQueuing;
+	accData.numErrors += data.numErrors;
+	for (int i = 0; i < NUM_ERROR_CLASSES; i++)
+		accData.numErrorClasses[i] += data.numErrorClasses[i];
+	for (int i = 0; i < NumStatusCodes; i++)
+		accData.numStatuses[i] += data.numStatuses[i];
+	accData.numQueued += data.numQueued;
+	accData.numDropped += data.numDropped;
+	accData.rxBytes += data.rxBytes;
+	accData.txBytes += data.txBytes;
+	accData.numTlsFull += data.numTlsFull;
+	accData.numTlsResumed += data.numTlsResumed;
+	accData.latencies.add(latencies);
+	auto accStats = computeStatistics(accData.latencies);
+	accData.sendLags.add(data.sendLags);
+	accData.schedLags.add(data.schedLags);
+	auto accSchedLagStats = computeStatistics(accData.schedLags);
+
+	std::string line = strprintf("time=%.6f latency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms latency95=%.0fms latency99=%.0fms requests=%d option1=%d option2=%d errors=%d throughput=%.0frps ql=%d rr=%.2f%% cr=%.2f%% accRequests=%d accOption1=%d accOption2=%d accLatency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms accLatency95=%.0fms accLatency99=%.0fms accOpenQueuing=%d accErrors=%d latency999=%.0fms accLatency999=%.0fms statsWaits=%d statsTime=%.0fus schedLag=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)us schedLag99=%.0fus accSchedLag99=%.0fus newConns=%d reusedConns=%d",
+		reportTime,
+		stats.minimum * 1000,
+		stats.lowerQuartile * 1000,
+		stats.median * 1000,
+		stats.upperQuartile * 1000,
+		stats.maximum * 1000,
+		stats.average * 1000,
+		stats.percentile95 * 1000,
+		stats.percentile99 * 1000,
+		data.numRequests,
+		data.numOptions[0],
+		data.numOptions[1],
+		data.numErrors,
+		throughput,
+		queueLength,
+		recommendationRate * 100,
+		commentRate * 100,
+		/* Accumulated statistics */
+		accData.numRequests,
+		accData.numOptions[0],
+		accData.numOptions[1],
+		accStats.minimum * 1000,
+		accStats.lowerQuartile * 1000,
+		accStats.median * 1000,
+		accStats.upperQuartile * 1000,
+		accStats.maximum * 1000,
+		accStats.average * 1000,
+		accStats.percentile95 * 1000,
+		accStats.percentile99 * 1000,
+		accData.numOpenQueuing,
+		accData.numErrors,
+		stats.percentile999 * 1000,
+		accStats.percentile999 * 1000,
+		data.statsWaits,
+		toSeconds(data.statsTime) * MicroSecondsInASecond,
+		schedLagStats.minimum * MicroSecondsInASecond,
+		schedLagStats.lowerQuartile * MicroSecondsInASecond,
+		schedLagStats.median * MicroSecondsInASecond,
+		schedLagStats.upperQuartile * MicroSecondsInASecond,
+		schedLagStats.maximum * MicroSecondsInASecond,
+		schedLagStats.average * MicroSecondsInASecond,
+		schedLagStats.percentile99 * MicroSecondsInASecond,
+		accSchedLagStats.percentile99 * MicroSecondsInASecond,
+		data.numNewConnections,
+		data.numReusedConnections
+	);
+	line += strprintf(" tlsFull=%d tlsResumed=%d accTlsFull=%d accTlsResumed=%d",
+		data.numTlsFull,
+		data.numTlsResumed,
+		accData.numTlsFull,
+		accData.numTlsResumed);
+	if (accData.warmUp)
+		line += strprintf(" warmingUp=%d", warmingUp);
+	/* How hard httpmon itself worked */
+	std::string saturation = saturationReasons(control, data, accData, dt, lastDt, schedLagStats.percentile99);
+	accData.saturated = !saturation.empty();
+	line += strprintf(" cpu=%.0f%% cpus=%u pacerUtil=%.0f%% reportLoop=%.0fus saturated=%d",
+		toSeconds(data.cpuTime) / dt * 100,
+		data.numCpus,
+		data.pacerUtilization * 100,
+		toSeconds(accData.reportLoopTime) * MicroSecondsInASecond,
+		accData.saturated);
+	/* Bytes over the wire, and sizes of successful replies */
+	auto sizeStats = computeStatistics(data.responseSizes, 1);
+	line += strprintf(" rxBytes=%llu txBytes=%llu rxRate=%.2fMB/s txRate=%.2fMB/s accRxBytes=%llu accTxBytes=%llu responseSize=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)B responseSize99=%.0fB",
+		(unsigned long long)data.rxBytes,
+		(unsigned long long)data.txBytes,
+		data.rxBytes / dt / 1e6,
+		data.txBytes / dt / 1e6,
+		(unsigned long long)accData.rxBytes,
+		(unsigned long long)accData.txBytes,
+		sizeStats.minimum,
+		sizeStats.lowerQuartile,
+		sizeStats.median,
+		sizeStats.upperQuartile,
+		sizeStats.maximum,
+		sizeStats.average,
+		sizeStats.percentile99);
+	if (control.decode) {
+		auto decodeStats = computeStatistics(data.decodeTimes);
+		line += strprintf(" decoded=%llu encodedBytes=%llu decodedBytes=%llu compressionRatio=%.2f decodeTime=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)us decodeTime99=%.0fus",
+			(unsigned long long)data.decodeTimes.count(),
+			(unsigned long long)data.encodedBytes,
+			(unsigned long long)data.decodedBytes,
+			(double)data.decodedBytes / data.encodedBytes,
+			decodeStats.minimum * MicroSecondsInASecond,
+			decodeStats.lowerQuartile * MicroSecondsInASecond,
+			decodeStats.median * MicroSecondsInASecond,
+			decodeStats.upperQuartile * MicroSecondsInASecond,
+			decodeStats.maximum * MicroSecondsInASecond,
+			decodeStats.average * MicroSecondsInASecond,
+			decodeStats.percentile99 * MicroSecondsInASecond);
+	}
+	/* Why requests failed, with the latency of each kind of failure, and HTTP statuses */
+	for (int i = ERROR_NONE + 1; i < NUM_ERROR_CLASSES; i++)
+		line += strprintf(" %s=%d", errorClassKey(i).c_str(), data.numErrorClasses[i]);
+	for (int i = ERROR_NONE + 1; i < NUM_ERROR_CLASSES; i++) {
+		if (data.errorLatencies[i].count() == 0)
+			continue;
+		auto errorStats = computeStatistics(data.errorLatencies[i]);
+		std::string key = errorClassKey(i) + "Latency";
+		line += strprintf(" %s=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms %s99=%.0fms",
+			key.c_str(),
+			errorStats.minimum * 1000,
+			errorStats.lowerQuartile * 1000,
+			errorStats.median * 1000,
+			errorStats.upperQuartile * 1000,
+			errorStats.maximum * 1000,
+			errorStats.average * 1000,
+			key.c_str(),
+			errorStats.percentile99 * 1000);
+	}
+	uint32_t numStatusClasses[6] = { 0 }; /* 0 for no reply, then 1xx to 5xx */
+	std::string statuses;
+	for (int i = 0; i < NumStatusCodes; i++) {
+		numStatusClasses[i / 100] += data.numStatuses[i];
+		if (i > 0 && data.numStatuses[i])
+			statuses += strprintf("%s%d:%d", statuses.empty() ? "" : ",", i, data.numStatuses[i]);
+	}
+	for (int i = 1; i < 6; i++)
+		line += strprintf(" http%dxx=%d", i, numStatusClasses[i]);
+	if (!statuses.empty())
+		line += " statuses=" + statuses;
+	/* Markers beyond the first two are reported like option1 and option2 */
+	for (size_t i = 2; i < control.classifier->size(); i++) {
+		line += strprintf(" option%zu=%d option%zuRate=%.2f%% accOption%zu=%d",
+			i + 1, data.numOptions[i],
+			i + 1, (double)data.numOptions[i] / latencies.count() * 100,
+			i + 1, accData.numOptions[i]);
+	}
+	if (control.rateMode) {
+		auto sendLagStats = computeStatistics(data.sendLags);
+		auto accSendLagStats = computeStatistics(accData.sendLags);
+		line += strprintf(" arrivals=%d queued=%d dropped=%d accQueued=%d accDropped=%d sendLag=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)us sendLag99=%.0fus accSendLag99=%.0fus",
+			data.numArrivals,
+			data.numQueued,
+			data.numDropped,
+			accData.numQueued,
+			accData.numDropped,
+			sendLagStats.minimum * MicroSecondsInASecond,
+			sendLagStats.lowerQuartile * MicroSecondsInASecond,
+			sendLagStats.median * MicroSecondsInASecond,
+			sendLagStats.upperQuartile * MicroSecondsInASecond,
+			sendLagStats.maximum * MicroSecondsInASecond,
+			sendLagStats.average * MicroSecondsInASecond,
+			sendLagStats.percentile99 * MicroSecondsInASecond,
+			accSendLagStats.percentile99 * MicroSecondsInASecond);
+	}
+	if (!data.phases.empty()) {
+		/* Where did time go? Client-side queuing, then each phase of the request */
+		for (int i = -1; i < NUM_PHASES; i++) {
+			const char *name = (i < 0) ? "clientQueue" : RequestPhaseNames[i];
+			auto phaseStats = computeStatistics(i < 0 ? data.sendLags : data.phases[i]);
+			line += strprintf(" %s=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)us %s99=%.0fus",
+				name,
+				phaseStats.minimum * MicroSecondsInASecond,
+				phaseStats.lowerQuartile * MicroSecondsInASecond,
+				phaseStats.median * MicroSecondsInASecond,
+				phaseStats.upperQuartile * MicroSecondsInASecond,
+				phaseStats.maximum * MicroSecondsInASecond,
+				phaseStats.average * MicroSecondsInASecond,
+				name,
+				phaseStats.percentile99 * MicroSecondsInASecond);
+		}
+	}
+	line += "\n";
+
+	/* Sliding windows, reported like the last interval */
+	if (accData.windows) {
+		SlidingWindows &windows = *accData.windows;
+		windows.addInterval(latencies, data.numRequests, data.numErrors, dt);
+		for (size_t i = 0; i < windows.size(); i++) {
+			const WindowStatistics &w = windows.statistics(i);
+			auto windowStats = computeStatistics(w.latencies);
+			line += strprintf("time=%.6f window=%gs latency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms latency95=%.0fms latency99=%.0fms latency999=%.0fms requests=%llu errors=%llu throughput=%.0frps errorRate=%.2f%% span=%.0fs\n",
+				reportTime,
+				windows.length(i),
+				windowStats.minimum * 1000,
+				windowStats.lowerQuartile * 1000,
+				windowStats.median * 1000,
+				windowStats.upperQuartile * 1000,
+				windowStats.maximum * 1000,
+				windowStats.average * 1000,
+				windowStats.percentile95 * 1000,
+				windowStats.percentile99 * 1000,
+				windowStats.percentile999 * 1000,
+				(unsigned long long)w.numRequests,
+				(unsigned long long)w.numErrors,
+				w.latencies.count() / w.duration,
+				(double)w.numErrors / w.numRequests * 100,
+				w.duration);
+		}
+	}
+
+	/* Per-template statistics */
+	for (size_t i = 0; i < accData.templates.size(); i++) {
+		const TemplateData &interval = data.templates[i];
+		TemplateData &t = accData.templates[i];
+		t.numRequests += interval.numRequests;
+		t.numErrors += interval.numErrors;
+		t.latencies.add(interval.latencies);
+		auto templateStats = computeStatistics(interval.latencies);
+		auto templateAccStats = computeStatistics(t.latencies);
+		line += strprintf("time=%.6f template=%s latency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms latency95=%.0fms latency99=%.0fms requests=%d errors=%d throughput=%.0frps accRequests=%d accErrors=%d accLatency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms accLatency95=%.0fms accLatency99=%.0fms\n",
+			reportTime,
+			control.requestSpecs[i].name.c_str(),
+			templateStats.minimum * 1000,
+			templateStats.lowerQuartile * 1000,
+			templateStats.median * 1000,
+			templateStats.upperQuartile * 1000,
+			templateStats.maximum * 1000,
+			templateStats.average * 1000,
+			templateStats.percentile95 * 1000,
+			templateStats.percentile99 * 1000,
+			interval.numRequests,
+			interval.numErrors,
+			interval.latencies.count() / dt,
+			t.numRequests,
+			t.numErrors,
+			templateAccStats.minimum * 1000,
+			templateAccStats.lowerQuartile * 1000,
+			templateAccStats.median * 1000,
+			templateAccStats.upperQuartile * 1000,
+			templateAccStats.maximum * 1000,
+			templateAccStats.average * 1000,
+			templateAccStats.percentile95 * 1000,
+			templateAccStats.percentile99 * 1000);
+	}
+
+	/* Summarize the warm-up, then let accumulated statistics restart with the steady state */
+	if (warmUpEnded) {
+		auto coldStats = computeStatistics(accData.latencies);
+		double duration = accData.warmUp->elapsed();
+		line += strprintf("time=%.6f phase=warmup steadyStateStart=%.6f duration=%.1fs latency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms latency95=%.0fms latency99=%.0fms latency999=%.0fms requests=%d errors=%d throughput=%.0frps errorRate=%.2f%%\n",
+			reportTime,
+			reportTime,
+			duration,
+			coldStats.minimum * 1000,
+			coldStats.lowerQuartile * 1000,
+			coldStats.median * 1000,
+			coldStats.upperQuartile * 1000,
+			coldStats.maximum * 1000,
+			coldStats.average * 1000,
+			coldStats.percentile95 * 1000,
+			coldStats.percentile99 * 1000,
+			coldStats.percentile999 * 1000,
+			accData.numRequests,
+			accData.numErrors,
+			duration > 0 ? accData.latencies.count() / duration : 0,
+			accData.numRequests ? (double)accData.numErrors / accData.numRequests * 100 : 0);
+		resetAccumulated(accData);
+	}
+	fputs(line.c_str(), stdout);
+	if (accData.saturated && control.running) /* the final interval is mostly cleaning up */
+		fprintf(stderr, "[%f] WARNING: httpmon may be limiting throughput, not the server: %s\n",
+			reportTime, saturation.c_str());
+}
+
+/*
+ * Render the statistics of the last report for the metrics server. The
+ * binary snapshot starts with the magic "HMS1", the wall-clock time of the
+ * report and the length of its interval in seconds (doubles). It continues
+ * with the interval's data, prefixed by its length and serialized as for
+ * the coordinator, then the accumulated counters and histograms.
+ */
+void publishMetrics(MetricsServer &metrics, const ClientControl &control, const IntervalData &data,
+	const AccumulatedData &accData)
+{
+	const std::vector<double> latencyBounds = {
+		0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+	};
+	const double NanosToSeconds = 1.0 / NanoSecondsInASecond;
+	double dt = toSeconds(accData.lastInterval);
+	std::shared_ptr<MetricsSnapshot> snapshot(new MetricsSnapshot);
+	/* With a warm-up policy, accumulated statistics restart with the steady state */
+	const std::string since = accData.warmUp ? " since the steady state started" : " since httpmon started";
+
+	OpenMetricsWriter w;
+	w.family("httpmon_requests", "counter", ("Requests answered or failed" + since).c_str());
+	w.sample("httpmon_requests_total", "", accData.numRequests);
+	w.family("httpmon_errors", "counter", ("Requests failed" + since).c_str());
+	w.sample("httpmon_errors_total", "", accData.numErrors);
+	w.family("httpmon_errors_by_class", "counter", ("Requests failed" + since + ", by cause").c_str());
+	for (int i = ERROR_NONE + 1; i < NUM_ERROR_CLASSES; i++)
+		w.sample("httpmon_errors_by_class_total", strprintf("class=\"%s\"", ErrorClassNames[i]), accData.numErrorClasses[i]);
+	w.family("httpmon_responses", "counter", ("Replies received" + since + ", by HTTP status").c_str());
+	for (int i = 1; i < NumStatusCodes; i++) {
+		if (accData.numStatuses[i])
+			w.sample("httpmon_responses_total", strprintf("code=\"%d\"", i), accData.numStatuses[i]);
+	}
+	w.family("httpmon_interval_error_latency_seconds", "summary", "Latency of failed requests during the last report interval, by cause", "seconds");
+	for (int i = ERROR_NONE + 1; i < NUM_ERROR_CLASSES; i++) {
+		if (data.errorLatencies[i].count())
+			w.summary("httpmon_interval_error_latency_seconds", strprintf("class=\"%s\"", ErrorClassNames[i]), data.errorLatencies[i], NanosToSeconds);
+	}
+	w.family("httpmon_options", "counter", ("Replies containing each marker" + since).c_str());
+	for (size_t i = 0; i < control.classifier->size(); i++)
+		w.sample("httpmon_options_total", strprintf("option=\"%zu\"", i + 1), accData.numOptions[i]);
+	w.family("httpmon_latency_seconds", "histogram", ("Latency of successful requests" + since).c_str(), "seconds");
+	w.histogram("httpmon_latency_seconds", "", accData.latencies, NanosToSeconds, latencyBounds);
+	w.family("httpmon_interval_latency_seconds", "summary", "Latency of successful requests during the last report interval", "seconds");
+	w.summary("httpmon_interval_latency_seconds", "", data.latencies, NanosToSeconds);
+	w.family("httpmon_interval_requests", "gauge", "Requests answered or failed during the last report interval");
+	w.sample("httpmon_interval_requests", "", data.numRequests);
+	w.family("httpmon_interval_errors", "gauge", "Requests failed during the last report interval");
+	w.sample("httpmon_interval_errors", "", data.numErrors);
+	w.family("httpmon_interval_throughput", "gauge", "Successful requests per second during the last report interval");
+	w.sample("httpmon_interval_throughput", "", dt > 0 ? data.latencies.count() / dt : 0);
+	w.family("httpmon_received_bytes", "counter", ("Bytes received" + since + ", headers included, before decoding").c_str(), "bytes");
+	w.sample("httpmon_received_bytes_total", "", accData.rxBytes);
+	w.family("httpmon_sent_bytes", "counter", ("Bytes sent" + since + ", headers included").c_str(), "bytes");
+	w.sample("httpmon_sent_bytes_total", "", accData.txBytes);
+	w.family("httpmon_tls_handshakes", "counter", ("TLS handshakes" + since + ", full or resuming a session").c_str());
+	w.sample("httpmon_tls_handshakes_total", "type=\"full\"", accData.numTlsFull);
+	w.sample("httpmon_tls_handshakes_total", "type=\"resumed\"", accData.numTlsResumed);
+	w.family("httpmon_interval_response_size_bytes", "summary", "Body size of successful replies during the last report interval, before decoding", "bytes");
+	w.summary("httpmon_interval_response_size_bytes", "", data.responseSizes, 1);
+	if (control.decode) {
+		w.family("httpmon_interval_decode_seconds", "summary", "Time spent decoding each encoded reply during the last report interval", "seconds");
+		w.summary("httpmon_interval_decode_seconds", "", data.decodeTimes, NanosToSeconds);
+		w.family("httpmon_interval_compression_ratio", "gauge", "Decoded over encoded bytes of replies decoded during the last report interval");
+		w.sample("httpmon_interval_compression_ratio", "", data.encodedBytes ? (double)data.decodedBytes / data.encodedBytes : 0);
+	}
+	w.family("httpmon_queue_length", "gauge", "Requests in flight");
+	w.sample("httpmon_queue_length", "", data.queueLength);
+	w.family("httpmon_concurrency", "gauge", "Configured number of clients");
+	w.sample("httpmon_concurrency", "", control.concurrency);
+	if (accData.warmUp) {
+		w.family("httpmon_warming_up", "gauge", "1 until the steady state starts, when counters and histograms restart");
+		w.sample("httpmon_warming_up", "", accData.warmUp->active());
+	}
+	if (accData.windows) {
+		/* Per sliding window, labelled with its length */
+		const SlidingWindows &windows = *accData.windows;
+		std::vector<std::string> labels;
+		for (size_t i = 0; i < windows.size(); i++)
+			labels.push_back(strprintf("window=\"%gs\"", windows.length(i)));
+		w.family("httpmon_window_latency_seconds", "summary", "Latency of successful requests during each sliding window", "seconds");
+		for (size_t i = 0; i < windows.size(); i++)
+			w.summary("httpmon_window_latency_seconds", labels[i], windows.statistics(i).latencies, NanosToSeconds);
+		w.family("httpmon_window_requests", "gauge", "Requests answered or failed during each sliding window");
+		for (size_t i = 0; i < windows.size(); i++)
+			w.sample("httpmon_window_requests", labels[i], windows.statistics(i).numRequests);
+		w.family("httpmon_window_errors", "gauge", "Requests failed during each sliding window");
+		for (size_t i = 0; i < windows.size(); i++)
+			w.sample("httpmon_window_errors", labels[i], windows.statistics(i).numErrors);
+		w.family("httpmon_window_throughput", "gauge", "Successful requests per second during each sliding window");
+		for (size_t i = 0; i < windows.size(); i++) {
+			const WindowStatistics &stats = windows.statistics(i);
+			w.sample("httpmon_window_throughput", labels[i], stats.duration > 0 ? stats.latencies.count() / stats.duration : 0);
+		}
+	}
+	w.family("httpmon_self_cpu_ratio", "gauge", "CPU time used by httpmon per second during the last report interval");
+	w.sample("httpmon_self_cpu_ratio", "", dt > 0 ? toSeconds(data.cpuTime) / dt : 0);
+	w.family("httpmon_self_pacer_utilization_ratio", "gauge", "Busy share of the busiest event loop or arrival scheduler during the last report interval");
+	w.sample("httpmon_self_pacer_utilization_ratio", "", data.pacerUtilization);
+	w.family("httpmon_self_report_loop_seconds", "gauge", "Time the last collection, report and publication took", "seconds");
+	w.sample("httpmon_self_report_loop_seconds", "", toSeconds(accData.reportLoopTime));
+	w.family("httpmon_self_saturated", "gauge", "1 if httpmon itself seemed to limit throughput during the last report interval");
+	w.sample("httpmon_self_saturated", "", accData.saturated);
+	if (control.rateMode) {
+		w.family("httpmon_rate", "gauge", "Configured arrival rate in requests per second");
+		w.sample("httpmon_rate", "", control.rate);
+		w.family("httpmon_queued", "counter", ("Arrivals that found no free client" + since).c_str());
+		w.sample("httpmon_queued_total", "", accData.numQueued);
+		w.family("httpmon_dropped", "counter", ("Arrivals dropped because the backlog was full" + since).c_str());
+		w.sample("httpmon_dropped_total", "", accData.numDropped);
+		w.family("httpmon_send_lag_seconds", "histogram", ("Delay between intended arrival and sending" + since).c_str(), "seconds");
+		w.histogram("httpmon_send_lag_seconds", "", accData.sendLags, NanosToSeconds, latencyBounds);
+	}
+	if (!accData.templates.empty()) {
+		/* Per request template, labelled with its name */
+		std::vector<std::string> labels;
+		for (const RequestSpec &spec : control.requestSpecs)
+			labels.push_back("template=\"" + OpenMetricsWriter::escape(spec.name) + "\"");
+		w.family("httpmon_template_requests", "counter", ("Requests answered or failed" + since + ", per template").c_str());
+		for (size_t i = 0; i < accData.templates.size(); i++)
+			w.sample("httpmon_template_requests_total", labels[i], accData.templates[i].numRequests);
+		w.family("httpmon_template_errors", "counter", ("Requests failed" + since + ", per template").c_str());
+		for (size_t i = 0; i < accData.templates.size(); i++)
+			w.sample("httpmon_template_errors_total", labels[i], accData.templates[i].numErrors);
+		w.family("httpmon_template_latency_seconds", "histogram", ("Latency of successful requests" + since + ", per template").c_str(), "seconds");
+		for (size_t i = 0; i < accData.templates.size(); i++)
+			w.histogram("httpmon_template_latency_seconds", labels[i], accData.templates[i].latencies, NanosToSeconds, latencyBounds);
+		w.family("httpmon_template_interval_latency_seconds", "summary", "Latency of successful requests during the last report interval, per template", "seconds");
+		for (size_t i = 0; i < data.templates.size(); i++)
+			w.summary("httpmon_template_interval_latency_seconds", labels[i], data.templates[i].latencies, NanosToSeconds);
+		w.family("httpmon_template_interval_requests", "gauge", "Requests answered or failed during the last report interval, per template");
+		for (size_t i = 0; i < data.templates.size(); i++)
+			w.sample("httpmon_template_interval_requests", labels[i], data.templates[i].numRequests);
+	}
+	snapshot->text = w.finish();
+
+	std::string &out = snapshot->binary;
+	out = "HMS1";
+	appendValue(out, now());
+	appendValue(out, dt);
+	std::string interval;
+	data.serialize(interval);
+	appendValue(out, (uint32_t)interval.size());
+	out += interval;
+	appendValue(out, accData.numRequests);
+	appendValue(out, accData.numErrors);
+	for (size_t i = 0; i < MaxMarkers; i++)
+		appendValue(out, accData.numOptions[i]);
+	appendValue(out, accData.numOpenQueuing);
+	appendValue(out, accData.numQueued);
+	appendValue(out, accData.numDropped);
+	accData.latencies.serialize(out);
+	accData.sendLags.serialize(out);
+	accData.schedLags.serialize(out);
+	appendValue(out, (uint32_t)accData.templates.size());
+	for (const TemplateData &t : accData.templates) {
+		t.latencies.serialize(out);
+		appendValue(out, t.numRequests);
+		appendValue(out, t.numErrors);
+	}
+	for (int i = 0; i < NUM_ERROR_CLASSES; i++)
+		appendValue(out, accData.numErrorClasses[i]);
+	for (int i = 0; i < NumStatusCodes; i++)
+		appendValue(out, accData.numStatuses[i]);
+	appendValue(out, accData.rxBytes);
+	appendValue(out, accData.txBytes);
+	appendValue(out, accData.numTlsFull);
+	appendValue(out, accData.numTlsResumed);
+
+	metrics.publish(snapshot);
+}
+
+/* Let dumped requests reach the disk at least once per report */
+void flushDump(ClientData &data, AccumulatedData &accData)
+{
+	if (!data.dump)
+		return;
+	data.dump->flush();
+	uint64_t numDumpDropped = data.dump->dropped();
+	if (numDumpDropped > accData.numDumpDropped)
+		fprintf(stderr, "[%f] WARNING: dump cannot keep up, %llu requests were not dumped so far\n",
+			now(), (unsigned long long)numDumpDropped);
+	accData.numDumpDropped = numDumpDropped;
+}
+
+/* (Re)build the workload after request parameters changed; clients pick it up with their next request */
+void updateWorkload(ClientControl &control)
+{
+	if (!control.workloadFromFile) {
+		RequestSpec spec;
+		spec.name = "default";
+		spec.weight = 1;
+		spec.url = control.url;
+		spec.headers = control.headers;
+		spec.body = control.body;
+		spec.corpus = control.bodyCorpus;
+		spec.hasBody = control.post || !control.body.empty() || control.bodyCorpus;
+		spec.method = spec.hasBody ? "POST" : "GET";
+		control.requestSpecs.assign(1, spec);
+	}
+
+	std::shared_ptr<const Workload> workload(new Workload(control.requestSpecs, control.compressed, control.decode));
+	std::lock_guard<std::mutex> lock(control.workloadMutex);
+	control.workload = workload;
+	control.workloadGeneration++;
+}
+
+/*
+ * Read what is available on a non-blocking fd and return complete lines;
+ * incomplete ones are kept in input until the next call. Sets eof if the
+ * other end was closed.
+ */
+std::vector<std::string> readLines(int fd, std::string &input, bool &eof)
+{
+	/* Read new input */
+	char buf[1024];
+	ssize_t len;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		input.append(buf, len);
+	eof = (len == 0);
+
+	/* Split line by line */
+	std::vector<std::string> lines;
+	size_t newlineFound;
+	while ((newlineFound = input.find('\n')) != std::string::npos) {
+		lines.push_back(input.substr(0, newlineFound));
+		input.erase(0, newlineFound + 1);
+	}
+	return lines;
+}
+
+/*
+ * Wait until deadline for a signal of signalFd, or for input on fd, unless
+ * it is negative, so that changes take effect as soon as they are written.
+ * Returns the signal number, or 0 if none arrived.
+ */
+int waitForSignalOrInput(int signalFd, int fd, Nanos deadline)
+{
+	struct pollfd fds[2] = { { signalFd, POLLIN, 0 }, { fd, POLLIN, 0 } };
+	struct timespec timeout = toTimespec(std::max<Nanos>(0, deadline - monotonicNow()));
+	ppoll(fds, (fd >= 0) ? 2 : 1, &timeout, NULL);
+	struct signalfd_siginfo info;
+	if (read(signalFd, &info, sizeof(info)) == sizeof(info))
+		return info.ssi_signo;
+	return 0;
+}
+
+/* Apply a line of key=value changes, e.g., read from standard input */
+void processCommand(const std::string &line, ClientControl &control)
+{
+	/* Tokenize input */
+	using namespace boost::algorithm;
+	std::vector<std::string> tokens;
+	split(tokens, line, is_any_of(" \n"), token_compress_on);
+
+	/* Parse key values */
+	for (auto it = tokens.begin(); it != tokens.end(); it++) {
+		std::vector<std::string> keyvalue;
+		split(keyvalue, *it, is_any_of("="), token_compress_on);
+		if (keyvalue.size() != 2) {
+			fprintf(stderr, "[%f] cannot parse key-value '%s'\n", now(), it->c_str());
+			continue; /* next input token */
+		}
+		std::string key = keyvalue[0];
+		std::string value = keyvalue[1];
+		
+		if (key == "url") {
+			if (control.workloadFromFile) {
+				fprintf(stderr, "[%f] cannot change url of a workload file\n", now());
+				continue;
+			}
+			control.url = value;
+			updateWorkload(control);
+			printf("time=%.6f url=%s\n", now(), control.url.c_str());
+		}
+		else if (key == "thinktime") {
+			control.thinkTime = atof(value.c_str());
+			printf("time=%.6f thinktime=%f\n", now(), control.thinkTime);
+		}
+		else if (key == "concurrency") {
+			control.concurrency = workerShare(atoi(value.c_str()), control);
+			printf("time=%.6f concurrency=%d\n", now(), control.concurrency);
+		}
+		else if (key == "open") {
+			control.open = atoi(value.c_str());
+			printf("time=%.6f open=%d\n", now(), control.open);
+		}
+		else if (key == "compressed") {
+			control.compressed = atoi(value.c_str());
+			updateWorkload(control);
+			printf("time=%.6f compressed=%d\n", now(), control.compressed);
+		}
+		else if (key == "count") {
+			int numRequestsLeft = workerShare(atoi(value.c_str()), control); /* avoid race */
+			control.numRequestsLeft = numRequestsLeft;
+			printf("time=%.6f count=%d\n", now(), numRequestsLeft);
+		}
+		else if (key == "rate") {
+			control.rate = atof(value.c_str());
+			printf("time=%.6f rate=%f\n", now(), control.rate);
+		}
+		else if (key == "timeout") {
+			control.timeout = atof(value.c_str());
+			printf("time=%.6f timeout=%f\n", now(), control.timeout);
+		}
+		else
+			fprintf(stderr, "[%f] unknown key '%s'\n", now(), key.c_str());
+	}
+}
+
+/*
+ * Set the target of the profile phase active at time t, logging phase
+ * transitions; returns false once the profile is over.
+ */
+bool applyProfile(ClientControl &control, const std::vector<ProfilePhase> &profile,
+	Nanos startTime, Nanos t, int &currentPhase)
+{
+	double elapsed = toSeconds(t - startTime);
+	int index = profilePhaseAt(profile, elapsed);
+	if (index != currentPhase) {
+		currentPhase = index;
+		if (index >= 0) {
+			const ProfilePhase &phase = profile[index];
+			printf("time=%.6f phase=%d duration=%g shape=%s %s\n", now(), index + 1,
+				phase.duration, ProfileShapeNames[phase.shape], phase.text.c_str());
+		}
+	}
+	if (index < 0)
+		return false;
+
+	const ProfilePhase &phase = profile[index];
+	double value = profileValue(phase, elapsed - phase.start);
+	if (phase.target == "rate")
+		control.rate = value;
+	else
+		control.concurrency = workerShare(std::lround(value), control);
+	return true;
+}
+
+/*
+ * Feed the statistics of a report interval to the capacity search, logging
+ * its measurements; returns false once the search is over. If the rate
+ * should change, sets command to the corresponding key=value change.
+ */
+bool advanceCapacitySearch(CapacitySearch &search, const IntervalData &data, std::string &command)
+{
+	std::string log;
+	bool done;
+	command.clear();
+	/* Dropped arrivals count as failed requests */
+	if (search.addInterval(data.latencies, data.numRequests + data.numDropped,
+		data.numErrors + data.numDropped, data.queueLength, log, done))
+		command = strprintf("rate=%f", search.rate());
+	if (!log.empty())
+		printf("time=%.6f %s\n", now(), log.c_str());
+	if (done)
+		printf("time=%.6f %s\n", now(), search.summary().c_str());
+	return !done;
+}
+
+/*
+ * Coordinator: forward changes read from standard input to workers and, at
+ * regular intervals, report statistics merged over all workers. Workers
+ * follow the profile themselves; the coordinator only logs its phases. The
+ * capacity search, if any, runs on the merged statistics, which are also
+ * exposed by the metrics server, if any.
+ */
+int coordinate(ClientControl &control, const std::vector<int> &workerFds, double interval,
+	const std::vector<ProfilePhase> &profile, CapacitySearch *search, MetricsServer *metrics,
+	IntervalData &data, AccumulatedData &accData)
+{
+	/* Block SIGINT, SIGQUIT and SIGTERM */
+	sigset_t sigset;
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGINT);
+	sigaddset(&sigset, SIGQUIT);
+	sigaddset(&sigset, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigset, NULL);
+	int signalFd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
 
-			/* Add data to report */
-			/* XXX: one day, this might be a bottleneck */
-			{
-				std::lock_guard<std::mutex> lock(data.mutex);
+	/* Make stdin non-blocking */
+	int flags = fcntl(0, F_GETFL);
+	flags |= O_NONBLOCK;
+	fcntl(0, F_SETFL, flags);
+	bool stdinOpen = true;
 
-				data.queueLength--;
-				data.requests.push_back(requestData);
+	std::vector<bool> finished(workerFds.size(), false);
+	size_t numFinished = 0;
 
-				data.numRequests++;
-				if (requestData.error) {
-					data.numErrors++;
+	/* Ask workers for their data, optionally waiting for all to finish, and merge it */
+	auto collectFromWorkers = [&](const char *request, bool untilFinished) {
+		data.reset();
+		for (size_t i = 0; i < workerFds.size(); i++) {
+			if (!finished[i])
+				sendLine(workerFds[i], request);
+		}
+		for (size_t i = 0; i < workerFds.size(); i++) {
+			while (!finished[i]) {
+				WorkerMessageKind kind;
+				std::string payload;
+				if (!receiveMessage(workerFds[i], kind, payload)) {
+					fprintf(stderr, "[%f] WARNING: lost worker %zu\n", now(), i);
+					kind = WORKER_FINAL;
+				}
+				else if (!data.addSerialized(payload)) {
+					fprintf(stderr, "[%f] WARNING: cannot parse statistics of worker %zu\n", now(), i);
 				}
-				else {
-					data.latencies.push_back(requestData.repliedAt - requestData.generatedAt);
-					if (requestData.option1)
-						data.numOption1 ++;
-					if (requestData.option2)
-						data.numOption2 ++;
-					if (didOpenQueuing)
-						data.numOpenQueuing++;
+				if (kind == WORKER_FINAL) {
+					finished[i] = true;
+					numFinished++;
 				}
+				if (!untilFinished)
+					break;
 			}
 		}
-	}
+	};
 
-	curl_easy_cleanup(curl);
+	/* Report at regular intervals */
+	int signo = 0;
+	bool running = true;
+	accData.reportTime = monotonicNow();
+	Nanos nextReportTime = accData.reportTime + toNanos(interval);
+	Nanos profileStartTime = accData.reportTime;
+	int profilePhase = -1;
+	std::string input;
+	while (running) {
+		if (!profile.empty())
+			applyProfile(control, profile, profileStartTime, monotonicNow(), profilePhase);
+		Nanos wakeUpAt = nextReportTime;
+		if (!profile.empty())
+			wakeUpAt = std::min(wakeUpAt, monotonicNow() + ControlPeriod);
+		signo = waitForSignalOrInput(signalFd, stdinOpen ? 0 : -1, wakeUpAt);
+		if (signo > 0)
+			running = false;
+
+		/* Apply changes here and forward them to workers */
+		auto command = [&](const std::string &line) {
+			processCommand(line, control);
+			for (size_t i = 0; i < workerFds.size(); i++) {
+				if (!finished[i])
+					sendLine(workerFds[i], line);
+			}
+		};
+		bool eof;
+		for (const std::string &line : readLines(0, input, eof))
+			command(line);
+		stdinOpen = !eof;
+
+		if (monotonicNow() < nextReportTime && running)
+			continue;
+		nextReportTime += toNanos(interval);
+		if (nextReportTime <= monotonicNow())
+			nextReportTime = monotonicNow() + toNanos(interval); /* do not catch up after falling behind */
+		Nanos reportLoopStart = monotonicNow();
+		collectFromWorkers("snapshot", false);
+		report(control, data, accData);
+		if (metrics)
+			publishMetrics(*metrics, control, data, accData);
+
+		std::string rateCommand;
+		if (search && running && !advanceCapacitySearch(*search, data, rateCommand)) {
+			running = false;
+			signo = -4;
+		}
+		if (!rateCommand.empty())
+			command(rateCommand);
+		accData.reportLoopTime = monotonicNow() - reportLoopStart;
+
+		if (numFinished == workerFds.size()) {
+			running = false;
+			signo = -1;
+		}
+	}
+	if (signo == -1)
+		fprintf(stderr, "All workers finished, cleaning up ...\n");
+	else if (signo == -4)
+		fprintf(stderr, "Capacity search completed, cleaning up ...\n");
+	else
+		fprintf(stderr, "Got signal %d, cleaning up ...\n", signo);
 
+	/* Final stats */
+	control.running = false;
+	collectFromWorkers("stop", true);
+	report(control, data, accData);
+	if (metrics)
+		publishMetrics(*metrics, control, data, accData);
+
+	for (int fd : workerFds)
+		close(fd);
+	close(signalFd);
+	while (wait(NULL) > 0)
+		; /* reap local workers */
 	return 0;
 }
 
-void report(ClientData &_data, AccumulatedData &accData)
+int httpmonMain(int argc, char **argv, int coordinatorFd, int workerIndex, int numWorkers);
+
+/* Remote worker: wait for a coordinator, then run with the command-line it sends */
+int serveCoordinator(int port)
 {
-	/* Atomically retrieve relevant data */
-	ClientData data;
-	{
-		std::lock_guard<std::mutex> lock(_data.mutex);
-		data.latencies = std::move(_data.latencies);
-		data.requests = std::move(_data.requests);
-		data.numRequests = _data.numRequests;
-		data.numOption1 = _data.numOption1;
-		data.numOption2 = _data.numOption2;
-		data.numOpenQueuing = _data.numOpenQueuing;
-		data.numErrors = _data.numErrors;
-		data.queueLength = _data.queueLength;
-
-		_data.latencies.clear();
-		_data.requests.clear();
-		_data.numRequests = 0;
-		_data.numOption1 = 0;
-		_data.numOption2 = 0;
-		_data.numOpenQueuing = 0;
-		_data.numErrors = 0;
-		/* _data.queueLength must not be reset */
+	std::string error;
+	fprintf(stderr, "Waiting for a coordinator on port %d ...\n", port);
+	int fd = acceptTcp(port, error);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot accept coordinator on port %d: %s\n", port, error.c_str());
+		return 1;
 	}
-	
-	/* Compute how much time passed */
-	double reportTime = now(); /* for atomicity */
-	double dt = reportTime - accData.reportTime;
-	accData.reportTime = reportTime;
-
-	/* Compute statistics since last reporting */
-	double throughput = (double)data.latencies.size() / dt;
-	double recommendationRate = (double)data.numOption1 / data.latencies.size();
-	double commentRate = (double)data.numOption2 / data.latencies.size();
-	int queueLength = data.queueLength;
-	auto stats = computeStatistics(data.latencies);
-
-	/* Compute accumulated statistics */
-	accData.numRequests += data.numRequests;
-	accData.numOption1 += data.numOption1;
-	accData.numOption2 += data.numOption2;
-	accData.numOpenQueuing += data.numOpenQueuing;
-	accData.numErrors += data.numErrors;
-	accData.latencies.insert(accData.latencies.end(), data.latencies.begin(), data.latencies.end());
-	accData.requests.insert(accData.requests.end(), data.requests.begin(), data.requests.end());
-	auto accStats = computeStatistics(accData.latencies);
 
-	printf("time=%.6f latency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms latency95=%.0fms latency99=%.0fms requests=%d option1=%d option2=%d errors=%d throughput=%.0frps ql=%d rr=%.2f%% cr=%.2f%% accRequests=%d accOption1=%d accOption2=%d accLatency=%.0f:%.0f:%.0f:%.0f:%.0f:(%.0f)ms accLatency95=%.0fms accLatency99=%.0fms accOpenQueuing=%d accErrors=%d\n",
-		reportTime,
-		stats.minimum * 1000,
-		stats.lowerQuartile * 1000,
-		stats.median * 1000,
-		stats.upperQuartile * 1000,
-		stats.maximum * 1000,
-		stats.average * 1000,
-		stats.percentile95 * 1000,
-		stats.percentile99 * 1000,
-		data.numRequests,
-		data.numOption1,
-		data.numOption2,
-		data.numErrors,
-		throughput,
-		queueLength,
-		recommendationRate * 100,
-		commentRate * 100,
-		/* Accumulated statistics */
-		accData.numRequests,
-		accData.numOption1,
-		accData.numOption2,
-		accStats.minimum * 1000,
-		accStats.lowerQuartile * 1000,
-		accStats.median * 1000,
-		accStats.upperQuartile * 1000,
-		accStats.maximum * 1000,
-		accStats.average * 1000,
-		accStats.percentile95 * 1000,
-		accStats.percentile99 * 1000,
-		accData.numOpenQueuing,
-		accData.numErrors
-	);
+	int index, count;
+	std::vector<std::string> args;
+	if (!receiveHandshake(fd, index, count, args)) {
+		fprintf(stderr, "Invalid handshake from coordinator\n");
+		close(fd);
+		return 1;
+	}
+	fprintf(stderr, "Running as worker %d of %d\n", index, count);
+
+	std::vector<char *> argv;
+	argv.push_back((char *)"httpmon");
+	for (std::string &arg : args)
+		argv.push_back(&arg[0]);
+	argv.push_back(NULL);
+	return httpmonMain(argv.size() - 1, argv.data(), fd, index, count);
 }
 
-void processInput(std::string &input, ClientControl &control)
+int main(int argc, char **argv)
 {
-	/* Store last size */
-	size_t prevInputSize = input.size();
-
-	/* Read new input */
-	char buf[1024];
-	ssize_t len;
-	while ((len = read(0, buf, sizeof(buf))) > 0)
-		input.append(buf, len);
-	if (input.size() == prevInputSize) /* no new data */
-		return;
-
-	/* Parse line by line */
-	for (;;) {
-		size_t newlineFound = input.find_first_of('\n', prevInputSize);
-		if (newlineFound == std::string::npos) {
-			/* newline not found */
-			return;
-		}
-		std::string line = input.substr(0, newlineFound);
-		input.erase(0, newlineFound + 1);
-
-		/* Tokenize input */
-		using namespace boost::algorithm;
-		std::vector<std::string> tokens;
-		split(tokens, line, is_any_of(" \n"), token_compress_on);
-
-		/* Parse key values */
-		for (auto it = tokens.begin(); it != tokens.end(); it++) {
-			std::vector<std::string> keyvalue;
-			split(keyvalue, *it, is_any_of("="), token_compress_on);
-			if (keyvalue.size() != 2) {
-				fprintf(stderr, "[%f] cannot parse key-value '%s'\n", now(), it->c_str());
-				continue; /* next input token */
-			}
-			std::string key = keyvalue[0];
-			std::string value = keyvalue[1];
-			
-			if (key == "url") {
-				control.url = value;
-				printf("time=%.6f url=%s\n", now(), control.url.c_str());
-			}
-			else if (key == "thinktime") {
-				control.thinkTime = atof(value.c_str());
-				printf("time=%.6f thinktime=%f\n", now(), control.thinkTime);
-			}
-			else if (key == "concurrency") {
-				control.concurrency = atoi(value.c_str());
-				printf("time=%.6f concurrency=%d\n", now(), control.concurrency);
-			}
-			else if (key == "open") {
-				control.open = atoi(value.c_str());
-				printf("time=%.6f open=%d\n", now(), control.open);
-			}
-			else if (key == "compressed") {
-				control.compressed = atoi(value.c_str());
-				printf("time=%.6f compressed=%d\n", now(), control.compressed);
-			}
-			else if (key == "count") {
-				int numRequestsLeft = atoi(value.c_str()); /* avoid race */
-				control.numRequestsLeft = numRequestsLeft;
-				printf("time=%.6f count=%d\n", now(), numRequestsLeft);
-			}
-			else if (key == "timeout") {
-				control.timeout = atof(value.c_str());
-				printf("time=%.6f timeout=%f\n", now(), control.timeout);
-			}
-			else
-				fprintf(stderr, "[%f] unknown key '%s'\n", now(), key.c_str());
-		}
-	}
+	return httpmonMain(argc, argv, -1, 0, 1);
 }
 
-int main(int argc, char **argv)
+/*
+ * Run httpmon, either standalone (coordinatorFd < 0), or as one of
+ * numWorkers workers of a coordinator connected to coordinatorFd.
+ */
+int httpmonMain(int argc, char **argv, int coordinatorFd, int workerIndex, int numWorkers)
 {
 	namespace po = boost::program_options;
 
@@ -502,13 +3173,54 @@ int main(int argc, char **argv)
 	double interval;
 	bool open;
 	bool compressed;
+	bool decode;
 	bool deterministic;
 	bool dump;
+	bool recordPhases;
+	std::string markers;
+	std::string httpVersion;
+	int streamsPerConnection;
+	std::string connectionReuse;
+	std::string dumpFormat;
+	std::string dumpFile;
+	double dumpRotate;
 	int numRequestsLeft;
 	bool terminateAfterCount;
 	bool post;
 	std::string body;
 	std::vector<std::string> headers;
+	std::string workloadFile;
+	std::string engine;
+	int eventLoops;
+	int histogramDigits;
+	int statsShards;
+	double rate;
+	std::string arrivals;
+	long maxBacklog;
+	std::string traceFile;
+	std::string profileFile;
+	std::string capacitySlo;
+	double searchSettle;
+	double searchMeasure;
+	double searchPrecision;
+	double traceSpeed;
+	double traceRate;
+	double spinUs;
+	int numLocalWorkers;
+	std::string remoteWorkers;
+	int workerListenPort;
+	std::string metricsListen;
+	int poolSize;
+	std::string cpuSet;
+	std::string windowList;
+	std::string warmUpSpec;
+	double warmUpTolerance;
+	int warmUpIntervals;
+	std::string shareList;
+	std::vector<std::string> resolveEntries;
+	std::string bodyCorpus;
+	std::string bodyOrderName;
+	uint64_t bodySeed;
 
 	/* Make stdout unbuffered */
 	setvbuf(stdout, NULL, _IONBF, 0);
@@ -521,18 +3233,60 @@ int main(int argc, char **argv)
 		("help", "produce help message")
 		("post", "set POST as HTTP method of the request")
 		("body", po::value<std::string>(&body), "set the body of POST requests")
+		("body-corpus", po::value<std::string>(&bodyCorpus), "send POST requests with bodies from this file, one per line, or directory, one per file, mapped into memory; bodies may contain {{seq}}, {{rand}} and {{client}}, see README")
+		("body-order", po::value<std::string>(&bodyOrderName)->default_value("round-robin"), "pick bodies from corpora in 'round-robin', 'random' or 'seeded' order; the latter is pseudo-random, but the same for each run with the same --body-seed")
+		("body-seed", po::value<uint64_t>(&bodySeed)->default_value(1), "set seed of the 'seeded' body order")
 		("headers", po::value<std::vector<std::string>>(&headers), "set the optional header for requests")
 		("url", po::value<std::string>(&url), "set URL to request")
+		("workload", po::value<std::string>(&workloadFile), "request a weighted mix of request templates defined in this file, instead of --url; see README")
 		("concurrency", po::value<int>(&concurrency)->default_value(100), "set concurrency (number of HTTP client threads)")
 		("timeout", po::value<double>(&timeout)->default_value(INFINITY), "set HTTP client timeout in seconds (default: infinity)")
 		("thinktime", po::value<double>(&thinkTime)->default_value(0), "add a random (à la Poisson) interval between requests in seconds")
 		("interval", po::value<double>(&interval)->default_value(1), "set report interval in seconds")
+		("warmup", po::value<std::string>(&warmUpSpec)->default_value("none"), "exclude the warm-up from accumulated statistics, which restart once it ends, after a duration, e.g., '30s', a number of requests, e.g., '5000req', or 'auto', once throughput and median latency settled; its statistics are summarized on a line of their own")
+		("warmup-tolerance", po::value<double>(&warmUpTolerance)->default_value(10), "with --warmup auto, consider throughput and median latency settled if their average over the last --warmup-intervals changed by at most this many percent")
+		("warmup-intervals", po::value<int>(&warmUpIntervals)->default_value(5), "with --warmup auto, average throughput and median latency over this many report intervals, comparing them to as many intervals before")
+		("windows", po::value<std::string>(&windowList), "also report statistics over sliding windows of these lengths in seconds, e.g., '10,60', rounded to whole report intervals")
+		("rate", po::value<double>(&rate), "generate arrivals centrally at this rate in requests per second, independently of concurrency, which only limits requests in flight; latency is measured from the intended arrival time")
+		("arrivals", po::value<std::string>(&arrivals)->default_value("poisson"), "set distribution of inter-arrival times with --rate: 'poisson', 'constant' or 'uniform'")
+		("max-backlog", po::value<long>(&maxBacklog)->default_value(-1), "with --rate, drop arrivals if this many already wait for a free client (default: never drop)")
+		("trace", po::value<std::string>(&traceFile), "replay the requests of this trace, at the times it gives, relative to --url; implies rate mode, see README")
+		("profile", po::value<std::string>(&profileFile), "vary rate or concurrency over time in steps, linear ramps, sine waves or spikes, as described in this file; exit at its end, see README")
+		("capacity-search", po::value<std::string>(&capacitySlo), "search the highest rate that meets this SLO, e.g., 'p99<200ms,errors<0.1%', starting at --rate (default: 10); exit once found, see README")
+		("search-settle", po::value<double>(&searchSettle)->default_value(2), "with --capacity-search, let each rate settle for this many seconds before measuring")
+		("search-measure", po::value<double>(&searchMeasure)->default_value(5), "with --capacity-search, measure each rate for this many seconds")
+		("search-precision", po::value<double>(&searchPrecision)->default_value(5), "with --capacity-search, stop once the highest rate meeting the SLO is known within this many percent")
+		("trace-speed", po::value<double>(&traceSpeed)->default_value(1), "with --trace, replay this many times faster than recorded")
+		("trace-rate", po::value<double>(&traceRate)->default_value(0), "with --trace, ignore trace times and replay at this fixed rate in requests per second")
+		("spin-us", po::value<double>(&spinUs)->default_value(0), "busy-wait for this many microseconds before each scheduled request, instead of sleeping, for more precise pacing at the expense of CPU (default: 0)")
 		("open", "use the open model with client-side queuing, i.e., arrival times do not depend on the response time of the server")
 		("compressed", "request the server to GZip compress the response")
+		("decode", "request gzip, deflate or Brotli compressed responses and decode them, reporting the compression ratio and decoding time")
 		("count", po::value<int>(&numRequestsLeft)->default_value(std::numeric_limits<int>::max()), "stop after sending this many requests (default: do not stop)")
 		("terminate-after-count", "terminate httpmon after sending count requests (default: do not terminate)")
 		("deterministic", "do not seed RNG; useful to compare two systems with the exact same requests (default: no)")
-		("dump", "dump all data about requests to httpmon-dump.csv")
+		("http", po::value<std::string>(&httpVersion)->default_value("1.1"), "set HTTP version: '1.1', '2' (HTTP/2 over TLS, negotiated with ALPN; HTTP/1.1 for http:// URLs) or 'h2c' (HTTP/2 without TLS, with prior knowledge)")
+		("streams-per-connection", po::value<int>(&streamsPerConnection)->default_value(1), "with HTTP/2 and the event engine, multiplex up to this many concurrent requests on one connection (default: one request per connection)")
+		("share", po::value<std::string>(&shareList)->default_value("none"), "let clients share caches, as a list of 'dns' (resolved host names), 'tls' (TLS sessions, to resume them) and 'connect' (connections, only with --engine event), or 'none'; clients are split into shards, one per core or event loop, that share caches")
+		("resolve", po::value<std::vector<std::string>>(&resolveEntries)->composing(), "resolve host names to addresses without DNS, as HOST:PORT:ADDRESS[,ADDRESS]...; may be repeated")
+		("connection-reuse", po::value<std::string>(&connectionReuse)->default_value("keep-alive"), "set connection policy: 'keep-alive' (reuse connections), 'never' (new connection for each request) or a number N (close connections after N requests)")
+		("markers", po::value<std::string>(&markers)->default_value("\\x80,\\x81"), "set comma-separated bytes or byte strings, at most 8, to look for in replies, reported as option1, option2, etc.; \\xHH stands for a byte in hexadecimal, \\, for a comma; '' disables scanning replies")
+		("phases", "report how long requests spent queuing on the client and in each phase: name lookup, connect, TLS handshake, time to first byte and transfer")
+		("dump", "dump all data about requests to httpmon-dump.csv, while running")
+		("dump-format", po::value<std::string>(&dumpFormat)->default_value("csv"), "set dump format: 'csv' or 'binary' (compact, default file httpmon-dump.bin, convert with httpmon-dump2csv)")
+		("dump-file", po::value<std::string>(&dumpFile), "set dump file name (default: depends on --dump-format)")
+		("dump-rotate", po::value<double>(&dumpRotate)->default_value(0), "start a new dump file, suffixed .1, .2, etc., when the current one exceeds this many MiB (default: never)")
+		("engine", po::value<std::string>(&engine)->default_value("threads"), "set client engine: 'threads' (one OS thread per client) or 'event' (few threads driving many clients using curl_multi and epoll)")
+		("histogram-digits", po::value<int>(&histogramDigits)->default_value(2), "set the number of significant decimal digits kept by latency histograms (1 to 5; more digits use more memory)")
+		("stats-shards", po::value<int>(&statsShards)->default_value(std::max(1u, std::thread::hardware_concurrency())), "set number of shards client threads record statistics into (default: one per core; the event engine uses one per event loop); each shard takes about 1MB with the default --histogram-digits, more with --phases or workload templates, and is drained at each report")
+		("pool-size", po::value<int>(&poolSize)->default_value(0), "keep this many clients ready, parking those beyond the concurrency, so that it can grow without creating clients (default: the initial concurrency; the pool grows with the concurrency)")
+		("prewarm", "let each client of the pool open its connection with a request that is not accounted, before it starts or parks")
+		("cpus", po::value<std::string>(&cpuSet), "run on these CPUs, e.g., '0-3,8', or on those of NUMA nodes, e.g., 'node:0'; event loops are pinned to one CPU each, local workers split the CPUs")
+		("event-loops", po::value<int>(&eventLoops)->default_value(std::max(1u, std::thread::hardware_concurrency())), "set number of event-loop threads for the event engine (default: one per core)")
+		("workers", po::value<int>(&numLocalWorkers)->default_value(0), "coordinate this many local worker processes, which split concurrency, rate, count and traces among them; report merged statistics")
+		("remote-workers", po::value<std::string>(&remoteWorkers), "also coordinate remote workers, given as a comma-separated list of host:port, each started with --worker-listen")
+		("worker-listen", po::value<int>(&workerListenPort), "act as a remote worker: wait for a coordinator on this TCP port, then run with its command-line")
+		("metrics-listen", po::value<std::string>(&metricsListen), "serve live statistics in OpenMetrics format at /metrics, and as binary snapshots at /snapshot, over HTTP on this PORT (of 127.0.0.1), HOST:PORT or unix:PATH; see README")
 	;
 
 	po::variables_map vm;
@@ -543,18 +3297,210 @@ int main(int argc, char **argv)
 		std::cerr << desc << "\n";
 		return 1;
 	}
+
+	if (vm.count("worker-listen")) {
+		if (coordinatorFd >= 0 || numLocalWorkers > 0 || !remoteWorkers.empty()) {
+			std::cerr << "--worker-listen cannot be combined with --workers or --remote-workers" << std::endl;
+			return 1;
+		}
+		return serveCoordinator(workerListenPort);
+	}
 	
-	if (url.empty()) {
+	if (url.empty() && workloadFile.empty()) {
 		std::cerr << "Warning, empty URL given. Expect high CPU usage and many errors." << std::endl;
 	}
 
 	open = vm.count("open");
 	compressed = vm.count("compressed");
+	decode = vm.count("decode");
 	deterministic = vm.count("deterministic");
 	dump = vm.count("dump");
+	recordPhases = vm.count("phases");
 	terminateAfterCount = vm.count("terminate-after-count");
 	post = vm.count("post");
 
+	if (engine != "threads" && engine != "event") {
+		std::cerr << "Unknown engine '" << engine << "'" << std::endl;
+		return 1;
+	}
+	bool eventDriven = (engine == "event");
+	if (eventLoops < 1) {
+		std::cerr << "Need at least one event loop" << std::endl;
+		return 1;
+	}
+	long curlHttpVersion;
+	if (httpVersion == "1.1")
+		curlHttpVersion = CURL_HTTP_VERSION_1_1;
+	else if (httpVersion == "2")
+		curlHttpVersion = CURL_HTTP_VERSION_2TLS;
+	else if (httpVersion == "h2c")
+		curlHttpVersion = CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+	else {
+		std::cerr << "Unknown HTTP version '" << httpVersion << "'" << std::endl;
+		return 1;
+	}
+	if (streamsPerConnection < 1) {
+		std::cerr << "Need at least one stream per connection" << std::endl;
+		return 1;
+	}
+	if (streamsPerConnection > 1 && (!eventDriven || httpVersion == "1.1")) {
+		std::cerr << "Multiplexing streams requires --engine event and --http 2 or h2c" << std::endl;
+		return 1;
+	}
+	int requestsPerConnection;
+	if (connectionReuse == "keep-alive")
+		requestsPerConnection = 0;
+	else if (connectionReuse == "never")
+		requestsPerConnection = 1;
+	else if ((requestsPerConnection = atoi(connectionReuse.c_str())) < 1) {
+		std::cerr << "Unknown connection policy '" << connectionReuse << "'" << std::endl;
+		return 1;
+	}
+	if (requestsPerConnection > 0 && streamsPerConnection > 1) {
+		std::cerr << "Closing connections cannot be combined with multiplexing streams" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<BodyClassifier> classifier;
+	try {
+		classifier.reset(new BodyClassifier(BodyClassifier::parse(markers)));
+	}
+	catch (const std::invalid_argument &e) {
+		std::cerr << "Invalid markers: " << e.what() << std::endl;
+		return 1;
+	}
+	ArrivalDistribution arrivalDistribution;
+	if (arrivals == "poisson")
+		arrivalDistribution = ARRIVALS_POISSON;
+	else if (arrivals == "constant")
+		arrivalDistribution = ARRIVALS_CONSTANT;
+	else if (arrivals == "uniform")
+		arrivalDistribution = ARRIVALS_UNIFORM;
+	else {
+		std::cerr << "Unknown arrival distribution '" << arrivals << "'" << std::endl;
+		return 1;
+	}
+	if (dumpFormat != "csv" && dumpFormat != "binary") {
+		std::cerr << "Unknown dump format '" << dumpFormat << "'" << std::endl;
+		return 1;
+	}
+	std::vector<int> cpus;
+	if (!cpuSet.empty()) {
+		try {
+			cpus = parseCpuSet(cpuSet);
+		}
+		catch (const std::invalid_argument &e) {
+			std::cerr << "Invalid CPU set: " << e.what() << std::endl;
+			return 1;
+		}
+	}
+	if (statsShards < 1) {
+		std::cerr << "Need at least one statistics shard" << std::endl;
+		return 1;
+	}
+	int shareFlags;
+	try {
+		shareFlags = parseShareFlags(shareList);
+	}
+	catch (const std::invalid_argument &e) {
+		std::cerr << "Invalid --share: " << e.what() << std::endl;
+		return 1;
+	}
+	if ((shareFlags & SHARE_CONNECTIONS) && !eventDriven) {
+		/* libcurl does not support using a connection cache from several threads at once */
+		std::cerr << "--share connect needs --engine event, whose clients share connections within one event loop" << std::endl;
+		return 1;
+	}
+	for (const std::string &entry : resolveEntries) {
+		if (!isResolveEntry(entry)) {
+			std::cerr << "Invalid --resolve '" << entry << "', expected HOST:PORT:ADDRESS" << std::endl;
+			return 1;
+		}
+	}
+	if (!traceFile.empty() && (vm.count("rate") || !workloadFile.empty())) {
+		std::cerr << "--trace cannot be combined with --rate or --workload" << std::endl;
+		return 1;
+	}
+	if (traceSpeed <= 0) {
+		std::cerr << "Trace speed must be positive" << std::endl;
+		return 1;
+	}
+	std::vector<std::string> remoteWorkerAddresses;
+	if (!remoteWorkers.empty())
+		boost::algorithm::split(remoteWorkerAddresses, remoteWorkers, boost::algorithm::is_any_of(","));
+	if (numLocalWorkers < 0) {
+		std::cerr << "Number of workers cannot be negative" << std::endl;
+		return 1;
+	}
+	std::unique_ptr<TraceFile> trace;
+	if (!traceFile.empty()) {
+		trace.reset(new TraceFile(traceFile));
+		if (!trace->ok()) {
+			std::cerr << "Cannot replay trace " << traceFile << ": " << trace->error << std::endl;
+			return 1;
+		}
+	}
+	std::vector<ProfilePhase> profile;
+	if (!profileFile.empty()) {
+		try {
+			profile = readProfileFile(profileFile);
+		}
+		catch (const std::exception &e) {
+			std::cerr << "Error in profile: " << e.what() << std::endl;
+			return 1;
+		}
+		if (trace && profileSets(profile, "rate")) {
+			std::cerr << "--trace cannot be combined with a profile setting the rate" << std::endl;
+			return 1;
+		}
+	}
+	std::vector<double> windows;
+	if (!windowList.empty()) {
+		try {
+			windows = parseWindows(windowList);
+		}
+		catch (const std::invalid_argument &e) {
+			std::cerr << "Invalid --windows: " << e.what() << std::endl;
+			return 1;
+		}
+	}
+	WarmUpPolicy warmUpPolicy;
+	try {
+		warmUpPolicy = parseWarmUpPolicy(warmUpSpec);
+	}
+	catch (const std::invalid_argument &e) {
+		std::cerr << "Invalid --warmup: " << e.what() << std::endl;
+		return 1;
+	}
+	if (!(warmUpTolerance >= 0) || warmUpIntervals < 1) {
+		std::cerr << "--warmup-tolerance must not be negative and --warmup-intervals must be positive" << std::endl;
+		return 1;
+	}
+	warmUpPolicy.tolerance = warmUpTolerance / 100;
+	warmUpPolicy.numIntervals = warmUpIntervals;
+	std::unique_ptr<CapacitySearch> search;
+	if (!capacitySlo.empty()) {
+		Slo slo;
+		try {
+			slo = parseSlo(capacitySlo);
+		}
+		catch (const std::invalid_argument &e) {
+			std::cerr << "Invalid SLO: " << e.what() << std::endl;
+			return 1;
+		}
+		if (trace || profileSets(profile, "rate")) {
+			std::cerr << "--capacity-search cannot be combined with --trace or a profile setting the rate" << std::endl;
+			return 1;
+		}
+		if (searchSettle < 0 || searchMeasure <= 0 || searchPrecision <= 0 || (vm.count("rate") && rate <= 0)) {
+			std::cerr << "Capacity search needs a positive start rate, measurement time and precision" << std::endl;
+			return 1;
+		}
+		/* Settle and measure whole report intervals */
+		search.reset(new CapacitySearch(slo, vm.count("rate") ? rate : 10, searchPrecision / 100,
+			std::ceil(searchSettle / interval - 1e-9), std::max(1.0, std::ceil(searchMeasure / interval - 1e-9)),
+			histogramDigits));
+	}
+
 	/*
 	 * Start HTTP client threads
 	 */
@@ -575,38 +3521,264 @@ int main(int argc, char **argv)
 	control.numRequestsLeft = numRequestsLeft;
 	control.url = url;
 	control.concurrency = concurrency;
+	control.poolSize = std::max(poolSize, concurrency);
+	control.prewarm = vm.count("prewarm");
 	control.thinkTime = thinkTime;
 	control.timeout = timeout;
 	control.open = open;
 	control.compressed = compressed;
+	control.decode = decode;
 	control.deterministic = deterministic;
 	control.post = post;
+	control.spinTime = toNanos(std::max(0.0, spinUs) / MicroSecondsInASecond);
 	control.headers = headers;
 	control.body = body;
+	control.classifier = classifier.get();
+	BodyOrder bodyOrder;
+	try {
+		bodyOrder = parseBodyOrder(bodyOrderName);
+		if (!bodyCorpus.empty())
+			control.bodyCorpus.reset(new BodyCorpus(bodyCorpus, bodyOrder, bodySeed));
+	}
+	catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	control.httpVersion = curlHttpVersion;
+	control.streamsPerConnection = streamsPerConnection;
+	control.connectionReuse = requestsPerConnection;
+	control.workloadFromFile = !workloadFile.empty();
+	if (control.workloadFromFile) {
+		try {
+			control.requestSpecs = readWorkloadFile(workloadFile, bodyOrder, bodySeed);
+		}
+		catch (const std::exception &e) {
+			std::cerr << "Error in workload: " << e.what() << std::endl;
+			return 1;
+		}
+	}
+	control.workloadGeneration = 0;
+	updateWorkload(control);
+	control.rateMode = vm.count("rate") || trace || profileSets(profile, "rate") || search;
+	control.rate = search ? search->rate() : vm.count("rate") ? rate : 0;
+	control.arrivals = arrivalDistribution;
+	control.maxBacklog = maxBacklog < 0 ? std::numeric_limits<size_t>::max() : maxBacklog;
+	control.trace = trace.get();
+	control.traceStartTime = monotonicNow();
+	control.traceSpeed = traceSpeed;
+	control.traceRate = traceRate;
+	control.numTraceReplayers = eventDriven ? eventLoops : 1;
+	control.workerIndex = 0;
+	control.numWorkers = 1;
 
-	/* Setup thread data */
-	ClientData data;
-	data.numRequests = 0;
-	data.numOption1 = 0;
-	data.numOption2 = 0;
-	data.numOpenQueuing = 0;
-	data.numErrors = 0;
-	data.queueLength = 0;
-	
 	/* Setup accumulated data */
+	size_t numTemplateStats = control.workloadFromFile ? control.requestSpecs.size() : 0;
+	IntervalData intervalData(histogramDigits, numTemplateStats, recordPhases);
 	AccumulatedData accData;
-	accData.numRequests = 0;
-	accData.numOption1 = 0;
-	accData.numOption2 = 0;
-	accData.numOpenQueuing = 0;
-	accData.numErrors = 0;
+	accData.latencies = Histogram(histogramDigits);
+	accData.sendLags = Histogram(histogramDigits);
+	accData.schedLags = Histogram(histogramDigits);
+	TemplateData templateData = { Histogram(histogramDigits), 0, 0 };
+	accData.templates.assign(numTemplateStats, templateData);
+	resetAccumulated(accData);
+	accData.numDumpDropped = 0;
+	accData.lastInterval = 0;
+	accData.reportLoopTime = 0;
+	accData.saturated = false;
+	if (!windows.empty())
+		accData.windows.reset(new SlidingWindows(windows, interval, histogramDigits));
+	if (warmUpPolicy.kind != WarmUpPolicy::NONE)
+		accData.warmUp.reset(new WarmUp(warmUpPolicy));
+
+	/*
+	 * Serve metrics, unless we are a worker: the coordinator serves merged
+	 * ones. Started after forking workers, which must not inherit it.
+	 */
+	std::unique_ptr<MetricsServer> metrics;
+	auto startMetricsServer = [&]() {
+		if (metricsListen.empty() || coordinatorFd >= 0)
+			return true;
+		try {
+			metrics.reset(new MetricsServer(metricsListen));
+		}
+		catch (const std::runtime_error &e) {
+			std::cerr << "Cannot serve metrics: " << e.what() << std::endl;
+			return false;
+		}
+		publishMetrics(*metrics, control, intervalData, accData);
+		return true;
+	};
+
+	/*
+	 * Coordinator: start workers, which inherit or receive our command-line
+	 * and generate the load, while we report their merged statistics
+	 */
+	int numCoordinatedWorkers = numLocalWorkers + remoteWorkerAddresses.size();
+	if (coordinatorFd < 0 && numCoordinatedWorkers > 0) {
+		std::vector<int> workerFds;
+		for (int i = 0; i < numLocalWorkers; i++) {
+			int sv[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+				perror("Cannot create worker socket");
+				return 1;
+			}
+			pid_t pid = fork();
+			if (pid < 0) {
+				perror("Cannot fork worker");
+				return 1;
+			}
+			if (pid == 0) {
+				/* Worker: continue below, reporting to the coordinator instead of stdout */
+				for (int fd : workerFds)
+					close(fd);
+				close(sv[0]);
+				coordinatorFd = sv[1];
+				workerIndex = i;
+				numWorkers = numCoordinatedWorkers;
+				int devNull = ::open("/dev/null", O_WRONLY);
+				dup2(devNull, 1);
+				close(devNull);
+				break;
+			}
+			close(sv[1]);
+			workerFds.push_back(sv[0]);
+		}
+
+		if (coordinatorFd < 0) {
+			/* Remote workers receive our command-line, except what makes us a coordinator */
+			std::vector<std::string> args;
+			for (int i = 1; i < argc; i++) {
+				std::string arg = argv[i];
+				if (arg == "--workers" || arg == "--remote-workers")
+					i++; /* skip value */
+				else if (arg.find("--workers=") != 0 && arg.find("--remote-workers=") != 0)
+					args.push_back(arg);
+			}
+			for (size_t i = 0; i < remoteWorkerAddresses.size(); i++) {
+				std::string error;
+				int fd = connectTcp(remoteWorkerAddresses[i], error);
+				if (fd < 0 || !sendHandshake(fd, numLocalWorkers + i, numCoordinatedWorkers, args)) {
+					fprintf(stderr, "Cannot reach worker %s: %s\n", remoteWorkerAddresses[i].c_str(), error.c_str());
+					kill(0, SIGTERM); /* also stop local workers */
+					return 1;
+				}
+				workerFds.push_back(fd);
+			}
+			if (!startMetricsServer()) {
+				kill(0, SIGTERM);
+				return 1;
+			}
+			return coordinate(control, workerFds, interval, profile, search.get(), metrics.get(), intervalData, accData);
+		}
+	}
+
+	if (!startMetricsServer())
+		return 1;
+
+	/* Worker: generate our share of the load */
+	if (coordinatorFd >= 0) {
+		control.workerIndex = workerIndex;
+		control.numWorkers = numWorkers;
+		control.concurrency = workerShare(concurrency, control);
+		control.poolSize = workerShare(control.poolSize, control);
+		control.numRequestsLeft = workerShare(numRequestsLeft, control);
+		if (maxBacklog >= 0)
+			control.maxBacklog = workerShare(maxBacklog, control);
+		fcntl(coordinatorFd, F_SETFL, fcntl(coordinatorFd, F_GETFL) | O_NONBLOCK);
+	}
+
+	/* Start following the profile before clients start, so that they start at its initial targets */
+	Nanos profileStartTime = monotonicNow();
+	int profilePhase = -1;
+	if (!profile.empty())
+		applyProfile(control, profile, profileStartTime, profileStartTime, profilePhase);
+
+	/* Setup thread data */
+	ClientData data;
+	HistogramLayout histogramLayout(histogramDigits);
+	if (eventDriven)
+		statsShards = eventLoops; /* one shard per event loop */
+	for (int i = 0; i < statsShards; i++)
+		data.shards.emplace_back(new StatsShard(histogramLayout, numTemplateStats, recordPhases));
+	std::unique_ptr<DumpWriter> dumpWriter;
+	if (dump) {
+		if (dumpFile.empty())
+			dumpFile = (dumpFormat == "binary") ? "httpmon-dump.bin" : "httpmon-dump.csv";
+		if (numWorkers > 1)
+			dumpFile += ".worker" + std::to_string(workerIndex); /* each worker dumps its own requests */
+		dumpWriter.reset(new DumpWriter(dumpFile,
+			(dumpFormat == "binary") ? DUMP_BINARY : DUMP_CSV,
+			wallClockOffset(), /* we dump monotonic times */
+			(uint64_t)(dumpRotate * 1024 * 1024), statsShards));
+		if (!dumpWriter->ok())
+			return 1;
+	}
+	data.dump = dumpWriter.get();
+	data.recordPhases = recordPhases;
+	std::unique_ptr<CurlShares> shares;
+	try {
+		/* Clients of an event loop, whose ids are equal modulo the number of loops, share caches */
+		int numShares = eventDriven ? eventLoops : std::max(1u, std::thread::hardware_concurrency());
+		if (shareFlags != SHARE_NONE)
+			shares.reset(new CurlShares(shareFlags, numShares));
+	}
+	catch (const std::runtime_error &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	control.shares = shares.get();
+	control.resolve = NULL;
+	for (const std::string &entry : resolveEntries)
+		control.resolve = curl_slist_append(control.resolve, entry.c_str());
+	data.lastCollectTime = monotonicNow();
+	data.lastCpuTime = processCpuTime();
+
+	/* Run on the given CPUs; threads started below inherit this */
+	if (!cpus.empty()) {
+		cpus = cpuShare(cpus, workerIndex, numWorkers);
+		int error = pinThread(pthread_self(), cpus);
+		if (error) {
+			std::cerr << "Cannot pin to CPUs: " << strerror(error) << std::endl;
+			return 1;
+		}
+	}
 
-	/* Start client threads */
+	/* Start client threads, parking those of the pool beyond the concurrency */
 	std::vector<std::thread> httpClientThreads;
-	for (int i = 0; i < concurrency; i++) {
-		httpClientThreads.emplace_back(httpClientMain, i,
-			std::ref(control), std::ref(data));
+	std::vector<std::thread> eventLoopThreads;
+	std::vector<int> loopWakeUpFds;
+	ClientPool pool(control);
+	std::unique_ptr<ArrivalScheduler> scheduler;
+	std::thread schedulerThread;
+	if (control.rateMode && !eventDriven) {
+		/* NOTE: event loops generate arrivals themselves */
+		scheduler.reset(new ArrivalScheduler(control, data.shardFor(0)));
+		schedulerThread = std::thread(&ArrivalScheduler::run, scheduler.get());
+	}
+	if (eventDriven) {
+		for (int i = 0; i < eventLoops; i++) {
+			loopWakeUpFds.push_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+			eventLoopThreads.emplace_back(eventLoopMain, i, eventLoops,
+				std::ref(control), std::ref(data), loopWakeUpFds.back());
+			if (!cpus.empty())
+				pinThread(eventLoopThreads.back().native_handle(), { cpus[i % cpus.size()] }); /* one loop per CPU */
+		}
 	}
+	else {
+		for (int i = 0; i < std::max(control.concurrency, control.poolSize); i++) {
+			httpClientThreads.emplace_back(httpClientMain, i,
+				std::ref(control), std::ref(data), std::ref(pool), scheduler.get());
+		}
+	}
+
+	/* Let clients notice changes of the concurrency, or that they should exit, right away */
+	auto wakeUpClients = [&]() {
+		pool.notify();
+		if (scheduler)
+			scheduler->wakeAll();
+		for (int fd : loopWakeUpFds)
+			eventfd_write(fd, 1);
+	};
 
 	/*
 	 * Let client threads work, until user interrupts us
@@ -619,35 +3791,95 @@ int main(int argc, char **argv)
 	sigaddset(&sigset, SIGQUIT);
 	sigaddset(&sigset, SIGTERM);
 	sigprocmask(SIG_BLOCK, &sigset, NULL);
+	int signalFd = signalfd(-1, &sigset, SFD_NONBLOCK | SFD_CLOEXEC);
 
 	/* Make stdin non-blocking */
 	int flags = fcntl(0, F_GETFL);
 	flags |= O_NONBLOCK;
 	fcntl(0, F_SETFL, flags);
-
-	/* Report at regular intervals */
-	int signo;
-	accData.reportTime = now();
-	std::string prevInput;
+	bool stdinOpen = true;
+
+	/* Report at regular intervals, following the profile in between */
+	int signo = 0;
+	int appliedConcurrency = control.concurrency;
+	accData.reportTime = monotonicNow();
+	Nanos nextReportTime = accData.reportTime + toNanos(interval);
+	std::string input;
 	while (control.running) {
-		struct timespec timeout = { int(interval), int((interval-(int)interval) * NanoSecondsInASecond)};
-		signo = sigtimedwait(&sigset, NULL, &timeout);
+		Nanos wakeUpAt = nextReportTime;
+		if (!profile.empty())
+			wakeUpAt = std::min(wakeUpAt, monotonicNow() + ControlPeriod);
+		if (coordinatorFd >= 0) {
+			/* Wait for requests of the coordinator, regularly checking if we are done */
+			signo = waitForSignalOrInput(signalFd, coordinatorFd,
+				monotonicNow() + (profile.empty() ? NanoSecondsInASecond / 10 : ControlPeriod));
+		}
+		else {
+			signo = waitForSignalOrInput(signalFd, stdinOpen ? 0 : -1, wakeUpAt);
+		}
 
 		if (signo > 0)
 			control.running = false;
 
-		report(data, accData);
-		processInput(prevInput, control);
+		if (!profile.empty() && !applyProfile(control, profile, profileStartTime, monotonicNow(), profilePhase) &&
+			control.running) {
+			control.running = false;
+			signo = -3;
+		}
+
+		bool eof;
+		if (coordinatorFd >= 0) {
+			for (const std::string &line : readLines(coordinatorFd, input, eof)) {
+				if (line == "snapshot") {
+					intervalData.reset();
+					collect(data, intervalData);
+					std::string payload;
+					intervalData.serialize(payload);
+					sendMessage(coordinatorFd, WORKER_SNAPSHOT, payload);
+					flushDump(data, accData);
+				}
+				else if (line == "stop")
+					control.running = false;
+				else
+					processCommand(line, control);
+			}
+			if (eof)
+				control.running = false; /* coordinator is gone */
+		}
+		else {
+			if (monotonicNow() >= nextReportTime || !control.running) {
+				nextReportTime += toNanos(interval);
+				if (nextReportTime <= monotonicNow())
+					nextReportTime = monotonicNow() + toNanos(interval); /* do not catch up after falling behind */
+				Nanos reportLoopStart = monotonicNow();
+				intervalData.reset();
+				collect(data, intervalData);
+				report(control, intervalData, accData);
+				if (metrics)
+					publishMetrics(*metrics, control, intervalData, accData);
+				flushDump(data, accData);
+
+				std::string rateCommand;
+				if (search && control.running && !advanceCapacitySearch(*search, intervalData, rateCommand)) {
+					control.running = false;
+					signo = -4;
+				}
+				if (!rateCommand.empty())
+					processCommand(rateCommand, control);
+				accData.reportLoopTime = monotonicNow() - reportLoopStart;
+			}
+			for (const std::string &line : readLines(0, input, eof))
+				processCommand(line, control);
+			stdinOpen = !eof;
+		}
 
-		/* Check if requested concurrency increased */
-		while ((int)httpClientThreads.size() < control.concurrency)
-			httpClientThreads.emplace_back(httpClientMain,
-				httpClientThreads.size(), std::ref(control), std::ref(data));
-		/* Check if requested concurrency decreased */
-		while ((int)httpClientThreads.size() > control.concurrency) {
-			pthread_kill(httpClientThreads.back().native_handle(), SIGUSR2);
-			httpClientThreads.back().detach();
-			httpClientThreads.pop_back();
+		/* Follow concurrency changes: activate or park clients, growing the pool if needed */
+		if (control.concurrency != appliedConcurrency) {
+			appliedConcurrency = control.concurrency;
+			while (!eventDriven && (int)httpClientThreads.size() < control.concurrency)
+				httpClientThreads.emplace_back(httpClientMain,
+					httpClientThreads.size(), std::ref(control), std::ref(data), std::ref(pool), scheduler.get());
+			wakeUpClients();
 		}
 
 		/* Honor terminate after count */
@@ -655,41 +3887,65 @@ int main(int argc, char **argv)
 			control.running = false;
 			signo = -1;
 		}
+
+		/* Terminate once the trace was replayed and answered */
+		if (control.trace && control.numTraceReplayers == 0 && data.queueLength() == 0) {
+			control.running = false;
+			signo = -2;
+		}
 	}
-	if (signo == -1)
+	if (coordinatorFd >= 0)
+		; /* the coordinator tells */
+	else if (signo == -1)
 		fprintf(stderr, "All requests sent, cleaning up ...\n");
+	else if (signo == -2)
+		fprintf(stderr, "Trace replayed, cleaning up ...\n");
+	else if (signo == -3)
+		fprintf(stderr, "Profile completed, cleaning up ...\n");
+	else if (signo == -4)
+		fprintf(stderr, "Capacity search completed, cleaning up ...\n");
 	else
 		fprintf(stderr, "Got signal %d, cleaning up ...\n", signo);
 
 	/*
-	 * Cleanup
+	 * Cleanup: client threads and event loops exit by themselves when
+	 * control.running is false. Client threads first finish their request
+	 * in flight, whereas event loops return at once: their requests in
+	 * flight are abandoned, i.e., removed without being reported.
 	 */
+	wakeUpClients();
 	for (auto &thread : httpClientThreads) {
-		pthread_kill(thread.native_handle(), SIGUSR2);
+		thread.join();
 	}
-	for (auto &thread : httpClientThreads) {
+	for (auto &thread : eventLoopThreads) {
 		thread.join();
 	}
+	if (schedulerThread.joinable())
+		schedulerThread.join();
+	for (int fd : loopWakeUpFds)
+		close(fd);
+	close(signalFd);
+	shares.reset(); /* clients cleaned up their handles */
+	curl_slist_free_all(control.resolve);
 	curl_global_cleanup();
 
 	/* Final stats */
-	report(data, accData);
-
-	if (dump) {
-		FILE *f = fopen("httpmon-dump.csv", "w");
-		if (!f) {
-			fprintf(stderr, "Writing to dumpfile failed\n");
-			return 1;
-		}
-	
-		fprintf(f, "generatedAt,sentAt,repliedAt,responseTime,option1,option2,error\n");
-		for (auto r : accData.requests) {
-			fprintf(f, "%f,%f,%f,%f,%d,%d,%d\n",
-				r.generatedAt, r.sentAt, r.repliedAt, r.repliedAt - r.generatedAt,
-				r.option1, r.option2, r.error);
-		}
-		fclose(f);
+	intervalData.reset();
+	collect(data, intervalData);
+	if (coordinatorFd >= 0) {
+		std::string payload;
+		intervalData.serialize(payload);
+		sendMessage(coordinatorFd, WORKER_FINAL, payload);
+		close(coordinatorFd);
+	}
+	else {
+		report(control, intervalData, accData);
+		if (metrics)
+			publishMetrics(*metrics, control, intervalData, accData);
 	}
 
+	/* Write remaining dumped requests */
+	dumpWriter.reset();
+
 	return 0;
 }
@@ -0,0 +1,345 @@
+#ifndef HTTPMON_LOOPBACK_SERVER_H
+#define HTTPMON_LOOPBACK_SERVER_H
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <queue>
+#include <random>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Loopback HTTP server
+ *
+ * A minimal HTTP/1.1 server on 127.0.0.1, used to benchmark httpmon itself
+ * without any network or real server in the way. It answers every request
+ * with a fixed body, after a delay that is either fixed or exponentially
+ * distributed. Delays are kept in a deadline heap served by a
+ * timerfd, so they do not occupy the server, which runs a single epoll
+ * thread. Arrival times and injected delays are recorded, so that the
+ * arrival process and the latencies measured by httpmon can be checked
+ * against them. Arrival times are taken by the kernel when requests are
+ * received (SO_TIMESTAMPNS), hence do not depend on when the server thread
+ * gets to run, e.g., if it shares a core with httpmon.
+ */
+
+enum DelayDistribution {
+	DELAY_FIXED,
+	DELAY_EXPONENTIAL,
+};
+
+class LoopbackServer {
+public:
+	/* Throws std::runtime_error if the server cannot listen */
+	LoopbackServer(DelayDistribution distribution, double meanDelay, size_t bodySize) :
+		distribution(distribution),
+		meanDelay(meanDelay * 1e9),
+		rng(std::random_device()()),
+		nextConnectionId(0),
+		serverPort(0)
+	{
+		response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " +
+			std::to_string(bodySize) + "\r\n\r\n" + std::string(bodySize, 'x');
+
+		listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		struct sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		address.sin_port = 0; /* any free port */
+		socklen_t addressLength = sizeof(address);
+		if (listenFd < 0 ||
+			bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+			listen(listenFd, SOMAXCONN) < 0 ||
+			getsockname(listenFd, (struct sockaddr *)&address, &addressLength) < 0)
+			throw std::runtime_error(std::string("Cannot listen on loopback: ") + strerror(errno));
+		serverPort = ntohs(address.sin_port);
+
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		watch(listenFd, EPOLLIN);
+		watch(timerFd, EPOLLIN);
+		watch(stopFd, EPOLLIN);
+
+		serverThread = std::thread(&LoopbackServer::run, this);
+	}
+
+	~LoopbackServer()
+	{
+		stop();
+		for (auto &c : connections)
+			close(c.second.fd);
+		close(listenFd);
+		close(timerFd);
+		close(stopFd);
+		close(epollFd);
+	}
+
+	int port() const { return serverPort; }
+
+	/* Stop serving; only then may the recorded data below be read */
+	void stop()
+	{
+		if (!serverThread.joinable())
+			return;
+		uint64_t one = 1;
+		if (write(stopFd, &one, sizeof(one)) < 0)
+			perror("Cannot stop loopback server");
+		serverThread.join();
+	}
+
+	/* Arrival times of requests, in CLOCK_MONOTONIC nanoseconds */
+	const std::vector<int64_t> &arrivals() const { return arrivalTimes; }
+
+	/* Delays injected before replying, in nanoseconds, in arrival order */
+	const std::vector<int64_t> &delays() const { return injectedDelays; }
+
+	/* How late delayed replies were sent compared to their deadline, in nanoseconds */
+	const std::vector<int64_t> &lateness() const { return replyLateness; }
+
+	static int64_t now()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	}
+
+private:
+	struct Connection {
+		int fd;
+		std::string in, out;
+		int64_t receivedAt; /* of the last data read */
+		int64_t lastDeadline; /* replies leave in order, even with random delays */
+	};
+
+	struct Reply {
+		int64_t deadline;
+		uint64_t connectionId;
+		bool operator>(const Reply &other) const { return deadline > other.deadline; }
+	};
+
+	void watch(int fd, uint32_t events, uint64_t data = UINT64_MAX)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.u64 = (data == UINT64_MAX) ? (uint64_t)fd | (1ull << 63) : data;
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+	}
+
+	int64_t drawDelay()
+	{
+		if (distribution == DELAY_EXPONENTIAL)
+			return std::exponential_distribution<double>(1 / meanDelay)(rng);
+		return meanDelay;
+	}
+
+	void run()
+	{
+		/* Leave signals to the main thread */
+		sigset_t sigset;
+		sigfillset(&sigset);
+		pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+		const int MaxEvents = 256;
+		struct epoll_event events[MaxEvents];
+		for (;;) {
+			int n = epoll_wait(epollFd, events, MaxEvents, -1);
+			if (n < 0 && errno != EINTR)
+				return;
+			for (int i = 0; i < n; i++) {
+				uint64_t data = events[i].data.u64;
+				if (data == ((uint64_t)stopFd | (1ull << 63)))
+					return;
+				else if (data == ((uint64_t)listenFd | (1ull << 63)))
+					acceptAll();
+				else if (data == ((uint64_t)timerFd | (1ull << 63))) {
+					uint64_t expirations;
+					if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+						perror("Cannot read loopback server timer");
+				}
+				else
+					serve(data, events[i].events);
+			}
+			sendDueReplies();
+		}
+	}
+
+	void acceptAll()
+	{
+		for (;;) {
+			int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0)
+				return;
+			int one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+			setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+			uint64_t id = nextConnectionId++;
+			Connection &c = connections[id];
+			c.fd = fd;
+			c.receivedAt = 0;
+			c.lastDeadline = 0;
+			watch(fd, EPOLLIN | EPOLLOUT | EPOLLET, id);
+		}
+	}
+
+	void serve(uint64_t id, uint32_t events)
+	{
+		auto it = connections.find(id);
+		if (it == connections.end())
+			return;
+		Connection &c = it->second;
+
+		if (events & EPOLLIN) {
+			char buf[16384];
+			char control[CMSG_SPACE(sizeof(struct timespec))];
+			for (;;) {
+				struct iovec iov = { buf, sizeof(buf) };
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+				ssize_t got = recvmsg(c.fd, &msg, 0);
+				if (got > 0) {
+					c.in.append(buf, got);
+					c.receivedAt = receiveTime(msg);
+					continue;
+				}
+				if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+					closeConnection(it);
+					return;
+				}
+				if (errno == EAGAIN)
+					break;
+			}
+			parseRequests(id, c);
+		}
+		if (!flush(c))
+			closeConnection(it);
+	}
+
+	/* Schedule a reply for each complete request received on c */
+	void parseRequests(uint64_t id, Connection &c)
+	{
+		size_t pos = 0;
+		for (;;) {
+			size_t headerEnd = c.in.find("\r\n\r\n", pos);
+			if (headerEnd == std::string::npos)
+				break;
+			size_t bodyLength = 0;
+			size_t cl = c.in.find("\r\nContent-Length:", pos);
+			if (cl != std::string::npos && cl < headerEnd)
+				bodyLength = strtoul(c.in.c_str() + cl + strlen("\r\nContent-Length:"), NULL, 10);
+			size_t requestEnd = headerEnd + 4 + bodyLength;
+			if (requestEnd > c.in.size())
+				break;
+			pos = requestEnd;
+
+			int64_t arrival = c.receivedAt;
+			int64_t delay = drawDelay();
+			arrivalTimes.push_back(arrival);
+			injectedDelays.push_back(delay);
+			if (delay <= 0 && c.lastDeadline <= arrival) {
+				c.out += response;
+				continue;
+			}
+			c.lastDeadline = std::max(arrival + delay, c.lastDeadline);
+			replies.push(Reply{ c.lastDeadline, id });
+		}
+		c.in.erase(0, pos);
+	}
+
+	/* Kernel receive time of a message, converted to CLOCK_MONOTONIC; now if unknown */
+	static int64_t receiveTime(struct msghdr &msg)
+	{
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+				continue;
+			struct timespec received, realtime;
+			memcpy(&received, CMSG_DATA(cmsg), sizeof(received));
+			int64_t monotonic = now();
+			clock_gettime(CLOCK_REALTIME, &realtime);
+			int64_t age = ((int64_t)realtime.tv_sec - received.tv_sec) * 1000000000 + (realtime.tv_nsec - received.tv_nsec);
+			return monotonic - age;
+		}
+		return now();
+	}
+
+	void sendDueReplies()
+	{
+		int64_t t = now();
+		while (!replies.empty() && replies.top().deadline <= t) {
+			Reply reply = replies.top();
+			replies.pop();
+			auto it = connections.find(reply.connectionId);
+			if (it == connections.end())
+				continue;
+			replyLateness.push_back(t - reply.deadline);
+			it->second.out += response;
+			if (!flush(it->second))
+				closeConnection(it);
+		}
+
+		if (!replies.empty()) {
+			struct itimerspec its;
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = replies.top().deadline / 1000000000;
+			its.it_value.tv_nsec = replies.top().deadline % 1000000000;
+			timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &its, NULL);
+		}
+	}
+
+	/* Write as much pending output as possible; returns false on errors */
+	bool flush(Connection &c)
+	{
+		while (!c.out.empty()) {
+			ssize_t written = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+			if (written < 0)
+				return errno == EAGAIN || errno == EINTR;
+			c.out.erase(0, written);
+		}
+		return true;
+	}
+
+	void closeConnection(std::unordered_map<uint64_t, Connection>::iterator it)
+	{
+		close(it->second.fd);
+		connections.erase(it);
+	}
+
+	const DelayDistribution distribution;
+	const double meanDelay; /* nanoseconds */
+	std::string response;
+	std::mt19937_64 rng;
+
+	int listenFd, epollFd, timerFd, stopFd;
+	std::unordered_map<uint64_t, Connection> connections;
+	uint64_t nextConnectionId;
+	std::priority_queue<Reply, std::vector<Reply>, std::greater<Reply>> replies;
+
+	std::vector<int64_t> arrivalTimes;
+	std::vector<int64_t> injectedDelays;
+	std::vector<int64_t> replyLateness;
+
+	int serverPort;
+	std::thread serverThread;
+};
+
+#endif
@@ -0,0 +1,439 @@
+#ifndef HTTPMON_METRICS_H
+#define HTTPMON_METRICS_H
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "histogram.h"
+
+/*
+ * Metrics exposition
+ *
+ * Serves the statistics of the last report over HTTP, on a TCP port or a
+ * Unix socket, so that monitoring systems can scrape them instead of parsing
+ * httpmon's output:
+ *
+ *     GET /metrics   OpenMetrics text, as understood by Prometheus
+ *     GET /snapshot  compact binary snapshot, see README
+ *
+ * The reporter renders each snapshot once per report and publishes it by
+ * swapping a pointer, hence never waits for scrapers. Meanwhile, the server
+ * thread keeps serving the previously published snapshot; connections that
+ * are still sending an older one hold a reference to it, so that it is sent
+ * directly from where it was rendered, without copying.
+ */
+
+/* Content served, rendered once per report */
+struct MetricsSnapshot {
+	std::string text; /* OpenMetrics */
+	std::string binary;
+};
+
+/* Renders metric families in the OpenMetrics text format */
+class OpenMetricsWriter {
+public:
+	/* Start a metric family; type is counter, gauge, histogram or summary */
+	void family(const std::string &name, const char *type, const char *help, const char *unit = NULL)
+	{
+		out += "# TYPE " + name + " " + type + "\n";
+		if (unit)
+			out += "# UNIT " + name + " " + unit + "\n";
+		out += "# HELP " + name + " " + help + "\n";
+	}
+
+	/* Add a sample; labels are given as name="value" pairs, already escaped, separated by commas */
+	void sample(const std::string &name, const std::string &labels, double value)
+	{
+		out += name;
+		if (!labels.empty())
+			out += "{" + labels + "}";
+		out += " " + formatValue(value) + "\n";
+	}
+
+	/*
+	 * Add the samples of a histogram family: cumulative counts of values up
+	 * to each bound, count and sum. Values are multiplied by scale, e.g., to
+	 * convert nanoseconds to seconds, before being compared to bounds.
+	 */
+	void histogram(const std::string &name, const std::string &labels, const Histogram &h, double scale,
+		const std::vector<double> &bounds)
+	{
+		std::vector<uint64_t> counts(bounds.size() + 1, 0);
+		for (size_t i = 0; i < h.numBuckets(); i++) {
+			if (h.bucketCount(i) == 0)
+				continue;
+			double value = (h.bucketLowest(i) + (h.bucketWidth(i) - 1) / 2.0) * scale;
+			size_t b = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+			counts[b] += h.bucketCount(i);
+		}
+		std::string prefix = labels.empty() ? "" : labels + ",";
+		uint64_t cumulative = 0;
+		for (size_t b = 0; b < bounds.size(); b++) {
+			cumulative += counts[b];
+			sample(name + "_bucket", prefix + "le=\"" + formatValue(bounds[b]) + "\"", cumulative);
+		}
+		sample(name + "_bucket", prefix + "le=\"+Inf\"", h.count());
+		sample(name + "_count", labels, h.count());
+		sample(name + "_sum", labels, h.count() ? h.mean() * h.count() * scale : 0);
+	}
+
+	/* Add the samples of a summary family: some quantiles, count and sum */
+	void summary(const std::string &name, const std::string &labels, const Histogram &h, double scale)
+	{
+		const double quantiles[] = { 0.5, 0.95, 0.99, 0.999 };
+		std::string prefix = labels.empty() ? "" : labels + ",";
+		for (double q : quantiles)
+			sample(name, prefix + "quantile=\"" + formatValue(q) + "\"", h.valueAtPercentile(q * 100) * scale);
+		sample(name + "_count", labels, h.count());
+		sample(name + "_sum", labels, h.count() ? h.mean() * h.count() * scale : 0);
+	}
+
+	/* Terminate and return the exposition */
+	std::string finish()
+	{
+		out += "# EOF\n";
+		return std::move(out);
+	}
+
+	/* Label value, escaped as OpenMetrics requires */
+	static std::string escape(const std::string &value)
+	{
+		std::string escaped;
+		for (char c : value) {
+			if (c == '\\' || c == '"')
+				escaped += std::string("\\") + c;
+			else if (c == '\n')
+				escaped += "\\n";
+			else
+				escaped += c;
+		}
+		return escaped;
+	}
+
+private:
+	static std::string formatValue(double value)
+	{
+		if (std::isnan(value))
+			return "NaN";
+		if (std::isinf(value))
+			return value > 0 ? "+Inf" : "-Inf";
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%.10g", value);
+		return buf;
+	}
+
+	std::string out;
+};
+
+class MetricsServer {
+public:
+	/*
+	 * Listen on address: "unix:PATH", "HOST:PORT" or "PORT", the latter on
+	 * 127.0.0.1 only. Throws std::runtime_error if it cannot.
+	 */
+	explicit MetricsServer(const std::string &address) :
+		listenFd(-1)
+	{
+		std::string error;
+		if (address.compare(0, 5, "unix:") == 0)
+			listenUnix(address.substr(5), error);
+		else {
+			size_t colon = address.rfind(':');
+			if (colon == std::string::npos)
+				listenTcp("127.0.0.1", address, error);
+			else
+				listenTcp(address.substr(0, colon), address.substr(colon + 1), error);
+		}
+		if (listenFd < 0)
+			throw std::runtime_error("cannot listen on '" + address + "': " + error);
+
+		epollFd = epoll_create1(EPOLL_CLOEXEC);
+		stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		watch(listenFd, EPOLLIN, ListenId, EPOLL_CTL_ADD);
+		watch(stopFd, EPOLLIN, StopId, EPOLL_CTL_ADD);
+		serverThread = std::thread(&MetricsServer::run, this);
+	}
+
+	~MetricsServer()
+	{
+		uint64_t one = 1;
+		if (write(stopFd, &one, sizeof(one)) < 0)
+			perror("Cannot stop metrics server");
+		serverThread.join();
+		for (auto &c : connections)
+			close(c.second.fd);
+		close(listenFd);
+		close(stopFd);
+		close(epollFd);
+		if (!unixPath.empty())
+			unlink(unixPath.c_str());
+	}
+
+	/* Called by the reporter: serve snapshot from now on; never blocks on scrapers */
+	void publish(std::shared_ptr<const MetricsSnapshot> snapshot)
+	{
+		std::atomic_store(&current, snapshot);
+	}
+
+private:
+	static const uint64_t ListenId = UINT64_MAX;
+	static const uint64_t StopId = UINT64_MAX - 1;
+	static const size_t MaxRequestSize = 8192;
+
+	struct Connection {
+		int fd;
+		std::string in;
+		std::string header; /* of the response being sent */
+		std::shared_ptr<const MetricsSnapshot> snapshot; /* keeps body alive while sending */
+		const std::string *body;
+		size_t sent; /* of header, then body */
+		bool closeAfterResponse;
+		bool waitingToSend; /* for the socket to drain */
+	};
+
+	void listenUnix(const std::string &path, std::string &error)
+	{
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+			error = "invalid socket path";
+			return;
+		}
+		strcpy(address.sun_path, path.c_str());
+
+		/* Replace a socket left behind by an earlier run, but nothing else */
+		struct stat st;
+		if (stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+			unlink(path.c_str());
+
+		listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+			listen(listenFd, SOMAXCONN) < 0) {
+			error = strerror(errno);
+			if (listenFd >= 0)
+				close(listenFd);
+			listenFd = -1;
+			return;
+		}
+		unixPath = path;
+	}
+
+	void listenTcp(const std::string &host, const std::string &port, std::string &error)
+	{
+		struct addrinfo hints, *addresses;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		int ret = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &addresses);
+		if (ret != 0) {
+			error = gai_strerror(ret);
+			return;
+		}
+		error = "no address";
+		for (struct addrinfo *a = addresses; a != NULL && listenFd < 0; a = a->ai_next) {
+			listenFd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+			if (listenFd < 0)
+				continue;
+			int one = 1;
+			setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(listenFd, a->ai_addr, a->ai_addrlen) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+				error = strerror(errno);
+				close(listenFd);
+				listenFd = -1;
+			}
+		}
+		freeaddrinfo(addresses);
+	}
+
+	void watch(int fd, uint32_t events, uint64_t id, int op)
+	{
+		struct epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.u64 = id;
+		epoll_ctl(epollFd, op, fd, &ev);
+	}
+
+	void run()
+	{
+		/* Leave signals to the main thread */
+		sigset_t sigset;
+		sigfillset(&sigset);
+		pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+		uint64_t nextId = 0;
+		const int MaxEvents = 64;
+		struct epoll_event events[MaxEvents];
+		for (;;) {
+			int n = epoll_wait(epollFd, events, MaxEvents, -1);
+			if (n < 0 && errno != EINTR)
+				return;
+			for (int i = 0; i < n; i++) {
+				uint64_t id = events[i].data.u64;
+				if (id == StopId)
+					return;
+				if (id == ListenId) {
+					int fd;
+					while ((fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+						Connection &c = connections[nextId];
+						c.fd = fd;
+						c.body = NULL;
+						c.sent = 0;
+						c.closeAfterResponse = false;
+						c.waitingToSend = false;
+						watch(fd, EPOLLIN, nextId++, EPOLL_CTL_ADD);
+					}
+					continue;
+				}
+				auto it = connections.find(id);
+				if (it != connections.end() && !serve(id, it->second)) {
+					close(it->second.fd);
+					connections.erase(it);
+				}
+			}
+		}
+	}
+
+	/* Read requests and send responses, one at a time; returns false to close the connection */
+	bool serve(uint64_t id, Connection &c)
+	{
+		if (!c.body) {
+			char buf[4096];
+			ssize_t got;
+			while ((got = read(c.fd, buf, sizeof(buf))) > 0)
+				c.in.append(buf, got);
+			if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+				return false;
+		}
+		for (;;) {
+			if (c.body) {
+				if (!sendResponse(c))
+					return false;
+				if (c.body) {
+					if (!c.waitingToSend)
+						watch(c.fd, EPOLLOUT, id, EPOLL_CTL_MOD);
+					c.waitingToSend = true;
+					return true;
+				}
+				if (c.closeAfterResponse)
+					return false;
+				if (c.waitingToSend)
+					watch(c.fd, EPOLLIN, id, EPOLL_CTL_MOD);
+				c.waitingToSend = false;
+			}
+			size_t end = c.in.find("\r\n\r\n");
+			if (end == std::string::npos)
+				return c.in.size() <= MaxRequestSize;
+			respond(c, c.in.substr(0, end));
+			c.in.erase(0, end + 4);
+		}
+	}
+
+	void respond(Connection &c, const std::string &request)
+	{
+		std::string method, path, version;
+		size_t space1 = request.find(' '), space2 = request.find(' ', space1 + 1);
+		size_t eol = request.find("\r\n");
+		if (space1 != std::string::npos && space2 != std::string::npos) {
+			method = request.substr(0, space1);
+			path = request.substr(space1 + 1, space2 - space1 - 1);
+			version = request.substr(space2 + 1, eol == std::string::npos ? std::string::npos : eol - space2 - 1);
+		}
+		path = path.substr(0, path.find('?'));
+		std::string lower(request);
+		std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+		c.closeAfterResponse = version != "HTTP/1.1" || lower.find("\r\nconnection: close") != std::string::npos;
+
+		c.snapshot = std::atomic_load(&current);
+		const char *status = "200 OK";
+		const char *contentType = "text/plain; charset=utf-8";
+		if (method != "GET" && method != "HEAD") {
+			status = "405 Method Not Allowed";
+			c.body = &MethodNotAllowed;
+		}
+		else if (path != "/metrics" && path != "/snapshot") {
+			status = "404 Not Found";
+			c.body = &NotFound;
+		}
+		else if (!c.snapshot) {
+			status = "503 Service Unavailable";
+			c.body = &NotReady;
+		}
+		else if (path == "/metrics") {
+			contentType = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+			c.body = &c.snapshot->text;
+		}
+		else {
+			contentType = "application/octet-stream";
+			c.body = &c.snapshot->binary;
+		}
+		c.header = std::string("HTTP/1.1 ") + status + "\r\nContent-Type: " + contentType +
+			"\r\nContent-Length: " + std::to_string(c.body->size()) +
+			(c.closeAfterResponse ? "\r\nConnection: close" : "") + "\r\n\r\n";
+		if (method == "HEAD")
+			c.body = &Empty;
+		c.sent = 0;
+	}
+
+	/* Send as much of the response as possible; returns false on errors */
+	bool sendResponse(Connection &c)
+	{
+		while (c.sent < c.header.size() + c.body->size()) {
+			struct iovec iov[2];
+			int n = 0;
+			if (c.sent < c.header.size())
+				iov[n++] = { (void *)(c.header.data() + c.sent), c.header.size() - c.sent };
+			size_t bodySent = c.sent > c.header.size() ? c.sent - c.header.size() : 0;
+			iov[n++] = { (void *)(c.body->data() + bodySent), c.body->size() - bodySent };
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = n;
+			ssize_t written = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+			if (written < 0)
+				return errno == EAGAIN || errno == EINTR;
+			c.sent += written;
+		}
+		c.body = NULL;
+		c.snapshot.reset();
+		return true;
+	}
+
+	const std::string NotFound = "Try /metrics or /snapshot\n";
+	const std::string MethodNotAllowed = "Only GET and HEAD are supported\n";
+	const std::string NotReady = "No report yet\n";
+	const std::string Empty;
+
+	int listenFd, epollFd, stopFd;
+	std::string unixPath; /* to remove when done */
+	std::unordered_map<uint64_t, Connection> connections;
+	std::shared_ptr<const MetricsSnapshot> current; /* only accessed atomically */
+	std::thread serverThread;
+};
+
+#endif
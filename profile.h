@@ -0,0 +1,205 @@
+#ifndef HTTPMON_PROFILE_H
+#define HTTPMON_PROFILE_H
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Workload profiles
+ *
+ * A profile is a text file with one timed phase per line:
+ *
+ *     duration shape target=value [parameter=value ...]
+ *
+ * where duration is in seconds and target is either rate, in requests per
+ * second, or concurrency. Phases follow each other; each sets its target
+ * as a function of the time elapsed since the phase started:
+ *
+ *     10 step  rate=100                         # constant
+ *     60 ramp  rate=100:1000                    # linear, from 100 to 1000
+ *     60 ramp  rate=200                         # linear, from the last value
+ *     60 sine  rate=500 amplitude=300 period=20 # 500 + 300 sin(2 pi t / 20)
+ *     30 spike rate=200 peak=2000 width=1 every=10 at=5
+ *
+ * A spike sets the target to peak for width seconds, starting at seconds
+ * into the phase (default: 0), and repeated every so many seconds if given;
+ * otherwise, the target is the base value. Targets never go below zero.
+ * Empty lines and text following '#' are ignored.
+ */
+
+enum ProfileShape {
+	PROFILE_STEP,
+	PROFILE_RAMP,
+	PROFILE_SINE,
+	PROFILE_SPIKE,
+};
+
+const char *const ProfileShapeNames[] = { "step", "ramp", "sine", "spike" };
+
+struct ProfilePhase {
+	double start;    /*< seconds since the profile started */
+	double duration; /*< seconds */
+	ProfileShape shape;
+	std::string target; /*< "rate" or "concurrency" */
+	double value; /*< step and spike: base value; ramp: start value; sine: mean */
+	double to; /*< ramp: end value */
+	double amplitude, period; /*< sine */
+	double peak, width, every, at; /*< spike */
+	std::string text; /*< target and parameters as written in the profile, for logging */
+};
+
+/* Target value of a phase, t seconds after it started */
+inline double profileValue(const ProfilePhase &phase, double t)
+{
+	double value = phase.value;
+	switch (phase.shape) {
+	case PROFILE_RAMP:
+		value = phase.value + (phase.to - phase.value) * std::min(1.0, t / phase.duration);
+		break;
+	case PROFILE_SINE:
+		value = phase.value + phase.amplitude * sin(2 * M_PI * t / phase.period);
+		break;
+	case PROFILE_SPIKE:
+		if (t >= phase.at) {
+			double sinceSpike = (phase.every > 0) ? fmod(t - phase.at, phase.every) : t - phase.at;
+			if (sinceSpike < phase.width)
+				value = phase.peak;
+		}
+		break;
+	default:
+		break;
+	}
+	return std::max(0.0, value);
+}
+
+/* Index of the phase active t seconds after the profile started; -1 once it is over */
+inline int profilePhaseAt(const std::vector<ProfilePhase> &phases, double t)
+{
+	for (size_t i = 0; i < phases.size(); i++) {
+		if (t < phases[i].start + phases[i].duration)
+			return i;
+	}
+	return -1;
+}
+
+/* True if some phase of the profile sets target */
+inline bool profileSets(const std::vector<ProfilePhase> &phases, const std::string &target)
+{
+	for (const ProfilePhase &phase : phases) {
+		if (phase.target == target)
+			return true;
+	}
+	return false;
+}
+
+/* Parse a profile file, see above; throws on errors */
+inline std::vector<ProfilePhase> readProfileFile(const std::string &path)
+{
+	std::ifstream f(path);
+	if (!f)
+		throw std::runtime_error("cannot read profile file '" + path + "'");
+
+	std::vector<ProfilePhase> phases;
+	std::string line;
+	double start = 0;
+	for (int lineNumber = 1; std::getline(f, line); lineNumber++) {
+		std::string where = path + ":" + std::to_string(lineNumber) + ": ";
+		line = line.substr(0, line.find('#'));
+		std::istringstream tokens(line);
+		std::string shape;
+		ProfilePhase phase;
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue; /* empty line */
+		if (!(tokens >> phase.duration) || phase.duration <= 0)
+			throw std::runtime_error(where + "expected a positive duration in seconds");
+		if (!(tokens >> shape))
+			throw std::runtime_error(where + "missing shape");
+		if (shape == "step")
+			phase.shape = PROFILE_STEP;
+		else if (shape == "ramp")
+			phase.shape = PROFILE_RAMP;
+		else if (shape == "sine")
+			phase.shape = PROFILE_SINE;
+		else if (shape == "spike")
+			phase.shape = PROFILE_SPIKE;
+		else
+			throw std::runtime_error(where + "unknown shape '" + shape + "'");
+		phase.start = start;
+		phase.value = phase.to = NAN;
+		phase.amplitude = phase.period = 0;
+		phase.peak = phase.width = phase.every = phase.at = 0;
+
+		std::string token;
+		while (tokens >> token) {
+			phase.text += (phase.text.empty() ? "" : " ") + token;
+			size_t equal = token.find('=');
+			if (equal == std::string::npos)
+				throw std::runtime_error(where + "expected key=value instead of '" + token + "'");
+			std::string key = token.substr(0, equal);
+			std::string value = token.substr(equal + 1);
+			try {
+				if (key == "rate" || key == "concurrency") {
+					if (!phase.target.empty())
+						throw std::runtime_error(where + "a phase sets a single target");
+					phase.target = key;
+					size_t colon = value.find(':');
+					if (phase.shape == PROFILE_RAMP && colon != std::string::npos) {
+						phase.value = std::stod(value.substr(0, colon));
+						phase.to = std::stod(value.substr(colon + 1));
+					}
+					else if (phase.shape == PROFILE_RAMP)
+						phase.to = std::stod(value);
+					else
+						phase.value = std::stod(value);
+				}
+				else if (key == "amplitude" && phase.shape == PROFILE_SINE)
+					phase.amplitude = std::stod(value);
+				else if (key == "period" && phase.shape == PROFILE_SINE)
+					phase.period = std::stod(value);
+				else if (key == "peak" && phase.shape == PROFILE_SPIKE)
+					phase.peak = std::stod(value);
+				else if (key == "width" && phase.shape == PROFILE_SPIKE)
+					phase.width = std::stod(value);
+				else if (key == "every" && phase.shape == PROFILE_SPIKE)
+					phase.every = std::stod(value);
+				else if (key == "at" && phase.shape == PROFILE_SPIKE)
+					phase.at = std::stod(value);
+				else
+					throw std::runtime_error(where + "unknown key '" + key + "' for " + shape);
+			}
+			catch (const std::logic_error &e) {
+				throw std::runtime_error(where + "invalid value '" + value + "' for " + key);
+			}
+		}
+
+		if (phase.target.empty())
+			throw std::runtime_error(where + "missing rate=... or concurrency=...");
+		if (phase.shape == PROFILE_RAMP && std::isnan(phase.value)) {
+			/* Continue from where the last phase with the same target ended */
+			for (auto it = phases.rbegin(); it != phases.rend() && std::isnan(phase.value); it++) {
+				if (it->target == phase.target)
+					phase.value = profileValue(*it, it->duration);
+			}
+			if (std::isnan(phase.value))
+				throw std::runtime_error(where + "ramp needs a start value, e.g., " + phase.target + "=FROM:TO");
+		}
+		if (phase.shape == PROFILE_SINE && phase.period <= 0)
+			throw std::runtime_error(where + "sine needs a positive period");
+		if (phase.shape == PROFILE_SPIKE && phase.width <= 0)
+			throw std::runtime_error(where + "spike needs a positive width");
+
+		phases.push_back(phase);
+		start += phase.duration;
+	}
+
+	if (phases.empty())
+		throw std::runtime_error("profile file '" + path + "' defines no phases");
+	return phases;
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef HTTPMON_SHARE_H
+#define HTTPMON_SHARE_H
+
+#include <cstdlib>
+#include <curl/curl.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * Shared caches
+ *
+ * By default, each client resolves host names, performs TLS handshakes and
+ * keeps connections on its own, as independent users would. Production
+ * clients, e.g., browsers or service meshes, rather cache DNS answers and
+ * resume TLS sessions. With --share, clients share these through CURL's
+ * share interface. To keep the share's locks from becoming a hot spot,
+ * clients are split into shards, e.g., one per event loop, and only
+ * clients of the same shard share caches.
+ */
+
+/* What clients may share, as a combination of flags */
+enum ShareFlags {
+	SHARE_NONE = 0,
+	SHARE_DNS = 1,
+	SHARE_TLS = 2, /* TLS session IDs and tickets, for resumption */
+	SHARE_CONNECTIONS = 4, /* only within one thread, i.e., an event loop */
+};
+
+/* Parse what to share, such as "dns,tls", or "none"; throws std::invalid_argument on errors */
+inline int parseShareFlags(const std::string &list)
+{
+	if (list == "none")
+		return SHARE_NONE;
+	int flags = SHARE_NONE;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string item = list.substr(start, end - start);
+		start = end + 1;
+
+		if (item == "dns")
+			flags |= SHARE_DNS;
+		else if (item == "tls")
+			flags |= SHARE_TLS;
+		else if (item == "connect")
+			flags |= SHARE_CONNECTIONS;
+		else
+			throw std::invalid_argument("cannot share '" + item + "', expected 'dns', 'tls', 'connect' or 'none'");
+	}
+	return flags;
+}
+
+/*
+ * Whether entry pins a host name to addresses, as HOST:PORT:ADDRESS[,ADDRESS]...,
+ * for CURLOPT_RESOLVE; addresses may be IPv6 in brackets.
+ */
+inline bool isResolveEntry(const std::string &entry)
+{
+	size_t hostEnd = entry.find(':');
+	if (hostEnd == 0 || hostEnd == std::string::npos)
+		return false;
+	size_t portEnd = entry.find(':', hostEnd + 1);
+	if (portEnd == std::string::npos || portEnd + 1 >= entry.size())
+		return false;
+	std::string port = entry.substr(hostEnd + 1, portEnd - hostEnd - 1);
+	char *rest;
+	long number = strtol(port.c_str(), &rest, 10);
+	return !port.empty() && *rest == '\0' && number > 0 && number < 65536;
+}
+
+class CurlShares {
+public:
+	/* Throws std::runtime_error if CURL cannot share as requested */
+	CurlShares(int flags, size_t numShards)
+	{
+		static const struct { int flag; curl_lock_data data; } Shared[] = {
+			{ SHARE_DNS, CURL_LOCK_DATA_DNS },
+			{ SHARE_TLS, CURL_LOCK_DATA_SSL_SESSION },
+			{ SHARE_CONNECTIONS, CURL_LOCK_DATA_CONNECT },
+		};
+
+		for (size_t i = 0; i < numShards; i++) {
+			shards.emplace_back(new Shard);
+			CURLSH *share = shards.back()->share;
+			if (share == NULL)
+				throw std::runtime_error("cannot create CURL share");
+			curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lock);
+			curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlock);
+			curl_share_setopt(share, CURLSHOPT_USERDATA, shards.back().get());
+			for (const auto &shared : Shared) {
+				if ((flags & shared.flag) && curl_share_setopt(share, CURLSHOPT_SHARE, shared.data) != CURLSHE_OK)
+					throw std::runtime_error("this CURL cannot share " + std::string(
+						shared.data == CURL_LOCK_DATA_DNS ? "DNS" : shared.data == CURL_LOCK_DATA_SSL_SESSION ? "TLS sessions" : "connections"));
+			}
+		}
+	}
+
+	/* Share for the client with the given id; all easy handles must be cleaned up before this is destroyed */
+	CURLSH *forClient(int id) const { return shards[id % shards.size()]->share; }
+
+private:
+	struct Shard {
+		CURLSH *share;
+		std::mutex locks[CURL_LOCK_DATA_LAST];
+
+		Shard() : share(curl_share_init()) {}
+		~Shard() { curl_share_cleanup(share); }
+	};
+
+	static void lock(CURL *, curl_lock_data data, curl_lock_access, void *userptr)
+	{
+		((Shard *)userptr)->locks[data].lock();
+	}
+
+	static void unlock(CURL *, curl_lock_data data, void *userptr)
+	{
+		((Shard *)userptr)->locks[data].unlock();
+	}
+
+	std::vector<std::unique_ptr<Shard>> shards;
+};
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef HTTPMON_TRACE_H
+#define HTTPMON_TRACE_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Request traces
+ *
+ * A trace is a text file with one request per line:
+ *
+ *     timestamp method path [body-ref]
+ *
+ * where timestamp is in seconds (e.g., a UNIX timestamp with fractional
+ * part), path is either absolute or relative to httpmon's --url, and the
+ * optional body-ref names a file holding the request body. Empty lines and
+ * lines starting with '#' are ignored. Timestamps are expected to be
+ * non-decreasing.
+ *
+ * Traces are memory-mapped and read sequentially, so they may be much
+ * larger than RAM.
+ */
+
+struct TraceEntry {
+	double timestamp;
+	std::string method;
+	std::string path;
+	std::string bodyRef; /* empty if none */
+};
+
+class TraceFile {
+public:
+	explicit TraceFile(const std::string &path) :
+		data(NULL),
+		size(0),
+		firstTimestamp(0)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			error = strerror(errno);
+			return;
+		}
+		struct stat st;
+		fstat(fd, &st);
+		size = st.st_size;
+		if (size > 0) {
+			void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED)
+				error = strerror(errno);
+			else {
+				data = (const char *)map;
+				madvise(map, size, MADV_SEQUENTIAL);
+			}
+		}
+		close(fd);
+
+		/* Find first timestamp, to which all others are relative */
+		size_t offset = 0;
+		TraceEntry entry;
+		if (error.empty() && !nextLine(offset, &entry))
+			error = "trace contains no requests";
+		firstTimestamp = entry.timestamp;
+
+		/* Relative body references are resolved against the trace's directory */
+		size_t slash = path.rfind('/');
+		if (slash != std::string::npos)
+			directory = path.substr(0, slash + 1);
+	}
+
+	~TraceFile()
+	{
+		if (data)
+			munmap((void *)data, size);
+	}
+
+	bool ok() const { return error.empty(); }
+
+	/*
+	 * Find the next request line starting at offset, parse it into entry if
+	 * non-NULL, and advance offset to the following line. Malformed lines are
+	 * skipped, also if entry is NULL, so that readers skipping lines and
+	 * readers parsing them agree on which lines are requests. Returns false
+	 * at the end of the trace.
+	 */
+	bool nextLine(size_t &offset, TraceEntry *entry) const
+	{
+		while (offset < size) {
+			const char *line = data + offset;
+			const char *end = (const char *)memchr(line, '\n', size - offset);
+			if (!end)
+				end = data + size;
+			offset = end - data + 1;
+
+			/* Skip empty lines and comments */
+			const char *p = skipSpaces(line, end);
+			if (p == end || *p == '#')
+				continue;
+
+			/* Parse fields, only copying them if asked to */
+			char *afterTimestamp;
+			double timestamp = strtod(p, &afterTimestamp);
+			if (afterTimestamp == p)
+				continue;
+			p = afterTimestamp;
+			const char *method, *path, *bodyRef;
+			size_t methodLength = nextField(p, end, method);
+			size_t pathLength = nextField(p, end, path);
+			if (methodLength == 0 || pathLength == 0)
+				continue;
+			if (entry) {
+				size_t bodyRefLength = nextField(p, end, bodyRef);
+				entry->timestamp = timestamp;
+				entry->method.assign(method, methodLength);
+				entry->path.assign(path, pathLength);
+				entry->bodyRef.assign(bodyRef, bodyRefLength);
+			}
+			return true;
+		}
+		return false;
+	}
+
+	std::string error;
+	const char *data;
+	size_t size;
+	double firstTimestamp;
+	std::string directory;
+
+private:
+	static const char *skipSpaces(const char *p, const char *end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		return p;
+	}
+
+	/* Find the next field, advancing p past it; returns its length, 0 if none */
+	static size_t nextField(const char *&p, const char *end, const char *&field)
+	{
+		p = skipSpaces(p, end);
+		field = p;
+		while (p < end && *p != ' ' && *p != '\t' && *p != '\r')
+			p++;
+		return p - field;
+	}
+
+	TraceFile(const TraceFile &);
+	TraceFile &operator=(const TraceFile &);
+};
+
+/*
+ * Reads every numShares-th request of a trace, starting with the
+ * shareIndex-th, so that several threads can replay disjoint parts of the
+ * same trace without coordinating.
+ */
+class TraceReader {
+public:
+	TraceReader(const TraceFile &file, size_t shareIndex, size_t numShares) :
+		file(file),
+		offset(0),
+		index(0),
+		shareIndex(shareIndex),
+		numShares(numShares)
+	{
+	}
+
+	/* Returns false at the end of the trace; index is the entry's index in the whole trace */
+	bool next(TraceEntry &entry, uint64_t &entryIndex)
+	{
+		/* Skip other readers' lines, only checking that they are requests */
+		while (index % numShares != shareIndex) {
+			if (!file.nextLine(offset, NULL))
+				return false;
+			index++;
+		}
+		if (!file.nextLine(offset, &entry))
+			return false;
+		entryIndex = index++;
+		return true;
+	}
+
+private:
+	const TraceFile &file;
+	size_t offset;
+	uint64_t index;
+	const size_t shareIndex;
+	const size_t numShares;
+};
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef HTTPMON_WARMUP_H
+#define HTTPMON_WARMUP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <stdexcept>
+#include <string>
+
+/*
+ * Warm-up exclusion
+ *
+ * The first seconds of a run measure a cold system: empty server caches,
+ * JIT compilers, connections being opened as clients start. These skew
+ * accumulated statistics and make runs hard to compare. A warm-up policy
+ * tells when the steady state starts: after a fixed duration, after a
+ * number of requests, or, automatically, once throughput and median latency
+ * settled: averaged over the last few report intervals, they are within a
+ * tolerance of their average over as many intervals before. Averaging makes
+ * detection robust to the noise of single intervals, e.g., at low rates.
+ * Warm-up always ends at the end of a report interval, so that accumulated
+ * statistics can be reset there.
+ */
+
+struct WarmUpPolicy {
+	enum Kind {
+		NONE,
+		DURATION, /* seconds */
+		REQUESTS,
+		AUTO, /* throughput and median latency settled */
+	} kind;
+	double seconds;
+	uint64_t requests;
+	double tolerance; /* with AUTO, relative change allowed, e.g., 0.1 for 10% */
+	int numIntervals; /* with AUTO, how many intervals to average */
+
+	WarmUpPolicy() : kind(NONE), seconds(0), requests(0), tolerance(0.1), numIntervals(5) {}
+};
+
+/*
+ * Parse a warm-up policy: "none", a duration in seconds, such as "30" or
+ * "30s", a number of requests, such as "5000req", or "auto"; throws
+ * std::invalid_argument on errors. Tolerance and intervals of "auto" are
+ * left to the caller.
+ */
+inline WarmUpPolicy parseWarmUpPolicy(const std::string &spec)
+{
+	WarmUpPolicy policy;
+	if (spec == "none")
+		return policy;
+	if (spec == "auto") {
+		policy.kind = WarmUpPolicy::AUTO;
+		return policy;
+	}
+	char *rest;
+	double value = strtod(spec.c_str(), &rest);
+	std::string unit(rest);
+	if (rest == spec.c_str() || !(value > 0) || !std::isfinite(value))
+		throw std::invalid_argument("expected 'none', 'auto', a duration such as '30s' or a number of requests such as '5000req'");
+	if (unit.empty() || unit == "s") {
+		policy.kind = WarmUpPolicy::DURATION;
+		policy.seconds = value;
+	}
+	else if (unit == "req" && value == std::floor(value)) {
+		policy.kind = WarmUpPolicy::REQUESTS;
+		policy.requests = (uint64_t)value;
+	}
+	else
+		throw std::invalid_argument("unknown unit '" + unit + "', expected 's' or 'req'");
+	return policy;
+}
+
+class WarmUp {
+public:
+	explicit WarmUp(const WarmUpPolicy &policy) :
+		policy(policy),
+		warmingUp(policy.kind != WarmUpPolicy::NONE),
+		duration(0),
+		numRequests(0)
+	{
+	}
+
+	/* Whether the steady state has yet to start */
+	bool active() const { return warmingUp; }
+
+	/* Seconds spent warming up so far, or in total once over */
+	double elapsed() const { return duration; }
+
+	/*
+	 * Account for a report interval of dt seconds that just ended, with its
+	 * number of requests, successful or not, throughput in requests per
+	 * second and median latency of successful requests. Returns true if
+	 * warm-up ended with this interval.
+	 */
+	bool addInterval(double dt, uint64_t requests, double throughput, double medianLatency)
+	{
+		if (!warmingUp)
+			return false;
+		duration += dt;
+		numRequests += requests;
+
+		switch (policy.kind) {
+		case WarmUpPolicy::DURATION:
+			/* Tolerate timer jitter, rather than waiting for another interval */
+			warmingUp = (duration < policy.seconds - 0.01 * dt);
+			break;
+		case WarmUpPolicy::REQUESTS:
+			warmingUp = (numRequests < policy.requests);
+			break;
+		case WarmUpPolicy::AUTO:
+			recent.push_back(Sample { throughput, medianLatency });
+			if (recent.size() > 2 * (size_t)policy.numIntervals)
+				recent.pop_front();
+			warmingUp = !settled();
+			break;
+		default:
+			warmingUp = false;
+		}
+		return !warmingUp;
+	}
+
+private:
+	struct Sample {
+		double throughput;
+		double medianLatency; /* NAN if no request succeeded */
+	};
+
+	/* Whether the average of the most recent intervals is within the tolerance of that of the previous ones */
+	bool settled() const
+	{
+		size_t n = policy.numIntervals;
+		if (recent.size() < 2 * n)
+			return false;
+		auto withinTolerance = [&](double Sample::*field) {
+			double previous = 0, last = 0;
+			for (size_t i = 0; i < 2 * n; i++) {
+				double value = recent[i].*field;
+				if (!(value > 0)) /* NAN or nothing completed: not settled */
+					return false;
+				(i < n ? previous : last) += value / n;
+			}
+			return std::fabs(last - previous) <= policy.tolerance * last;
+		};
+		return withinTolerance(&Sample::throughput) && withinTolerance(&Sample::medianLatency);
+	}
+
+	const WarmUpPolicy policy;
+	bool warmingUp;
+	double duration;
+	uint64_t numRequests;
+	std::deque<Sample> recent; /* with AUTO, the last 2 * numIntervals intervals, oldest first */
+};
+
+#endif
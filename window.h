@@ -0,0 +1,134 @@
+#ifndef HTTPMON_WINDOW_H
+#define HTTPMON_WINDOW_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+/*
+ * Sliding windows
+ *
+ * Statistics over the last few report intervals, e.g., the last 10 and 60
+ * seconds, less noisy than those of a single interval and more responsive
+ * than those since the start. The statistics of recent intervals are kept
+ * in a ring, as long as the longest window. Each window keeps a running
+ * total, to which an interval is added when it ends and from which it is
+ * subtracted once it falls out of the window, so that updating a window
+ * costs O(histogram buckets), whatever its length.
+ */
+
+struct WindowStatistics {
+	Histogram latencies; /*< of successful requests, in nanoseconds */
+	uint64_t numRequests;
+	uint64_t numErrors;
+	double duration; /*< seconds actually covered, less than the window's length at first */
+
+	explicit WindowStatistics(int histogramDigits) :
+		latencies(histogramDigits),
+		numRequests(0),
+		numErrors(0),
+		duration(0)
+	{
+	}
+};
+
+/* Parse window lengths in seconds, such as "10,60"; throws std::invalid_argument on errors */
+inline std::vector<double> parseWindows(const std::string &list)
+{
+	std::vector<double> lengths;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string item = list.substr(start, end - start);
+		start = end + 1;
+
+		char *rest;
+		double length = strtod(item.c_str(), &rest);
+		if (item.empty() || (*rest != '\0' && std::string(rest) != "s") || !(length > 0))
+			throw std::invalid_argument("invalid window length '" + item + "'");
+		lengths.push_back(length);
+	}
+	return lengths;
+}
+
+class SlidingWindows {
+public:
+	/* Windows of the given lengths in seconds, rounded to whole report intervals */
+	SlidingWindows(const std::vector<double> &lengths, double interval, int histogramDigits) :
+		histogramDigits(histogramDigits)
+	{
+		for (double length : lengths) {
+			Window w = { length, std::max(1, (int)std::lround(length / interval)), WindowStatistics(histogramDigits) };
+			windows.push_back(w);
+		}
+	}
+
+	size_t size() const { return windows.size(); }
+
+	/* Length of window i in seconds, as requested */
+	double length(size_t i) const { return windows[i].length; }
+
+	/* Statistics of window i, updated by addInterval() */
+	const WindowStatistics &statistics(size_t i) const { return windows[i].total; }
+
+	/* Account for a report interval of dt seconds that just ended */
+	void addInterval(const Histogram &latencies, uint64_t requests, uint64_t errors, double dt)
+	{
+		if (windows.empty())
+			return;
+		ring.push_back(WindowStatistics(histogramDigits));
+		WindowStatistics &slot = ring.back();
+		slot.latencies.add(latencies);
+		slot.numRequests = requests;
+		slot.numErrors = errors;
+		slot.duration = dt;
+
+		size_t maxIntervals = 0;
+		for (Window &w : windows) {
+			add(w.total, slot);
+			if (ring.size() > (size_t)w.numIntervals)
+				subtract(w.total, ring[ring.size() - 1 - w.numIntervals]);
+			maxIntervals = std::max(maxIntervals, (size_t)w.numIntervals);
+		}
+		if (ring.size() > maxIntervals)
+			ring.pop_front(); /* left all windows */
+	}
+
+private:
+	struct Window {
+		double length;
+		int numIntervals;
+		WindowStatistics total;
+	};
+
+	static void add(WindowStatistics &total, const WindowStatistics &interval)
+	{
+		total.latencies.add(interval.latencies);
+		total.numRequests += interval.numRequests;
+		total.numErrors += interval.numErrors;
+		total.duration += interval.duration;
+	}
+
+	static void subtract(WindowStatistics &total, const WindowStatistics &interval)
+	{
+		total.latencies.subtract(interval.latencies);
+		total.numRequests -= interval.numRequests;
+		total.numErrors -= interval.numErrors;
+		total.duration -= interval.duration;
+	}
+
+	const int histogramDigits;
+	std::vector<Window> windows;
+	std::deque<WindowStatistics> ring; /* the most recent intervals, oldest first */
+};
+
+#endif
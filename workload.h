@@ -0,0 +1,310 @@
+#ifndef HTTPMON_WORKLOAD_H
+#define HTTPMON_WORKLOAD_H
+
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <curl/curl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "corpus.h"
+
+/*
+ * Workloads
+ *
+ * A workload is a weighted mix of request templates. Templates are described
+ * by RequestSpecs, either derived from the command-line (a single template),
+ * or read from a workload file, e.g.:
+ *
+ *     [login]
+ *     weight = 1
+ *     method = POST
+ *     url = http://example.com/login
+ *     header = Content-Type: application/json
+ *     body-file = login.json
+ *
+ *     [home]
+ *     weight = 9
+ *     url = http://example.com/
+ *
+ *     [upload]
+ *     url = http://example.com/upload
+ *     body-corpus = uploads/
+ *     body-order = random
+ *
+ * Everything that does not change from one request to the next, such as
+ * header lists, is built once. Clients pick templates using Walker's alias
+ * method, in constant time.
+ */
+
+struct RequestSpec {
+	std::string name;
+	double weight;
+	std::string method;
+	std::string url;
+	std::vector<std::string> headers;
+	std::string body;
+	bool hasBody; /* send body, even if empty */
+	std::shared_ptr<const BodyCorpus> corpus; /* if not NULL, send bodies from it instead */
+};
+
+/*
+ * Configure a CURL handle to send a request with a body read from a corpus;
+ * its size is set for each request, see BodyCorpus.
+ */
+inline void applyCorpusRequest(CURL *curl, const std::string &method, const std::string &url,
+	struct curl_slist *headers)
+{
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, 0L);
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, method == "POST" ? NULL : method.c_str());
+}
+
+/*
+ * Configure a CURL handle to send a request; body may be NULL. The body and
+ * headers must outlive the request, CURL does not copy them.
+ */
+inline void applyRequest(CURL *curl, const std::string &method, const std::string &url,
+	const std::string *body, struct curl_slist *headers)
+{
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	if (body) {
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)body->size());
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->c_str());
+	}
+	else {
+		curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+	}
+	curl_easy_setopt(curl, CURLOPT_NOBODY, method == "HEAD" ? 1L : 0L);
+	bool standardMethod = body ? (method == "POST") : (method == "GET" || method == "HEAD");
+	curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, standardMethod ? NULL : method.c_str());
+}
+
+struct RequestTemplate {
+	std::string name;
+	double weight;
+	std::string method;
+	std::string url;
+	std::string body;
+	bool hasBody;
+	std::shared_ptr<const BodyCorpus> corpus;
+	struct curl_slist *headers;
+
+	RequestTemplate(const RequestSpec &spec, bool compressed, bool decode) :
+		name(spec.name),
+		weight(spec.weight),
+		method(spec.method),
+		url(spec.url),
+		body(spec.body),
+		hasBody(spec.hasBody),
+		corpus(spec.corpus),
+		headers(NULL)
+	{
+		if (decode)
+			headers = curl_slist_append(headers, "Accept-Encoding: gzip, deflate, br");
+		else if (compressed)
+			headers = curl_slist_append(headers, "Accept-Encoding: gzip");
+		if (corpus)
+			headers = curl_slist_append(headers, "Expect:"); /* do not wait for 100 Continue before large bodies */
+		for (const std::string &header : spec.headers)
+			headers = curl_slist_append(headers, header.c_str());
+	}
+
+	~RequestTemplate()
+	{
+		curl_slist_free_all(headers);
+	}
+
+	/* Configure a CURL handle to send this request */
+	void apply(CURL *curl) const
+	{
+		if (corpus)
+			applyCorpusRequest(curl, method, url, headers);
+		else
+			applyRequest(curl, method, url, hasBody ? &body : NULL, headers);
+	}
+
+private:
+	RequestTemplate(const RequestTemplate &);
+	RequestTemplate &operator=(const RequestTemplate &);
+};
+
+class Workload {
+public:
+	/* With decode, ask for any encoding httpmon can decode (see decoder.h) */
+	Workload(const std::vector<RequestSpec> &specs, bool compressed, bool decode)
+	{
+		for (const RequestSpec &spec : specs)
+			templates.emplace_back(new RequestTemplate(spec, compressed, decode));
+		buildAliasTable();
+	}
+
+	size_t size() const { return templates.size(); }
+	const RequestTemplate &operator[](size_t i) const { return *templates[i]; }
+
+	/* Pick a template index according to weights */
+	template<typename RNG>
+	size_t pick(RNG &rng) const
+	{
+		if (templates.size() == 1)
+			return 0; /* do not disturb the random number sequence */
+		double u = std::uniform_real_distribution<double>(0, templates.size())(rng);
+		size_t i = std::min((size_t)u, templates.size() - 1);
+		return (u - i < probability[i]) ? i : alias[i];
+	}
+
+private:
+	/* Vose's variant of Walker's alias method */
+	void buildAliasTable()
+	{
+		size_t n = templates.size();
+		double totalWeight = 0;
+		for (auto &t : templates)
+			totalWeight += t->weight;
+
+		probability.resize(n);
+		alias.resize(n);
+		std::vector<double> scaled(n);
+		std::vector<size_t> small, large;
+		for (size_t i = 0; i < n; i++) {
+			scaled[i] = templates[i]->weight * n / totalWeight;
+			(scaled[i] < 1 ? small : large).push_back(i);
+		}
+		while (!small.empty() && !large.empty()) {
+			size_t s = small.back(), l = large.back();
+			small.pop_back();
+			large.pop_back();
+			probability[s] = scaled[s];
+			alias[s] = l;
+			scaled[l] -= 1 - scaled[s];
+			(scaled[l] < 1 ? small : large).push_back(l);
+		}
+		/* Remaining entries are 1, up to rounding errors */
+		for (size_t i : small) { probability[i] = 1; alias[i] = i; }
+		for (size_t i : large) { probability[i] = 1; alias[i] = i; }
+	}
+
+	std::vector<std::unique_ptr<RequestTemplate>> templates;
+	std::vector<double> probability;
+	std::vector<size_t> alias;
+};
+
+/* Read a file entirely, e.g., a request body */
+inline std::string readFile(const std::string &path)
+{
+	std::ifstream f(path, std::ios::binary);
+	if (!f)
+		throw std::runtime_error("cannot read '" + path + "'");
+	return std::string(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+}
+
+/* Resolve a path given in a file, e.g., a body file, relative to that file's directory */
+inline std::string relativeTo(const std::string &file, const std::string &path)
+{
+	size_t slash = file.rfind('/');
+	if (path.empty() || path[0] == '/' || slash == std::string::npos)
+		return path;
+	return file.substr(0, slash + 1) + path;
+}
+
+/*
+ * Parse a workload file, see above; throws on errors. Relative body files
+ * and corpora are resolved against the workload file's directory. Body
+ * corpora are picked from in bodyOrder, unless a template sets body-order.
+ */
+inline std::vector<RequestSpec> readWorkloadFile(const std::string &path, BodyOrder bodyOrder, uint64_t bodySeed)
+{
+	namespace po = boost::program_options;
+
+	std::ifstream f(path);
+	if (!f)
+		throw std::runtime_error("cannot read workload file '" + path + "'");
+	po::options_description none;
+	po::parsed_options parsed = po::parse_config_file(f, none, true);
+
+	std::vector<RequestSpec> specs;
+	std::vector<std::string> corpusPaths; /* per spec */
+	std::vector<BodyOrder> corpusOrders;
+	for (const po::option &option : parsed.options) {
+		size_t dot = option.string_key.find('.');
+		if (dot == std::string::npos)
+			throw std::runtime_error("key '" + option.string_key + "' outside of a [template] section");
+		std::string name = option.string_key.substr(0, dot);
+		std::string key = option.string_key.substr(dot + 1);
+		std::string value = option.value.empty() ? "" : option.value[0];
+
+		auto it = std::find_if(specs.begin(), specs.end(),
+			[&name](const RequestSpec &spec) { return spec.name == name; });
+		if (it == specs.end()) {
+			RequestSpec spec;
+			spec.name = name;
+			spec.weight = 1;
+			spec.method = "GET";
+			spec.hasBody = false;
+			specs.push_back(spec);
+			corpusPaths.push_back("");
+			corpusOrders.push_back(bodyOrder);
+			it = specs.end() - 1;
+		}
+		RequestSpec &spec = *it;
+		size_t index = it - specs.begin();
+
+		if (key == "weight")
+			spec.weight = std::stod(value);
+		else if (key == "method")
+			spec.method = value;
+		else if (key == "url")
+			spec.url = value;
+		else if (key == "header")
+			spec.headers.push_back(value);
+		else if (key == "body") {
+			spec.body = value;
+			spec.hasBody = true;
+		}
+		else if (key == "body-file") {
+			spec.body = readFile(relativeTo(path, value));
+			spec.hasBody = true;
+		}
+		else if (key == "body-corpus") {
+			corpusPaths[index] = relativeTo(path, value);
+			spec.hasBody = true;
+		}
+		else if (key == "body-order") {
+			try {
+				corpusOrders[index] = parseBodyOrder(value);
+			}
+			catch (const std::invalid_argument &e) {
+				throw std::runtime_error(std::string(e.what()) + " in template '" + name + "'");
+			}
+		}
+		else
+			throw std::runtime_error("unknown key '" + key + "' in template '" + name + "'");
+	}
+
+	if (specs.empty())
+		throw std::runtime_error("workload file '" + path + "' defines no templates");
+	for (size_t i = 0; i < specs.size(); i++) {
+		RequestSpec &spec = specs[i];
+		if (!corpusPaths[i].empty())
+			spec.corpus.reset(new BodyCorpus(corpusPaths[i], corpusOrders[i], bodySeed));
+		if (spec.url.empty())
+			throw std::runtime_error("template '" + spec.name + "' has no url");
+		if (spec.weight <= 0)
+			throw std::runtime_error("template '" + spec.name + "' must have a positive weight");
+		if (spec.hasBody && spec.method == "GET")
+			spec.method = "POST";
+	}
+	return specs;
+}
+
+#endif